@@ -0,0 +1,1076 @@
+/*
+ * The process in the flask.
+ *
+ * Copyright (c) 2013, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <spawn.h>
+#include <sched.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+#include <termios.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "printf.h"
+#include "util.h"
+
+#define BENCH_MAX_ARGS  4
+#define BENCH_MAX_EXTRA 16
+
+struct bench_config {
+    const char *name;
+    const char *args[BENCH_MAX_ARGS];
+
+    bool chroot;
+};
+
+struct bench_result {
+    unsigned int runs;
+    unsigned int failed;
+
+    uint64_t total;
+
+    uint64_t *exec;
+    uint64_t *reap;
+};
+
+enum relay_dir {
+    RELAY_OUT,
+    RELAY_IN,
+    RELAY_ECHO,
+};
+
+struct relay_config {
+    const char *name;
+    enum relay_dir dir;
+
+    /* whether pflask's stdout is a file rather than a pipe */
+    bool file;
+
+    /* whether the data goes through a detached pflask and a client
+     * attached to it, rather than a single pflask */
+    bool attach;
+};
+
+struct relay_result {
+    double rate;
+
+    unsigned int keys;
+    uint64_t *lat;
+
+    /* CPU time used by the pflask processes, in clock ticks */
+    uint64_t usr;
+    uint64_t sys;
+};
+
+/* what the container's output is compared against: the peer only writes
+ * what the benchmark expects, so counting the bytes is enough */
+struct relay_out {
+    int fd;
+    bool file;
+
+    pid_t pid;
+
+    uint64_t seen;
+};
+
+static const char *pflask = "pflask";
+static const char *rootfs = NULL;
+
+static char *extra_args[BENCH_MAX_EXTRA];
+static size_t extra_count = 0;
+
+/* a "%u" in one of the config's args is replaced by a unique run number,
+ * so that e.g. veth names don't clash with the ones still being deleted */
+static unsigned int run_id = 0;
+
+static char cgroup_arg[64] = "--cgroup=unified";
+
+static struct bench_config configs[] = {
+    { "default",    { NULL },                         false },
+    { "no-userns",  { "--no-userns" },                false },
+    { "no-mountns", { "--no-mountns" },               false },
+    { "no-netns",   { "--no-netns" },                 false },
+    { "no-ipcns",   { "--no-ipcns" },                 false },
+    { "no-utsns",   { "--no-utsns" },                 false },
+    { "no-pidns",   { "--no-pidns" },                 false },
+    { "chroot",     { NULL },                         true  },
+    { "ephemeral",  { "--ephemeral" },                true  },
+    { "netif-veth", { "--netif=veth:pfb%u:eth0" },   false },
+    { "user-map",   { "--user-map=0:100000:65536" },  false },
+    { "cgroup",     { cgroup_arg },                   false },
+};
+
+static struct relay_config relay_configs[] = {
+    { "out-pipe",         RELAY_OUT,  false, false },
+    { "out-file",         RELAY_OUT,  true,  false },
+    { "in-pipe",          RELAY_IN,   false, false },
+    { "in-file",          RELAY_IN,   true,  false },
+    { "echo-pipe",        RELAY_ECHO, false, false },
+    { "echo-file",        RELAY_ECHO, true,  false },
+    { "attach-out-pipe",  RELAY_OUT,  false, true  },
+    { "attach-out-file",  RELAY_OUT,  true,  true  },
+    { "attach-in-pipe",   RELAY_IN,   false, true  },
+    { "attach-in-file",   RELAY_IN,   true,  true  },
+    { "attach-echo-pipe", RELAY_ECHO, false, true  },
+    { "attach-echo-file", RELAY_ECHO, true,  true  },
+};
+
+static uint64_t bench_now(void);
+static bool bench_run(struct bench_config *cfg, char **cmd, int timings_fd,
+                      const char *timings_path, uint64_t *exec,
+                      uint64_t *reap);
+static pid_t bench_spawn(char **argv, int in_fd, int out_fd, int err_fd);
+static bool bench_phase(const char *buf, const char *name, uint64_t *begin,
+                        uint64_t *duration);
+static void bench_print(struct bench_config *cfg, struct bench_result *r);
+static int bench_cmp(const void *a, const void *b);
+static double bench_pct(uint64_t *v, unsigned int count, unsigned int p);
+static int bench_relay(const char *only, uint64_t size, unsigned int keys);
+static bool relay_run(struct relay_config *cfg, const char *self,
+                      uint64_t size, struct relay_result *r);
+static pid_t relay_attach(pid_t pid, int in_fd, int out_fd, int null_fd);
+static pid_t relay_find_child(void);
+static bool relay_expect(struct relay_out *o, uint64_t count);
+static bool relay_reap(pid_t pid, struct relay_result *r);
+static void relay_print(struct relay_config *cfg, struct relay_result *r,
+                        bool ok);
+static int relay_peer(const char *role, uint64_t count);
+static void bench_write(int fd, const char *buf, size_t len);
+static void help(void);
+
+int main(int argc, char *argv[]) {
+    int rc;
+
+    unsigned int runs = 100;
+
+    bool relay = false;
+    uint64_t size = 64;
+    unsigned int keys = 1000;
+
+    const char *only = NULL;
+
+    _close_ int timings_fd = -1;
+    char timings_path[] = "/tmp/pflask-bench-XXXXXX";
+
+    char *def_cmd[] = { "true", NULL };
+    char **cmd = def_cmd;
+
+    static struct option long_opts[] = {
+        { "runs",   required_argument, NULL, 'n' },
+        { "pflask", required_argument, NULL, 'p' },
+        { "chroot", required_argument, NULL, 'r' },
+        { "cgroup", required_argument, NULL, 'g' },
+        { "only",   required_argument, NULL, 'o' },
+        { "arg",    required_argument, NULL, 'a' },
+        { "relay",  no_argument,       NULL, 'R' },
+        { "size",   required_argument, NULL, 's' },
+        { "keys",   required_argument, NULL, 'k' },
+        { "help",   no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    /* the producer and consumer run inside the containers by --relay are
+     * pflask-bench itself */
+    if ((argc == 4) && !strcmp(argv[1], "--relay-peer"))
+        return relay_peer(argv[2], strtoull(argv[3], NULL, 10));
+
+    while ((rc = getopt_long(argc, argv, "+n:p:r:g:o:a:Rs:k:h",
+                             long_opts, NULL)) != -1) {
+        switch (rc) {
+        case 'n':
+            runs = strtoul(optarg, NULL, 10);
+            fail_if(!runs, "Invalid number of runs '%s'", optarg);
+            break;
+
+        case 'p':
+            pflask = optarg;
+            break;
+
+        case 'r':
+            rootfs = optarg;
+            break;
+
+        case 'g':
+            rc = snprintf(cgroup_arg, sizeof(cgroup_arg),
+                          "--cgroup=%s", optarg);
+            fail_if(rc >= (int) sizeof(cgroup_arg),
+                    "Invalid controller '%s'", optarg);
+            break;
+
+        case 'o':
+            only = optarg;
+            break;
+
+        case 'a':
+            fail_if(extra_count >= BENCH_MAX_EXTRA, "Too many args");
+            extra_args[extra_count++] = optarg;
+            break;
+
+        case 'R':
+            relay = true;
+            break;
+
+        case 's':
+            size = strtoull(optarg, NULL, 10);
+            fail_if(!size, "Invalid size '%s'", optarg);
+            break;
+
+        case 'k':
+            keys = strtoul(optarg, NULL, 10);
+            fail_if(!keys, "Invalid number of keys '%s'", optarg);
+            break;
+
+        case 'h':
+            help();
+            return 0;
+
+        default:
+            help();
+            return 1;
+        }
+    }
+
+    if (relay)
+        return bench_relay(only, size * 1024 * 1024, keys);
+
+    if (optind < argc)
+        cmd = argv + optind;
+
+    timings_fd = mkstemp(timings_path);
+    sys_fail_if(timings_fd < 0, "Error creating '%s'", timings_path);
+
+    printf("%-12s %6s %6s %9s %26s %26s\n", "config", "runs", "failed",
+           "cont/s", "launch-to-exec p50/95/99", "exit-to-reap p50/95/99");
+
+    for (size_t i = 0; i < sizeof(configs) / sizeof(*configs); i++) {
+        struct bench_config *cfg = &configs[i];
+        struct bench_result r = { 0 };
+
+        _free_ uint64_t *exec = NULL;
+        _free_ uint64_t *reap = NULL;
+
+        uint64_t start;
+
+        if (only && strcmp(only, cfg->name))
+            continue;
+
+        if (cfg->chroot && !rootfs)
+            continue;
+
+        exec = calloc(runs, sizeof(*exec));
+        fail_if(!exec, "OOM");
+
+        reap = calloc(runs, sizeof(*reap));
+        fail_if(!reap, "OOM");
+
+        r.exec = exec;
+        r.reap = reap;
+
+        start = bench_now();
+
+        for (unsigned int j = 0; j < runs; j++) {
+            if (bench_run(cfg, cmd, timings_fd, timings_path,
+                          &exec[r.runs], &reap[r.runs]))
+                r.runs++;
+            else
+                r.failed++;
+        }
+
+        r.total = bench_now() - start;
+
+        bench_print(cfg, &r);
+    }
+
+    unlink(timings_path);
+
+    return 0;
+}
+
+static uint64_t bench_now(void) {
+    int rc;
+    struct timespec ts;
+
+    rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+    sys_fail_if(rc < 0, "clock_gettime()");
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool bench_run(struct bench_config *cfg, char **cmd, int timings_fd,
+                      const char *timings_path, uint64_t *exec,
+                      uint64_t *reap) {
+    int rc, status;
+
+    pid_t pid;
+
+    char buf[4096];
+    ssize_t len = 0;
+
+    uint64_t start, end;
+    uint64_t clock_start, exec_begin, reap_begin, duration;
+
+    _close_ int master_fd = -1;
+    _close_ int slave_fd = -1;
+
+    _free_ char *timings_arg = NULL;
+    _free_ char *timings = NULL;
+
+    struct stat sb;
+
+    _free_ char *run_arg = NULL;
+
+    _free_ char **argv = NULL;
+    size_t argc = 0;
+
+    size_t cmd_len = 0;
+
+    while (cmd[cmd_len])
+        cmd_len++;
+
+    argv = calloc(BENCH_MAX_ARGS + BENCH_MAX_EXTRA + cmd_len + 5,
+                  sizeof(*argv));
+    fail_if(!argv, "OOM");
+
+    rc = asprintf(&timings_arg, "--timings=%s", timings_path);
+    fail_if(rc < 0, "OOM");
+
+    argv[argc++] = (char *) pflask;
+    argv[argc++] = timings_arg;
+
+    if (cfg->chroot) {
+        argv[argc++] = "--chroot";
+        argv[argc++] = (char *) rootfs;
+    }
+
+    for (size_t i = 0; i < extra_count; i++)
+        argv[argc++] = extra_args[i];
+
+    for (size_t i = 0; i < BENCH_MAX_ARGS && cfg->args[i]; i++) {
+        if (!run_arg && strstr(cfg->args[i], "%u")) {
+            rc = asprintf(&run_arg, cfg->args[i], run_id);
+            fail_if(rc < 0, "OOM");
+
+            argv[argc++] = run_arg;
+            continue;
+        }
+
+        argv[argc++] = (char *) cfg->args[i];
+    }
+
+    run_id++;
+
+    argv[argc++] = "--";
+
+    for (size_t i = 0; i < cmd_len; i++)
+        argv[argc++] = cmd[i];
+
+    rc = ftruncate(timings_fd, 0);
+    sys_fail_if(rc < 0, "Error truncating '%s'", timings_path);
+
+    /* pflask wants a terminal on its stdin */
+    master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    sys_fail_if(master_fd < 0, "posix_openpt()");
+
+    rc = grantpt(master_fd);
+    sys_fail_if(rc < 0, "grantpt()");
+
+    rc = unlockpt(master_fd);
+    sys_fail_if(rc < 0, "unlockpt()");
+
+    slave_fd = open(ptsname(master_fd), O_RDWR | O_NOCTTY | O_CLOEXEC);
+    sys_fail_if(slave_fd < 0, "Error opening slave pty");
+
+    start = bench_now();
+
+    pid = bench_spawn(argv, slave_fd, slave_fd, slave_fd);
+
+    closep(&slave_fd);
+
+    /* drain the output until pflask closes the terminal */
+    do {
+        len = read(master_fd, buf, sizeof(buf));
+    } while (len > 0 || (len < 0 && errno == EINTR));
+
+    rc = waitpid(pid, &status, 0);
+    sys_fail_if(rc < 0, "Error waiting for pflask");
+
+    end = bench_now();
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return false;
+
+    /* the records grow with the phases enabled, so the whole file is read
+     * rather than a fixed amount of it */
+    rc = fstat(timings_fd, &sb);
+    sys_fail_if(rc < 0, "Error reading '%s'", timings_path);
+
+    timings = malloc(sb.st_size + 1);
+    fail_if(!timings, "OOM");
+
+    len = pread(timings_fd, timings, sb.st_size, 0);
+    sys_fail_if(len < 0, "Error reading '%s'", timings_path);
+
+    timings[len] = '\0';
+
+    if (sscanf(timings,
+               "{\"pid\":%*d,\"clock\":\"monotonic\",\"start_ns\":%" SCNu64,
+               &clock_start) != 1)
+        return false;
+
+    if (!bench_phase(timings, "exec", &exec_begin, &duration))
+        return false;
+
+    if (!bench_phase(timings, "reap", &reap_begin, &duration))
+        return false;
+
+    *exec = clock_start + exec_begin - start;
+    *reap = end - (clock_start + reap_begin);
+
+    return true;
+}
+
+static pid_t bench_spawn(char **argv, int in_fd, int out_fd, int err_fd) {
+    int rc;
+
+    pid_t pid;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+
+    rc = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (rc != 0) {
+        errno = rc;
+        sysf_printf("Error executing '%s'", argv[0]);
+    }
+
+    return pid;
+}
+
+static bool bench_phase(const char *buf, const char *name, uint64_t *begin,
+                        uint64_t *duration) {
+    int rc;
+
+    _free_ char *needle = NULL;
+
+    const char *phase;
+
+    rc = asprintf(&needle, "{\"name\":\"%s\",", name);
+    fail_if(rc < 0, "OOM");
+
+    phase = strstr(buf, needle);
+    if (!phase)
+        return false;
+
+    phase = strstr(phase, "\"begin_ns\":");
+    if (!phase)
+        return false;
+
+    return sscanf(phase, "\"begin_ns\":%" SCNu64 ",\"duration_ns\":%" SCNu64,
+                  begin, duration) == 2;
+}
+
+static void bench_print(struct bench_config *cfg, struct bench_result *r) {
+    char exec[32], reap[32];
+
+    double rate = 0;
+
+    if (r->runs) {
+        rate = r->runs / (r->total / 1e9);
+
+        qsort(r->exec, r->runs, sizeof(*r->exec), bench_cmp);
+        qsort(r->reap, r->runs, sizeof(*r->reap), bench_cmp);
+    }
+
+    snprintf(exec, sizeof(exec), "%.2f/%.2f/%.2f ms",
+             bench_pct(r->exec, r->runs, 50),
+             bench_pct(r->exec, r->runs, 95),
+             bench_pct(r->exec, r->runs, 99));
+
+    snprintf(reap, sizeof(reap), "%.2f/%.2f/%.2f ms",
+             bench_pct(r->reap, r->runs, 50),
+             bench_pct(r->reap, r->runs, 95),
+             bench_pct(r->reap, r->runs, 99));
+
+    printf("%-12s %6u %6u %9.2f %26s %26s\n", cfg->name, r->runs,
+           r->failed, rate, exec, reap);
+
+    fflush(stdout);
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile, in milliseconds */
+static double bench_pct(uint64_t *v, unsigned int count, unsigned int p) {
+    unsigned int i;
+
+    if (!count)
+        return 0;
+
+    i = (p * count + 99) / 100;
+
+    return v[i ? i - 1 : 0] / 1e6;
+}
+
+static void help(void) {
+    puts("Usage: pflask-bench [OPTIONS] [-- COMMAND [ARGS...]]\n");
+
+    puts("Options:");
+    puts("  -n, --runs=<count>     Containers to spawn for each config");
+    puts("  -p, --pflask=<path>    The pflask executable to benchmark");
+    puts("  -r, --chroot=<dir>     Root directory for the chroot configs");
+    puts("  -g, --cgroup=<name>    Controller for the cgroup config");
+    puts("  -o, --only=<config>    Only run the given config");
+    puts("  -a, --arg=<arg>        Pass an extra argument to every pflask");
+    puts("  -R, --relay            Benchmark the terminal relay instead");
+    puts("  -s, --size=<MiB>       Data moved each way by the relay benchmark");
+    puts("  -k, --keys=<count>     Keystrokes echoed by the relay benchmark");
+    puts("  -h, --help             Show this help");
+}
+
+static int bench_relay(const char *only, uint64_t size, unsigned int keys) {
+    int rc;
+
+    char self[PATH_MAX];
+    ssize_t len;
+
+    len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    sys_fail_if(len < 0, "readlink(/proc/self/exe)");
+
+    self[len] = '\0';
+
+    /* a detached pflask is re-parented to the benchmark, so that its CPU
+     * time can still be read once it exits */
+    rc = prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+    sys_fail_if(rc < 0, "prctl(PR_SET_CHILD_SUBREAPER)");
+
+    printf("%-17s %9s %26s %18s\n", "config", "MB/s",
+           "echo p50/95/99", "cpu usr/sys");
+
+    for (size_t i = 0; i < sizeof(relay_configs) / sizeof(*relay_configs);
+         i++) {
+        struct relay_config *cfg = &relay_configs[i];
+        struct relay_result r = { 0 };
+
+        _free_ uint64_t *lat = NULL;
+
+        bool ok;
+
+        if (only && strcmp(only, cfg->name))
+            continue;
+
+        if (cfg->dir == RELAY_ECHO) {
+            lat = calloc(keys, sizeof(*lat));
+            fail_if(!lat, "OOM");
+
+            r.lat  = lat;
+            r.keys = keys;
+        }
+
+        ok = relay_run(cfg, self, size, &r);
+
+        relay_print(cfg, &r, ok);
+    }
+
+    return 0;
+}
+
+static bool relay_run(struct relay_config *cfg, const char *self,
+                      uint64_t size, struct relay_result *r) {
+    int rc;
+
+    pid_t pid, server = -1;
+
+    char buf[65536];
+
+    char size_arg[32];
+
+    uint64_t start, end;
+
+    bool ok = true;
+
+    _close_ int master_fd = -1;
+    _close_ int slave_fd = -1;
+    _close_ int null_fd = -1;
+    _close_ int out_fd = -1;
+    _close_ int out_w = -1;
+
+    _free_ char **argv = NULL;
+    size_t argc = 0;
+
+    struct relay_out out = { 0 };
+
+    const char *roles[] = { "out", "in", "echo" };
+
+    argv = calloc(BENCH_MAX_EXTRA + 8, sizeof(*argv));
+    fail_if(!argv, "OOM");
+
+    snprintf(size_arg, sizeof(size_arg), "%" PRIu64, size);
+
+    argv[argc++] = (char *) pflask;
+
+    for (size_t i = 0; i < extra_count; i++)
+        argv[argc++] = extra_args[i];
+
+    if (cfg->attach)
+        argv[argc++] = "--detach";
+
+    argv[argc++] = "--";
+    argv[argc++] = (char *) self;
+    argv[argc++] = "--relay-peer";
+    argv[argc++] = (char *) roles[cfg->dir];
+    argv[argc++] = size_arg;
+
+    /* pflask wants a terminal on its stdin */
+    master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    sys_fail_if(master_fd < 0, "posix_openpt()");
+
+    rc = grantpt(master_fd);
+    sys_fail_if(rc < 0, "grantpt()");
+
+    rc = unlockpt(master_fd);
+    sys_fail_if(rc < 0, "unlockpt()");
+
+    slave_fd = open(ptsname(master_fd), O_RDWR | O_NOCTTY | O_CLOEXEC);
+    sys_fail_if(slave_fd < 0, "Error opening slave pty");
+
+    null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    sys_fail_if(null_fd < 0, "Error opening /dev/null");
+
+    if (cfg->file) {
+        char path[] = "/tmp/pflask-bench-XXXXXX";
+
+        out_fd = mkostemp(path, O_CLOEXEC);
+        sys_fail_if(out_fd < 0, "Error creating '%s'", path);
+
+        unlink(path);
+
+        out_w = dup(out_fd);
+        sys_fail_if(out_w < 0, "dup()");
+    } else {
+        int fds[2];
+
+        rc = pipe2(fds, O_CLOEXEC);
+        sys_fail_if(rc < 0, "pipe2()");
+
+        out_fd = fds[0];
+        out_w  = fds[1];
+    }
+
+    if (cfg->attach) {
+        int status;
+
+        server = bench_spawn(argv, slave_fd, null_fd, null_fd);
+
+        rc = waitpid(server, &status, 0);
+        sys_fail_if(rc < 0, "Error waiting for pflask");
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            return false;
+
+        /* the detached pflask is the child of the one that just exited */
+        server = relay_find_child();
+        if (server < 0)
+            return false;
+
+        pid = relay_attach(server, slave_fd, out_w, null_fd);
+    } else {
+        pid = bench_spawn(argv, slave_fd, out_w, null_fd);
+    }
+
+    closep(&out_w);
+
+    out.fd   = out_fd;
+    out.file = cfg->file;
+    out.pid  = pid;
+
+    /* the peer says when the container's terminal is ready, and then
+     * waits for a byte before starting */
+    if (pid < 0 || !relay_expect(&out, 1)) {
+        ok = false;
+        goto done;
+    }
+
+    memset(buf, 'x', sizeof(buf));
+
+    start = bench_now();
+
+    bench_write(master_fd, "g", 1);
+
+    switch (cfg->dir) {
+    case RELAY_OUT:
+        ok = relay_expect(&out, 1 + size);
+        break;
+
+    case RELAY_IN:
+        for (uint64_t left = size; left; ) {
+            size_t len = MIN(left, sizeof(buf));
+
+            bench_write(master_fd, buf, len);
+            left -= len;
+        }
+
+        /* the peer acknowledges once it has read all of it */
+        ok = relay_expect(&out, 2);
+        break;
+
+    case RELAY_ECHO:
+        for (unsigned int i = 0; ok && (i < r->keys); i++) {
+            uint64_t key = bench_now();
+
+            bench_write(master_fd, "x", 1);
+
+            ok = relay_expect(&out, 2 + i);
+
+            r->lat[i] = bench_now() - key;
+        }
+
+        bench_write(master_fd, "q", 1);
+        break;
+    }
+
+    end = bench_now();
+
+    if (cfg->dir != RELAY_ECHO)
+        r->rate = size / ((end - start) / 1e9) / 1e6;
+
+done:
+    if (pid > 0)
+        ok = relay_reap(pid, r) && ok;
+
+    if (server > 0)
+        ok = relay_reap(server, r) && ok;
+
+    return ok;
+}
+
+/* The detached pflask only starts listening once the container is set up,
+ * so attaching is retried until the client doesn't fail right away. */
+static pid_t relay_attach(pid_t pid, int in_fd, int out_fd, int null_fd) {
+    char attach_arg[32];
+
+    char *argv[BENCH_MAX_EXTRA + 3];
+    size_t argc = 0;
+
+    snprintf(attach_arg, sizeof(attach_arg), "--attach=%d", pid);
+
+    argv[argc++] = (char *) pflask;
+
+    for (size_t i = 0; i < extra_count; i++)
+        argv[argc++] = extra_args[i];
+
+    argv[argc++] = attach_arg;
+    argv[argc++] = NULL;
+
+    for (unsigned int i = 0; i < 100; i++) {
+        int rc, status;
+
+        struct timespec delay = { 0, 20 * 1000 * 1000 };
+
+        pid_t client = bench_spawn(argv, in_fd, out_fd, null_fd);
+
+        nanosleep(&delay, NULL);
+
+        rc = waitpid(client, &status, WNOHANG);
+        sys_fail_if(rc < 0, "Error waiting for pflask");
+
+        if (rc == 0)
+            return client;
+    }
+
+    return -1;
+}
+
+static pid_t relay_find_child(void) {
+    DIR *dir;
+
+    struct dirent *de;
+
+    pid_t child = -1;
+
+    dir = opendir("/proc");
+    sys_fail_if(!dir, "Error opening /proc");
+
+    while ((de = readdir(dir))) {
+        FILE *f;
+
+        char path[PATH_MAX];
+
+        int ppid = -1;
+
+        pid_t pid = strtol(de->d_name, NULL, 10);
+        if (pid <= 0)
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+        f = fopen(path, "re");
+        if (!f)
+            continue;
+
+        if (fscanf(f, "%*d (%*[^)]) %*c %d", &ppid) != 1)
+            ppid = -1;
+
+        fclose(f);
+
+        if (ppid == getpid()) {
+            child = pid;
+            break;
+        }
+    }
+
+    closedir(dir);
+
+    return child;
+}
+
+/* Wait until count bytes in total have come out of the relay. */
+static bool relay_expect(struct relay_out *o, uint64_t count) {
+    char buf[65536];
+
+    ssize_t len;
+
+    while (o->seen < count) {
+        if (o->file) {
+            int rc;
+
+            struct stat sb;
+
+            siginfo_t info = { 0 };
+
+            rc = fstat(o->fd, &sb);
+            sys_fail_if(rc < 0, "fstat()");
+
+            o->seen = sb.st_size;
+            if (o->seen >= count)
+                break;
+
+            rc = waitid(P_PID, o->pid, &info,
+                        WEXITED | WNOHANG | WNOWAIT);
+            sys_fail_if(rc < 0, "Error waiting for pflask");
+
+            /* make sure nothing was written just before it exited */
+            if (info.si_pid) {
+                rc = fstat(o->fd, &sb);
+                sys_fail_if(rc < 0, "fstat()");
+
+                o->seen = sb.st_size;
+                return o->seen >= count;
+            }
+
+            sched_yield();
+            continue;
+        }
+
+        len = read(o->fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR)
+            continue;
+
+        sys_fail_if(len < 0, "Error reading output");
+
+        if (len == 0)
+            return false;
+
+        o->seen += len;
+    }
+
+    return true;
+}
+
+/* Wait for pid to exit, adding up its CPU time before reaping it. */
+static bool relay_reap(pid_t pid, struct relay_result *r) {
+    int rc, status;
+
+    FILE *f;
+
+    char path[64];
+
+    uint64_t usr, sys;
+
+    siginfo_t info;
+
+    rc = waitid(P_PID, pid, &info, WEXITED | WNOWAIT);
+    sys_fail_if(rc < 0, "Error waiting for pflask");
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    f = fopen(path, "re");
+    sys_fail_if(!f, "Error opening '%s'", path);
+
+    rc = fscanf(f, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u "
+                   "%*u %" SCNu64 " %" SCNu64, &usr, &sys);
+    fclose(f);
+
+    if (rc == 2) {
+        r->usr += usr;
+        r->sys += sys;
+    }
+
+    rc = waitpid(pid, &status, 0);
+    sys_fail_if(rc < 0, "Error waiting for pflask");
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void relay_print(struct relay_config *cfg, struct relay_result *r,
+                        bool ok) {
+    char rate[32] = "-", echo[32] = "-", cpu[32];
+
+    double tick = 1000.0 / sysconf(_SC_CLK_TCK);
+
+    if (!ok) {
+        printf("%-17s %9s\n", cfg->name, "failed");
+        fflush(stdout);
+        return;
+    }
+
+    if (r->keys) {
+        qsort(r->lat, r->keys, sizeof(*r->lat), bench_cmp);
+
+        snprintf(echo, sizeof(echo), "%.3f/%.3f/%.3f ms",
+                 bench_pct(r->lat, r->keys, 50),
+                 bench_pct(r->lat, r->keys, 95),
+                 bench_pct(r->lat, r->keys, 99));
+    } else {
+        snprintf(rate, sizeof(rate), "%.2f", r->rate);
+    }
+
+    snprintf(cpu, sizeof(cpu), "%.0f/%.0f ms", r->usr * tick, r->sys * tick);
+
+    printf("%-17s %9s %26s %18s\n", cfg->name, rate, echo, cpu);
+
+    fflush(stdout);
+}
+
+/* Run inside the container: put the terminal in raw mode, say so, wait for
+ * the go byte, and then produce or consume the data. */
+static int relay_peer(const char *role, uint64_t count) {
+    int rc;
+
+    char buf[65536];
+    ssize_t len;
+
+    struct termios attr;
+
+    rc = tcgetattr(STDIN_FILENO, &attr);
+    sys_fail_if(rc < 0, "tcgetattr()");
+
+    cfmakeraw(&attr);
+
+    /* the terminal of a detached container starts out zeroed */
+    attr.c_cc[VMIN]  = 1;
+    attr.c_cc[VTIME] = 0;
+
+    rc = tcsetattr(STDIN_FILENO, TCSANOW, &attr);
+    sys_fail_if(rc < 0, "tcsetattr()");
+
+    bench_write(STDOUT_FILENO, "R", 1);
+
+    len = read(STDIN_FILENO, buf, 1);
+    sys_fail_if(len != 1, "Error reading input");
+
+    if (!strcmp(role, "out")) {
+        memset(buf, 'x', sizeof(buf));
+
+        while (count) {
+            size_t n = MIN(count, sizeof(buf));
+
+            bench_write(STDOUT_FILENO, buf, n);
+            count -= n;
+        }
+    } else if (!strcmp(role, "in")) {
+        while (count) {
+            len = read(STDIN_FILENO, buf, MIN(count, sizeof(buf)));
+            sys_fail_if(len <= 0, "Error reading input");
+
+            count -= len;
+        }
+
+        bench_write(STDOUT_FILENO, "D", 1);
+    } else if (!strcmp(role, "echo")) {
+        while (1) {
+            len = read(STDIN_FILENO, buf, sizeof(buf));
+            sys_fail_if(len <= 0, "Error reading input");
+
+            if (memchr(buf, 'q', len))
+                break;
+
+            bench_write(STDOUT_FILENO, buf, len);
+        }
+    } else {
+        fail_printf("Invalid relay peer '%s'", role);
+    }
+
+    return 0;
+}
+
+static void bench_write(int fd, const char *buf, size_t len) {
+    ssize_t rc;
+
+    while (len) {
+        rc = write(fd, buf, len);
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        sys_fail_if(rc < 0, "Error writing to %d", fd);
+
+        buf += rc;
+        len -= rc;
+    }
+}
@@ -30,9 +30,15 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <stdbool.h>
 #include <string.h>
 
+#include <fcntl.h>
+
 #include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include <linux/magic.h>
 
 #include "ut/utlist.h"
 
@@ -45,11 +51,30 @@ struct cgroup {
     char *controller;
     char *name;
 
+    bool unified;
+
     struct cgroup *next, *prev;
 };
 
-static void create_cgroup(const char *controller, const char *name);
-static void attach_cgroup(const char *controller, const char *name, pid_t pid);
+/* The controllers' directories are opened once and kept open, so that the
+ * containers launched by the same process (e.g. --batch) can create and
+ * destroy their cgroups without resolving the whole path every time. */
+struct cgroup_root {
+    char *controller;
+    int fd;
+
+    struct cgroup_root *next, *prev;
+};
+
+static struct cgroup_root *roots = NULL;
+
+static unsigned int group_count = 0;
+
+static int open_cgroup_root(const char *controller);
+static int create_cgroup(const char *controller, const char *name,
+                         bool *unified);
+static void attach_cgroup(const char *controller, const char *name,
+                          bool unified, pid_t pid);
 static void destroy_cgroup(const char *controller, const char *name);
 
 void cgroup_add(struct cgroup **groups, char *controller) {
@@ -61,19 +86,53 @@ void cgroup_add(struct cgroup **groups, char *controller) {
     fail_if(!cg, "OOM");
 
     cg->controller = strdup(controller);
+    cg->unified    = false;
 
-    rc = asprintf(&cg->name, "pflask.%d", pid);
+    /* every container launched by the same process gets its own set */
+    if (!*groups)
+        group_count++;
+
+    if (group_count > 1)
+        rc = asprintf(&cg->name, "pflask.%d.%u", pid, group_count - 1);
+    else
+        rc = asprintf(&cg->name, "pflask.%d", pid);
     fail_if(rc < 0, "OOM");
 
     DL_APPEND(*groups, cg);
 }
 
-void setup_cgroup(struct cgroup *groups, pid_t pid) {
+int prepare_cgroup(struct cgroup *groups) {
+    int fd = -1;
+
     struct cgroup *i = NULL;
 
     DL_FOREACH(groups, i) {
-        create_cgroup(i->controller, i->name);
-        attach_cgroup(i->controller, i->name, pid);
+        _close_ int cg_fd = create_cgroup(i->controller, i->name,
+                                          &i->unified);
+
+        /* only a cgroup v2 hierarchy can be joined directly with
+         * clone3() */
+        if ((fd < 0) && i->unified) {
+            fd = cg_fd;
+            cg_fd = -1;
+        }
+    }
+
+    return fd;
+}
+
+void setup_cgroup(struct cgroup *groups, pid_t pid, bool joined) {
+    struct cgroup *i = NULL;
+
+    DL_FOREACH(groups, i) {
+        /* the child was created directly inside the first unified
+         * cgroup, see prepare_cgroup() */
+        if (joined && i->unified) {
+            joined = false;
+            continue;
+        }
+
+        attach_cgroup(i->controller, i->name, i->unified, pid);
     }
 }
 
@@ -85,28 +144,76 @@ void clean_cgroup(struct cgroup *groups) {
     }
 }
 
-static void create_cgroup(const char *controller, const char *name) {
+static int open_cgroup_root(const char *controller) {
     int rc;
 
+    struct cgroup_root *r = NULL;
+
     _free_ char *path = NULL;
 
-    rc = asprintf(&path, CGROUP_BASE "/%s/%s", controller, name);
+    DL_FOREACH(roots, r) {
+        if (!strcmp(r->controller, controller))
+            return r->fd;
+    }
+
+    rc = asprintf(&path, CGROUP_BASE "/%s", controller);
     fail_if(rc < 0, "OOM");
 
-    rc = mkdir(path, 0755);
+    r = malloc(sizeof(struct cgroup_root));
+    fail_if(!r, "OOM");
+
+    r->controller = strdup(controller);
+    fail_if(!r->controller, "OOM");
+
+    r->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    sys_fail_if(r->fd < 0, "Error opening cgroup controller '%s'",
+                controller);
+
+    DL_APPEND(roots, r);
+
+    return r->fd;
+}
+
+static int create_cgroup(const char *controller, const char *name,
+                         bool *unified) {
+    int rc;
+
+    int fd;
+
+    struct statfs sb;
+
+    int root_fd = open_cgroup_root(controller);
+
+    rc = mkdirat(root_fd, name, 0755);
     sys_fail_if((rc < 0) && (errno != EEXIST), "Error creating cgroup");
+
+    fd = openat(root_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    sys_fail_if(fd < 0, "Error opening cgroup");
+
+    rc = fstatfs(fd, &sb);
+    sys_fail_if(rc < 0, "Error checking cgroup");
+
+    *unified = sb.f_type == CGROUP2_SUPER_MAGIC;
+
+    return fd;
 }
 
-static void attach_cgroup(const char *controller, const char *name, pid_t pid) {
+static void attach_cgroup(const char *controller, const char *name,
+                          bool unified, pid_t pid) {
     int rc;
 
     FILE *tasks = NULL;
     _free_ char *path = NULL;
 
-    rc = asprintf(&path, CGROUP_BASE "/%s/%s/tasks", controller, name);
+    int root_fd = open_cgroup_root(controller);
+
+    rc = asprintf(&path, "%s/%s", name, unified ? "cgroup.procs" : "tasks");
     fail_if(rc < 0, "OOM");
 
-    tasks = fopen(path, "w");
+    rc = openat(root_fd, path, O_WRONLY | O_CLOEXEC);
+    sys_fail_if(rc < 0, "Error opening cgroup");
+
+    tasks = fdopen(rc, "w");
     sys_fail_if(!tasks, "Error opening cgroup");
 
     fprintf(tasks, "%d\n", pid);
@@ -118,11 +225,8 @@ static void attach_cgroup(const char *controller, const char *name, pid_t pid) {
 static void destroy_cgroup(const char *controller, const char *name) {
     int rc;
 
-    _free_ char *path = NULL;
-
-    rc = asprintf(&path, CGROUP_BASE "/%s/%s", controller, name);
-    fail_if(rc < 0, "OOM");
+    int root_fd = open_cgroup_root(controller);
 
-    rc = rmdir(path);
+    rc = unlinkat(root_fd, name, AT_REMOVEDIR);
     sys_fail_if(rc < 0, "Error destroying cgroup");
 }
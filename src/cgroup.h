@@ -32,5 +32,6 @@ struct cgroup;
 
 void cgroup_add(struct cgroup **groups, char *controller);
 
-void setup_cgroup(struct cgroup *groups, pid_t pid);
+int prepare_cgroup(struct cgroup *groups);
+void setup_cgroup(struct cgroup *groups, pid_t pid, bool joined);
 void clean_cgroup(struct cgroup *groups);
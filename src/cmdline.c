@@ -34,28 +34,48 @@ const char *gengetopt_args_info_versiontext = "";
 const char *gengetopt_args_info_description = "";
 
 const char *gengetopt_args_info_help[] = {
-  "  -h, --help             Print help and exit",
-  "  -V, --version          Print version and exit",
-  "  -r, --chroot=STRING    Change the root directory inside the container",
-  "  -c, --chdir=STRING     Change the current directory inside the container",
-  "  -t, --hostname=STRING  Set the container hostname",
-  "  -m, --mount=STRING     Create a new mount point inside the container",
-  "  -n, --netif[=STRING]   Disconnect the container networking from the host",
-  "  -u, --user=STRING      Run the command under the specified user\n                           (default=`root')",
-  "  -e, --user-map=STRING  Map container users to host users",
-  "  -w, --ephemeral        Discard changes to /  (default=off)",
-  "  -g, --cgroup=STRING    Create a new cgroup and move the container inside it",
-  "  -b, --caps=STRING      Change the effective capabilities inside the container\n                           (default=`+all')",
-  "  -d, --detach           Detach from terminal  (default=off)",
-  "  -a, --attach=INT       Attach to the specified detached process",
-  "  -s, --setenv=STRING    Set additional environment variables",
-  "  -k, --keepenv          Do not clear environment  (default=off)",
-  "  -U, --no-userns        Disable user namespace support  (default=off)",
-  "  -M, --no-mountns       Disable mount namespace support  (default=off)",
-  "  -N, --no-netns         Disable net namespace support  (default=off)",
-  "  -I, --no-ipcns         Disable IPC namespace support  (default=off)",
-  "  -H, --no-utsns         Disable UTS namespace support  (default=off)",
-  "  -P, --no-pidns         Disable PID namespace support  (default=off)",
+  "  -h, --help                  Print help and exit",
+  "  -V, --version               Print version and exit",
+  "  -r, --chroot=STRING         Change the root directory inside the container",
+  "  -c, --chdir=STRING          Change the current directory inside the container",
+  "  -t, --hostname=STRING       Set the container hostname",
+  "  -m, --mount=STRING          Create a new mount point inside the container",
+  "  -n, --netif[=STRING]        Disconnect the container networking from the host",
+  "  -u, --user=STRING           Run the command under the specified user\n                                (default=`root')",
+  "  -e, --user-map=STRING       Map container users to host users",
+  "  -w, --ephemeral             Discard changes to /  (default=off)",
+  "      --dev-template          Clone /dev from a template prepared once per host\n                                (default=off)",
+  "      --snapshot              Reuse a prepared snapshot of the root and bind\n                                mounts (default=off)",
+  "      --drop-snapshots        Unmount the prepared snapshots and exit\n                                (default=off)",
+  "  -g, --cgroup=STRING         Create a new cgroup and move the container inside\n                                it",
+  "  -b, --caps=STRING           Change the effective capabilities inside the\n                                container (default=`+all')",
+  "  -d, --detach                Detach from terminal  (default=off)",
+  "  -a, --attach=INT            Attach to the specified detached process",
+  "      --detach-keys=STRING    Key sequence that detaches from the container\n                                (default=`ctrl-@')",
+  "  -s, --setenv=STRING         Set additional environment variables",
+  "  -k, --keepenv               Do not clear environment  (default=off)",
+  "      --timings[=STRING]      Report the duration of each startup phase",
+  "      --no-pty                Pass the standard streams through without a\n                                pseudo-terminal (default=off)",
+  "      --scrollback=INT        KiB of output replayed when attaching to a\n                                detached process (default=`64')",
+  "      --log-output=STRING     Write a copy of the container's output to the\n                                given file",
+  "      --log-size=INT          Rotate the output log once it grows past the\n                                given KiB (default=`0')",
+  "      --log-keep=INT          Number of rotated output logs to keep\n                                (default=`5')",
+  "      --log-timestamps        Prefix each line of the output log with a\n                                timestamp (default=off)",
+  "      --relay-engine=STRING   How to move the data between the terminal and the\n                                container (auto, epoll, io_uring)\n                                (default=`auto')",
+  "      --output-buffer=INT     KiB of output buffered for a slow terminal\n                                (default=`256')",
+  "      --output-policy=STRING  What to do when the terminal falls behind the\n                                output (block, drop, spill) (default=`block')",
+  "      --relay-stats           Report the amount of data relayed through the\n                                terminal (default=off)",
+  "      --pool=INT              Keep a pool of pre-forked containers ready to be\n                                claimed",
+  "      --claim=INT             Run the command in a container claimed from the\n                                specified pool",
+  "      --batch=STRING          Launch the containers described in the given file",
+  "      --jobs=INT              Maximum number of containers launched at once in\n                                batch mode (default=`8')",
+  "      --veth-pool=INT         Keep the given number of veth pairs ready for\n                                each bridge in pool or batch mode",
+  "  -U, --no-userns             Disable user namespace support  (default=off)",
+  "  -M, --no-mountns            Disable mount namespace support  (default=off)",
+  "  -N, --no-netns              Disable net namespace support  (default=off)",
+  "  -I, --no-ipcns              Disable IPC namespace support  (default=off)",
+  "  -H, --no-utsns              Disable UTS namespace support  (default=off)",
+  "  -P, --no-pidns              Disable PID namespace support  (default=off)",
     0
 };
 
@@ -93,12 +113,32 @@ void clear_given (struct gengetopt_args_info *args_info)
   args_info->user_given = 0 ;
   args_info->user_map_given = 0 ;
   args_info->ephemeral_given = 0 ;
+  args_info->dev_template_given = 0 ;
+  args_info->snapshot_given = 0 ;
+  args_info->drop_snapshots_given = 0 ;
   args_info->cgroup_given = 0 ;
   args_info->caps_given = 0 ;
   args_info->detach_given = 0 ;
   args_info->attach_given = 0 ;
+  args_info->detach_keys_given = 0 ;
   args_info->setenv_given = 0 ;
   args_info->keepenv_given = 0 ;
+  args_info->timings_given = 0 ;
+  args_info->no_pty_given = 0 ;
+  args_info->scrollback_given = 0 ;
+  args_info->log_output_given = 0 ;
+  args_info->log_size_given = 0 ;
+  args_info->log_keep_given = 0 ;
+  args_info->log_timestamps_given = 0 ;
+  args_info->relay_engine_given = 0 ;
+  args_info->output_buffer_given = 0 ;
+  args_info->output_policy_given = 0 ;
+  args_info->relay_stats_given = 0 ;
+  args_info->pool_given = 0 ;
+  args_info->claim_given = 0 ;
+  args_info->batch_given = 0 ;
+  args_info->jobs_given = 0 ;
+  args_info->veth_pool_given = 0 ;
   args_info->no_userns_given = 0 ;
   args_info->no_mountns_given = 0 ;
   args_info->no_netns_given = 0 ;
@@ -126,15 +166,46 @@ void clear_args (struct gengetopt_args_info *args_info)
   args_info->user_map_arg = NULL;
   args_info->user_map_orig = NULL;
   args_info->ephemeral_flag = 0;
+  args_info->dev_template_flag = 0;
+  args_info->snapshot_flag = 0;
+  args_info->drop_snapshots_flag = 0;
   args_info->cgroup_arg = NULL;
   args_info->cgroup_orig = NULL;
   args_info->caps_arg = NULL;
   args_info->caps_orig = NULL;
   args_info->detach_flag = 0;
   args_info->attach_orig = NULL;
+  args_info->detach_keys_arg = gengetopt_strdup ("ctrl-@");
+  args_info->detach_keys_orig = NULL;
   args_info->setenv_arg = NULL;
   args_info->setenv_orig = NULL;
   args_info->keepenv_flag = 0;
+  args_info->timings_arg = NULL;
+  args_info->timings_orig = NULL;
+  args_info->no_pty_flag = 0;
+  args_info->scrollback_arg = 64;
+  args_info->scrollback_orig = NULL;
+  args_info->log_output_arg = NULL;
+  args_info->log_output_orig = NULL;
+  args_info->log_size_arg = 0;
+  args_info->log_size_orig = NULL;
+  args_info->log_keep_arg = 5;
+  args_info->log_keep_orig = NULL;
+  args_info->log_timestamps_flag = 0;
+  args_info->relay_engine_arg = gengetopt_strdup ("auto");
+  args_info->relay_engine_orig = NULL;
+  args_info->output_buffer_arg = 256;
+  args_info->output_buffer_orig = NULL;
+  args_info->output_policy_arg = gengetopt_strdup ("block");
+  args_info->output_policy_orig = NULL;
+  args_info->relay_stats_flag = 0;
+  args_info->pool_orig = NULL;
+  args_info->claim_orig = NULL;
+  args_info->batch_arg = NULL;
+  args_info->batch_orig = NULL;
+  args_info->jobs_arg = 8;
+  args_info->jobs_orig = NULL;
+  args_info->veth_pool_orig = NULL;
   args_info->no_userns_flag = 0;
   args_info->no_mountns_flag = 0;
   args_info->no_netns_flag = 0;
@@ -165,24 +236,44 @@ void init_args_info(struct gengetopt_args_info *args_info)
   args_info->user_map_min = 0;
   args_info->user_map_max = 0;
   args_info->ephemeral_help = gengetopt_args_info_help[9] ;
-  args_info->cgroup_help = gengetopt_args_info_help[10] ;
+  args_info->dev_template_help = gengetopt_args_info_help[10] ;
+  args_info->snapshot_help = gengetopt_args_info_help[11] ;
+  args_info->drop_snapshots_help = gengetopt_args_info_help[12] ;
+  args_info->cgroup_help = gengetopt_args_info_help[13] ;
   args_info->cgroup_min = 0;
   args_info->cgroup_max = 0;
-  args_info->caps_help = gengetopt_args_info_help[11] ;
+  args_info->caps_help = gengetopt_args_info_help[14] ;
   args_info->caps_min = 0;
   args_info->caps_max = 0;
-  args_info->detach_help = gengetopt_args_info_help[12] ;
-  args_info->attach_help = gengetopt_args_info_help[13] ;
-  args_info->setenv_help = gengetopt_args_info_help[14] ;
+  args_info->detach_help = gengetopt_args_info_help[15] ;
+  args_info->attach_help = gengetopt_args_info_help[16] ;
+  args_info->detach_keys_help = gengetopt_args_info_help[17] ;
+  args_info->setenv_help = gengetopt_args_info_help[18] ;
   args_info->setenv_min = 0;
   args_info->setenv_max = 0;
-  args_info->keepenv_help = gengetopt_args_info_help[15] ;
-  args_info->no_userns_help = gengetopt_args_info_help[16] ;
-  args_info->no_mountns_help = gengetopt_args_info_help[17] ;
-  args_info->no_netns_help = gengetopt_args_info_help[18] ;
-  args_info->no_ipcns_help = gengetopt_args_info_help[19] ;
-  args_info->no_utsns_help = gengetopt_args_info_help[20] ;
-  args_info->no_pidns_help = gengetopt_args_info_help[21] ;
+  args_info->keepenv_help = gengetopt_args_info_help[19] ;
+  args_info->timings_help = gengetopt_args_info_help[20] ;
+  args_info->no_pty_help = gengetopt_args_info_help[21] ;
+  args_info->scrollback_help = gengetopt_args_info_help[22] ;
+  args_info->log_output_help = gengetopt_args_info_help[23] ;
+  args_info->log_size_help = gengetopt_args_info_help[24] ;
+  args_info->log_keep_help = gengetopt_args_info_help[25] ;
+  args_info->log_timestamps_help = gengetopt_args_info_help[26] ;
+  args_info->relay_engine_help = gengetopt_args_info_help[27] ;
+  args_info->output_buffer_help = gengetopt_args_info_help[28] ;
+  args_info->output_policy_help = gengetopt_args_info_help[29] ;
+  args_info->relay_stats_help = gengetopt_args_info_help[30] ;
+  args_info->pool_help = gengetopt_args_info_help[31] ;
+  args_info->claim_help = gengetopt_args_info_help[32] ;
+  args_info->batch_help = gengetopt_args_info_help[33] ;
+  args_info->jobs_help = gengetopt_args_info_help[34] ;
+  args_info->veth_pool_help = gengetopt_args_info_help[35] ;
+  args_info->no_userns_help = gengetopt_args_info_help[36] ;
+  args_info->no_mountns_help = gengetopt_args_info_help[37] ;
+  args_info->no_netns_help = gengetopt_args_info_help[38] ;
+  args_info->no_ipcns_help = gengetopt_args_info_help[39] ;
+  args_info->no_utsns_help = gengetopt_args_info_help[40] ;
+  args_info->no_pidns_help = gengetopt_args_info_help[41] ;
   
 }
 
@@ -325,7 +416,27 @@ cmdline_parser_release (struct gengetopt_args_info *args_info)
   free_multiple_string_field (args_info->cgroup_given, &(args_info->cgroup_arg), &(args_info->cgroup_orig));
   free_multiple_string_field (args_info->caps_given, &(args_info->caps_arg), &(args_info->caps_orig));
   free_string_field (&(args_info->attach_orig));
+  free_string_field (&(args_info->detach_keys_arg));
+  free_string_field (&(args_info->detach_keys_orig));
   free_multiple_string_field (args_info->setenv_given, &(args_info->setenv_arg), &(args_info->setenv_orig));
+  free_string_field (&(args_info->timings_arg));
+  free_string_field (&(args_info->timings_orig));
+  free_string_field (&(args_info->scrollback_orig));
+  free_string_field (&(args_info->log_output_arg));
+  free_string_field (&(args_info->log_output_orig));
+  free_string_field (&(args_info->log_size_orig));
+  free_string_field (&(args_info->log_keep_orig));
+  free_string_field (&(args_info->relay_engine_arg));
+  free_string_field (&(args_info->relay_engine_orig));
+  free_string_field (&(args_info->output_buffer_orig));
+  free_string_field (&(args_info->output_policy_arg));
+  free_string_field (&(args_info->output_policy_orig));
+  free_string_field (&(args_info->pool_orig));
+  free_string_field (&(args_info->claim_orig));
+  free_string_field (&(args_info->batch_arg));
+  free_string_field (&(args_info->batch_orig));
+  free_string_field (&(args_info->jobs_orig));
+  free_string_field (&(args_info->veth_pool_orig));
   
   
 
@@ -381,15 +492,55 @@ cmdline_parser_dump(FILE *outfile, struct gengetopt_args_info *args_info)
   write_multiple_into_file(outfile, args_info->user_map_given, "user-map", args_info->user_map_orig, 0);
   if (args_info->ephemeral_given)
     write_into_file(outfile, "ephemeral", 0, 0 );
+  if (args_info->dev_template_given)
+    write_into_file(outfile, "dev-template", 0, 0 );
+  if (args_info->snapshot_given)
+    write_into_file(outfile, "snapshot", 0, 0 );
+  if (args_info->drop_snapshots_given)
+    write_into_file(outfile, "drop-snapshots", 0, 0 );
   write_multiple_into_file(outfile, args_info->cgroup_given, "cgroup", args_info->cgroup_orig, 0);
   write_multiple_into_file(outfile, args_info->caps_given, "caps", args_info->caps_orig, 0);
   if (args_info->detach_given)
     write_into_file(outfile, "detach", 0, 0 );
   if (args_info->attach_given)
     write_into_file(outfile, "attach", args_info->attach_orig, 0);
+  if (args_info->detach_keys_given)
+    write_into_file(outfile, "detach-keys", args_info->detach_keys_orig, 0);
   write_multiple_into_file(outfile, args_info->setenv_given, "setenv", args_info->setenv_orig, 0);
   if (args_info->keepenv_given)
     write_into_file(outfile, "keepenv", 0, 0 );
+  if (args_info->timings_given)
+    write_into_file(outfile, "timings", args_info->timings_orig, 0);
+  if (args_info->no_pty_given)
+    write_into_file(outfile, "no-pty", 0, 0 );
+  if (args_info->scrollback_given)
+    write_into_file(outfile, "scrollback", args_info->scrollback_orig, 0);
+  if (args_info->log_output_given)
+    write_into_file(outfile, "log-output", args_info->log_output_orig, 0);
+  if (args_info->log_size_given)
+    write_into_file(outfile, "log-size", args_info->log_size_orig, 0);
+  if (args_info->log_keep_given)
+    write_into_file(outfile, "log-keep", args_info->log_keep_orig, 0);
+  if (args_info->log_timestamps_given)
+    write_into_file(outfile, "log-timestamps", 0, 0 );
+  if (args_info->relay_engine_given)
+    write_into_file(outfile, "relay-engine", args_info->relay_engine_orig, 0);
+  if (args_info->output_buffer_given)
+    write_into_file(outfile, "output-buffer", args_info->output_buffer_orig, 0);
+  if (args_info->output_policy_given)
+    write_into_file(outfile, "output-policy", args_info->output_policy_orig, 0);
+  if (args_info->relay_stats_given)
+    write_into_file(outfile, "relay-stats", 0, 0 );
+  if (args_info->pool_given)
+    write_into_file(outfile, "pool", args_info->pool_orig, 0);
+  if (args_info->claim_given)
+    write_into_file(outfile, "claim", args_info->claim_orig, 0);
+  if (args_info->batch_given)
+    write_into_file(outfile, "batch", args_info->batch_orig, 0);
+  if (args_info->jobs_given)
+    write_into_file(outfile, "jobs", args_info->jobs_orig, 0);
+  if (args_info->veth_pool_given)
+    write_into_file(outfile, "veth-pool", args_info->veth_pool_orig, 0);
   if (args_info->no_userns_given)
     write_into_file(outfile, "no-userns", 0, 0 );
   if (args_info->no_mountns_given)
@@ -678,6 +829,36 @@ cmdline_parser_required2 (struct gengetopt_args_info *args_info, const char *pro
       fprintf (stderr, "%s: '--ephemeral' ('-w') option depends on option 'chroot'%s\n", prog_name, (additional_error ? additional_error : ""));
       error_occurred = 1;
     }
+  if (args_info->dev_template_given && ! args_info->chroot_given)
+    {
+      fprintf (stderr, "%s: '--dev-template' option depends on option 'chroot'%s\n", prog_name, (additional_error ? additional_error : ""));
+      error_occurred = 1;
+    }
+  if (args_info->snapshot_given && ! args_info->chroot_given)
+    {
+      fprintf (stderr, "%s: '--snapshot' option depends on option 'chroot'%s\n", prog_name, (additional_error ? additional_error : ""));
+      error_occurred = 1;
+    }
+  if (args_info->log_size_given && ! args_info->log_output_given)
+    {
+      fprintf (stderr, "%s: '--log-size' option depends on option 'log-output'%s\n", prog_name, (additional_error ? additional_error : ""));
+      error_occurred = 1;
+    }
+  if (args_info->log_keep_given && ! args_info->log_output_given)
+    {
+      fprintf (stderr, "%s: '--log-keep' option depends on option 'log-output'%s\n", prog_name, (additional_error ? additional_error : ""));
+      error_occurred = 1;
+    }
+  if (args_info->log_timestamps_given && ! args_info->log_output_given)
+    {
+      fprintf (stderr, "%s: '--log-timestamps' option depends on option 'log-output'%s\n", prog_name, (additional_error ? additional_error : ""));
+      error_occurred = 1;
+    }
+  if (args_info->jobs_given && ! args_info->batch_given)
+    {
+      fprintf (stderr, "%s: '--jobs' option depends on option 'batch'%s\n", prog_name, (additional_error ? additional_error : ""));
+      error_occurred = 1;
+    }
 
   return error_occurred;
 }
@@ -984,12 +1165,32 @@ cmdline_parser_internal (
         { "user",	1, NULL, 'u' },
         { "user-map",	1, NULL, 'e' },
         { "ephemeral",	0, NULL, 'w' },
+        { "dev-template",	0, NULL, 0 },
+        { "snapshot",	0, NULL, 0 },
+        { "drop-snapshots",	0, NULL, 0 },
         { "cgroup",	1, NULL, 'g' },
         { "caps",	1, NULL, 'b' },
         { "detach",	0, NULL, 'd' },
         { "attach",	1, NULL, 'a' },
+        { "detach-keys",	1, NULL, 0 },
         { "setenv",	1, NULL, 's' },
         { "keepenv",	0, NULL, 'k' },
+        { "timings",	2, NULL, 0 },
+        { "no-pty",	0, NULL, 0 },
+        { "scrollback",	1, NULL, 0 },
+        { "log-output",	1, NULL, 0 },
+        { "log-size",	1, NULL, 0 },
+        { "log-keep",	1, NULL, 0 },
+        { "log-timestamps",	0, NULL, 0 },
+        { "relay-engine",	1, NULL, 0 },
+        { "output-buffer",	1, NULL, 0 },
+        { "output-policy",	1, NULL, 0 },
+        { "relay-stats",	0, NULL, 0 },
+        { "pool",	1, NULL, 0 },
+        { "claim",	1, NULL, 0 },
+        { "batch",	1, NULL, 0 },
+        { "jobs",	1, NULL, 0 },
+        { "veth-pool",	1, NULL, 0 },
         { "no-userns",	0, NULL, 'U' },
         { "no-mountns",	0, NULL, 'M' },
         { "no-netns",	0, NULL, 'N' },
@@ -1221,6 +1422,276 @@ cmdline_parser_internal (
           break;
 
         case 0:	/* Long option with no short option */
+          /* Clone /dev from a template prepared once per host.  */
+          if (strcmp (long_options[option_index].name, "dev-template") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->dev_template_flag), 0, &(args_info->dev_template_given),
+                &(local_args_info.dev_template_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "dev-template", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Reuse a prepared snapshot of the root and bind mounts.  */
+          else if (strcmp (long_options[option_index].name, "snapshot") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->snapshot_flag), 0, &(args_info->snapshot_given),
+                &(local_args_info.snapshot_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "snapshot", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Unmount the prepared snapshots and exit.  */
+          else if (strcmp (long_options[option_index].name, "drop-snapshots") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->drop_snapshots_flag), 0, &(args_info->drop_snapshots_given),
+                &(local_args_info.drop_snapshots_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "drop-snapshots", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Key sequence that detaches from the container.  */
+          else if (strcmp (long_options[option_index].name, "detach-keys") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->detach_keys_arg), 
+                 &(args_info->detach_keys_orig), &(args_info->detach_keys_given),
+                &(local_args_info.detach_keys_given), optarg, 0, "ctrl-@", ARG_STRING,
+                check_ambiguity, override, 0, 0,
+                "detach-keys", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Report the duration of each startup phase.  */
+          else if (strcmp (long_options[option_index].name, "timings") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->timings_arg), 
+                 &(args_info->timings_orig), &(args_info->timings_given),
+                &(local_args_info.timings_given), optarg, 0, 0, ARG_STRING,
+                check_ambiguity, override, 0, 0,
+                "timings", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Pass the standard streams through without a pseudo-terminal.  */
+          else if (strcmp (long_options[option_index].name, "no-pty") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->no_pty_flag), 0, &(args_info->no_pty_given),
+                &(local_args_info.no_pty_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "no-pty", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* KiB of output replayed when attaching to a detached process.  */
+          else if (strcmp (long_options[option_index].name, "scrollback") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->scrollback_arg), 
+                 &(args_info->scrollback_orig), &(args_info->scrollback_given),
+                &(local_args_info.scrollback_given), optarg, 0, "64", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "scrollback", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Write a copy of the container's output to the given file.  */
+          else if (strcmp (long_options[option_index].name, "log-output") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->log_output_arg), 
+                 &(args_info->log_output_orig), &(args_info->log_output_given),
+                &(local_args_info.log_output_given), optarg, 0, 0, ARG_STRING,
+                check_ambiguity, override, 0, 0,
+                "log-output", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Rotate the output log once it grows past the given KiB.  */
+          else if (strcmp (long_options[option_index].name, "log-size") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->log_size_arg), 
+                 &(args_info->log_size_orig), &(args_info->log_size_given),
+                &(local_args_info.log_size_given), optarg, 0, "0", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "log-size", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Number of rotated output logs to keep.  */
+          else if (strcmp (long_options[option_index].name, "log-keep") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->log_keep_arg), 
+                 &(args_info->log_keep_orig), &(args_info->log_keep_given),
+                &(local_args_info.log_keep_given), optarg, 0, "5", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "log-keep", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Prefix each line of the output log with a timestamp.  */
+          else if (strcmp (long_options[option_index].name, "log-timestamps") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->log_timestamps_flag), 0, &(args_info->log_timestamps_given),
+                &(local_args_info.log_timestamps_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "log-timestamps", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* How to move the data between the terminal and the container (auto, epoll, io_uring).  */
+          else if (strcmp (long_options[option_index].name, "relay-engine") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->relay_engine_arg), 
+                 &(args_info->relay_engine_orig), &(args_info->relay_engine_given),
+                &(local_args_info.relay_engine_given), optarg, 0, "auto", ARG_STRING,
+                check_ambiguity, override, 0, 0,
+                "relay-engine", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* KiB of output buffered for a slow terminal.  */
+          else if (strcmp (long_options[option_index].name, "output-buffer") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->output_buffer_arg), 
+                 &(args_info->output_buffer_orig), &(args_info->output_buffer_given),
+                &(local_args_info.output_buffer_given), optarg, 0, "256", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "output-buffer", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* What to do when the terminal falls behind the output (block, drop, spill).  */
+          else if (strcmp (long_options[option_index].name, "output-policy") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->output_policy_arg), 
+                 &(args_info->output_policy_orig), &(args_info->output_policy_given),
+                &(local_args_info.output_policy_given), optarg, 0, "block", ARG_STRING,
+                check_ambiguity, override, 0, 0,
+                "output-policy", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Report the amount of data relayed through the terminal.  */
+          else if (strcmp (long_options[option_index].name, "relay-stats") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->relay_stats_flag), 0, &(args_info->relay_stats_given),
+                &(local_args_info.relay_stats_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "relay-stats", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Keep a pool of pre-forked containers ready to be claimed.  */
+          else if (strcmp (long_options[option_index].name, "pool") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->pool_arg), 
+                 &(args_info->pool_orig), &(args_info->pool_given),
+                &(local_args_info.pool_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "pool", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Run the command in a container claimed from the specified pool.  */
+          else if (strcmp (long_options[option_index].name, "claim") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->claim_arg), 
+                 &(args_info->claim_orig), &(args_info->claim_given),
+                &(local_args_info.claim_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "claim", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Launch the containers described in the given file.  */
+          else if (strcmp (long_options[option_index].name, "batch") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->batch_arg), 
+                 &(args_info->batch_orig), &(args_info->batch_given),
+                &(local_args_info.batch_given), optarg, 0, 0, ARG_STRING,
+                check_ambiguity, override, 0, 0,
+                "batch", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Maximum number of containers launched at once in batch mode.  */
+          else if (strcmp (long_options[option_index].name, "jobs") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->jobs_arg), 
+                 &(args_info->jobs_orig), &(args_info->jobs_given),
+                &(local_args_info.jobs_given), optarg, 0, "8", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "jobs", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Keep the given number of veth pairs ready for each bridge in pool or batch mode.  */
+          else if (strcmp (long_options[option_index].name, "veth-pool") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->veth_pool_arg), 
+                 &(args_info->veth_pool_orig), &(args_info->veth_pool_given),
+                &(local_args_info.veth_pool_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "veth-pool", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          
+          break;
         case '?':	/* Invalid option.  */
           /* `getopt_long' already printed an error message.  */
           goto failure;
@@ -68,6 +68,12 @@ struct gengetopt_args_info
   const char *user_map_help; /**< @brief Map container users to host users help description.  */
   int ephemeral_flag;	/**< @brief Discard changes to / (default=off).  */
   const char *ephemeral_help; /**< @brief Discard changes to / help description.  */
+  int dev_template_flag;	/**< @brief Clone /dev from a template prepared once per host (default=off).  */
+  const char *dev_template_help; /**< @brief Clone /dev from a template prepared once per host help description.  */
+  int snapshot_flag;	/**< @brief Reuse a prepared snapshot of the root and bind mounts (default=off).  */
+  const char *snapshot_help; /**< @brief Reuse a prepared snapshot of the root and bind mounts help description.  */
+  int drop_snapshots_flag;	/**< @brief Unmount the prepared snapshots and exit (default=off).  */
+  const char *drop_snapshots_help; /**< @brief Unmount the prepared snapshots and exit help description.  */
   char ** cgroup_arg;	/**< @brief Create a new cgroup and move the container inside it.  */
   char ** cgroup_orig;	/**< @brief Create a new cgroup and move the container inside it original value given at command line.  */
   unsigned int cgroup_min; /**< @brief Create a new cgroup and move the container inside it's minimum occurreces */
@@ -83,6 +89,9 @@ struct gengetopt_args_info
   int attach_arg;	/**< @brief Attach to the specified detached process.  */
   char * attach_orig;	/**< @brief Attach to the specified detached process original value given at command line.  */
   const char *attach_help; /**< @brief Attach to the specified detached process help description.  */
+  char * detach_keys_arg;	/**< @brief Key sequence that detaches from the container (default='ctrl-@').  */
+  char * detach_keys_orig;	/**< @brief Key sequence that detaches from the container original value given at command line.  */
+  const char *detach_keys_help; /**< @brief Key sequence that detaches from the container help description.  */
   char ** setenv_arg;	/**< @brief Set additional environment variables.  */
   char ** setenv_orig;	/**< @brief Set additional environment variables original value given at command line.  */
   unsigned int setenv_min; /**< @brief Set additional environment variables's minimum occurreces */
@@ -90,6 +99,51 @@ struct gengetopt_args_info
   const char *setenv_help; /**< @brief Set additional environment variables help description.  */
   int keepenv_flag;	/**< @brief Do not clear environment (default=off).  */
   const char *keepenv_help; /**< @brief Do not clear environment help description.  */
+  char * timings_arg;	/**< @brief Report the duration of each startup phase.  */
+  char * timings_orig;	/**< @brief Report the duration of each startup phase original value given at command line.  */
+  const char *timings_help; /**< @brief Report the duration of each startup phase help description.  */
+  int no_pty_flag;	/**< @brief Pass the standard streams through without a pseudo-terminal (default=off).  */
+  const char *no_pty_help; /**< @brief Pass the standard streams through without a pseudo-terminal help description.  */
+  int scrollback_arg;	/**< @brief KiB of output replayed when attaching to a detached process (default='64').  */
+  char * scrollback_orig;	/**< @brief KiB of output replayed when attaching to a detached process original value given at command line.  */
+  const char *scrollback_help; /**< @brief KiB of output replayed when attaching to a detached process help description.  */
+  char * log_output_arg;	/**< @brief Write a copy of the container's output to the given file.  */
+  char * log_output_orig;	/**< @brief Write a copy of the container's output to the given file original value given at command line.  */
+  const char *log_output_help; /**< @brief Write a copy of the container's output to the given file help description.  */
+  int log_size_arg;	/**< @brief Rotate the output log once it grows past the given KiB (default='0').  */
+  char * log_size_orig;	/**< @brief Rotate the output log once it grows past the given KiB original value given at command line.  */
+  const char *log_size_help; /**< @brief Rotate the output log once it grows past the given KiB help description.  */
+  int log_keep_arg;	/**< @brief Number of rotated output logs to keep (default='5').  */
+  char * log_keep_orig;	/**< @brief Number of rotated output logs to keep original value given at command line.  */
+  const char *log_keep_help; /**< @brief Number of rotated output logs to keep help description.  */
+  int log_timestamps_flag;	/**< @brief Prefix each line of the output log with a timestamp (default=off).  */
+  const char *log_timestamps_help; /**< @brief Prefix each line of the output log with a timestamp help description.  */
+  char * relay_engine_arg;	/**< @brief How to move the data between the terminal and the container (auto, epoll, io_uring) (default='auto').  */
+  char * relay_engine_orig;	/**< @brief How to move the data between the terminal and the container (auto, epoll, io_uring) original value given at command line.  */
+  const char *relay_engine_help; /**< @brief How to move the data between the terminal and the container (auto, epoll, io_uring) help description.  */
+  int output_buffer_arg;	/**< @brief KiB of output buffered for a slow terminal (default='256').  */
+  char * output_buffer_orig;	/**< @brief KiB of output buffered for a slow terminal original value given at command line.  */
+  const char *output_buffer_help; /**< @brief KiB of output buffered for a slow terminal help description.  */
+  char * output_policy_arg;	/**< @brief What to do when the terminal falls behind the output (block, drop, spill) (default='block').  */
+  char * output_policy_orig;	/**< @brief What to do when the terminal falls behind the output (block, drop, spill) original value given at command line.  */
+  const char *output_policy_help; /**< @brief What to do when the terminal falls behind the output (block, drop, spill) help description.  */
+  int relay_stats_flag;	/**< @brief Report the amount of data relayed through the terminal (default=off).  */
+  const char *relay_stats_help; /**< @brief Report the amount of data relayed through the terminal help description.  */
+  int pool_arg;	/**< @brief Keep a pool of pre-forked containers ready to be claimed.  */
+  char * pool_orig;	/**< @brief Keep a pool of pre-forked containers ready to be claimed original value given at command line.  */
+  const char *pool_help; /**< @brief Keep a pool of pre-forked containers ready to be claimed help description.  */
+  int claim_arg;	/**< @brief Run the command in a container claimed from the specified pool.  */
+  char * claim_orig;	/**< @brief Run the command in a container claimed from the specified pool original value given at command line.  */
+  const char *claim_help; /**< @brief Run the command in a container claimed from the specified pool help description.  */
+  char * batch_arg;	/**< @brief Launch the containers described in the given file.  */
+  char * batch_orig;	/**< @brief Launch the containers described in the given file original value given at command line.  */
+  const char *batch_help; /**< @brief Launch the containers described in the given file help description.  */
+  int jobs_arg;	/**< @brief Maximum number of containers launched at once in batch mode (default='8').  */
+  char * jobs_orig;	/**< @brief Maximum number of containers launched at once in batch mode original value given at command line.  */
+  const char *jobs_help; /**< @brief Maximum number of containers launched at once in batch mode help description.  */
+  int veth_pool_arg;	/**< @brief Keep the given number of veth pairs ready for each bridge in pool or batch mode.  */
+  char * veth_pool_orig;	/**< @brief Keep the given number of veth pairs ready for each bridge in pool or batch mode original value given at command line.  */
+  const char *veth_pool_help; /**< @brief Keep the given number of veth pairs ready for each bridge in pool or batch mode help description.  */
   int no_userns_flag;	/**< @brief Disable user namespace support (default=off).  */
   const char *no_userns_help; /**< @brief Disable user namespace support help description.  */
   int no_mountns_flag;	/**< @brief Disable mount namespace support (default=off).  */
@@ -113,12 +167,32 @@ struct gengetopt_args_info
   unsigned int user_given ;	/**< @brief Whether user was given.  */
   unsigned int user_map_given ;	/**< @brief Whether user-map was given.  */
   unsigned int ephemeral_given ;	/**< @brief Whether ephemeral was given.  */
+  unsigned int dev_template_given ;	/**< @brief Whether dev-template was given.  */
+  unsigned int snapshot_given ;	/**< @brief Whether snapshot was given.  */
+  unsigned int drop_snapshots_given ;	/**< @brief Whether drop-snapshots was given.  */
   unsigned int cgroup_given ;	/**< @brief Whether cgroup was given.  */
   unsigned int caps_given ;	/**< @brief Whether caps was given.  */
   unsigned int detach_given ;	/**< @brief Whether detach was given.  */
   unsigned int attach_given ;	/**< @brief Whether attach was given.  */
+  unsigned int detach_keys_given ;	/**< @brief Whether detach-keys was given.  */
   unsigned int setenv_given ;	/**< @brief Whether setenv was given.  */
   unsigned int keepenv_given ;	/**< @brief Whether keepenv was given.  */
+  unsigned int timings_given ;	/**< @brief Whether timings was given.  */
+  unsigned int no_pty_given ;	/**< @brief Whether no-pty was given.  */
+  unsigned int scrollback_given ;	/**< @brief Whether scrollback was given.  */
+  unsigned int log_output_given ;	/**< @brief Whether log-output was given.  */
+  unsigned int log_size_given ;	/**< @brief Whether log-size was given.  */
+  unsigned int log_keep_given ;	/**< @brief Whether log-keep was given.  */
+  unsigned int log_timestamps_given ;	/**< @brief Whether log-timestamps was given.  */
+  unsigned int relay_engine_given ;	/**< @brief Whether relay-engine was given.  */
+  unsigned int output_buffer_given ;	/**< @brief Whether output-buffer was given.  */
+  unsigned int output_policy_given ;	/**< @brief Whether output-policy was given.  */
+  unsigned int relay_stats_given ;	/**< @brief Whether relay-stats was given.  */
+  unsigned int pool_given ;	/**< @brief Whether pool was given.  */
+  unsigned int claim_given ;	/**< @brief Whether claim was given.  */
+  unsigned int batch_given ;	/**< @brief Whether batch was given.  */
+  unsigned int jobs_given ;	/**< @brief Whether jobs was given.  */
+  unsigned int veth_pool_given ;	/**< @brief Whether veth-pool was given.  */
   unsigned int no_userns_given ;	/**< @brief Whether no-userns was given.  */
   unsigned int no_mountns_given ;	/**< @brief Whether no-mountns was given.  */
   unsigned int no_netns_given ;	/**< @brief Whether no-netns was given.  */
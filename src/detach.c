@@ -0,0 +1,163 @@
+/*
+ * The process in the flask.
+ *
+ * Copyright (c) 2013, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "detach.h"
+#include "printf.h"
+#include "util.h"
+
+static bool detach_step(struct detach *d, char c);
+static bool detach_found(struct detach *d, const char *buf, const char *end,
+                         size_t *len);
+
+/* Parse a comma-separated list of keys, each either a single character or
+ * "ctrl-<c>" (e.g. "ctrl-p,ctrl-q"). "none" disables detaching. */
+void detach_init(struct detach *d, const char *spec) {
+    _free_ char *copy = NULL;
+
+    char *key, *save = NULL;
+
+    d->len     = 0;
+    d->matched = 0;
+
+    if (!strcmp(spec, "none"))
+        return;
+
+    copy = strdup(spec);
+    fail_if(!copy, "OOM");
+
+    for (key = strtok_r(copy, ",", &save); key;
+         key = strtok_r(NULL, ",", &save)) {
+        char c;
+
+        fail_if(d->len == DETACH_KEYS_MAX, "Too many detach keys in '%s'",
+                spec);
+
+        if (!strncmp(key, "ctrl-", 5) && (strlen(key) == 6)) {
+            c = toupper(key[5]);
+
+            fail_if(c < '@' || c > '_', "Invalid detach key '%s'", key);
+
+            c &= 0x1f;
+        } else {
+            fail_if(strlen(key) != 1, "Invalid detach key '%s'", key);
+
+            c = key[0];
+        }
+
+        d->keys[d->len++] = c;
+    }
+
+    fail_if(!d->len, "Invalid detach keys '%s'", spec);
+}
+
+/* Look for the detach sequence in the len bytes of buf, returns true once all
+ * of it has been seen, with len cut to the bytes that came before it (which
+ * still belong to the container). memchr() skips to the candidates for the
+ * first key, so that large inputs (e.g. a paste) aren't looked at one byte at
+ * a time. */
+bool detach_scan(struct detach *d, const char *buf, size_t *len) {
+    const char *p = buf, *end = buf + *len;
+
+    if (!d->len)
+        return false;
+
+    /* finish the sequence started by the previous read */
+    while (d->matched && (p < end)) {
+        if (detach_step(d, *p++))
+            return detach_found(d, buf, p, len);
+    }
+
+    while (p < end) {
+        size_t left;
+
+        p = memchr(p, d->keys[0], end - p);
+        if (!p)
+            return false;
+
+        left = end - p;
+
+        if (left >= d->len) {
+            if (!memcmp(p, d->keys, d->len))
+                return detach_found(d, buf, p + d->len, len);
+
+            p++;
+            continue;
+        }
+
+        /* the sequence may continue in the next read */
+        while (p < end) {
+            if (detach_step(d, *p++))
+                return detach_found(d, buf, p, len);
+        }
+    }
+
+    return false;
+}
+
+/* Feed one more byte to the matcher. On a mismatch the longest suffix of
+ * the input seen so far that is also a prefix of the keys is kept, so that
+ * e.g. "ctrl-p,ctrl-p,ctrl-q" is found in "^P^P^P^Q". */
+static bool detach_step(struct detach *d, char c) {
+    while (1) {
+        if (d->keys[d->matched] == c) {
+            if (++d->matched == d->len) {
+                d->matched = 0;
+                return true;
+            }
+
+            return false;
+        }
+
+        if (!d->matched)
+            return false;
+
+        for (size_t n = d->matched - 1; ; n--) {
+            /* the last n matched keys are keys[matched - n, matched) */
+            if (!memcmp(d->keys, d->keys + d->matched - n, n)) {
+                d->matched = n;
+                break;
+            }
+        }
+    }
+}
+
+/* The sequence ended right before end, and may have started in a previous
+ * read, in which case nothing in buf precedes it. */
+static bool detach_found(struct detach *d, const char *buf, const char *end,
+                         size_t *len) {
+    size_t seen = end - buf;
+
+    *len = seen > d->len ? seen - d->len : 0;
+    return true;
+}
@@ -30,15 +30,18 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 #include <sched.h>
 
+#include <sys/file.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+#include "dev.h"
 #include "user.h"
 #include "sync.h"
 #include "printf.h"
@@ -217,3 +220,61 @@ void setup_nodes(const char *dest) {
 
     umask(u);
 }
+
+void setup_dev_template(void) {
+    int rc;
+
+    struct stat sb;
+
+    _close_ int lock_fd = -1;
+
+    rc = mkdir(DEV_TEMPLATE_ROOT, 0755);
+    sys_fail_if(rc < 0 && errno != EEXIST, "Error creating directory '%s'",
+                DEV_TEMPLATE_ROOT);
+
+    lock_fd = open(DEV_TEMPLATE_ROOT "/dev.lock",
+                   O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    sys_fail_if(lock_fd < 0, "Error opening '%s'",
+                DEV_TEMPLATE_ROOT "/dev.lock");
+
+    rc = flock(lock_fd, LOCK_EX);
+    sys_fail_if(rc < 0, "Error locking '%s'", DEV_TEMPLATE_ROOT "/dev.lock");
+
+    if (!stat(DEV_TEMPLATE_ROOT "/dev.ready", &sb))
+        return;
+
+    /* a previous attempt may have been interrupted half-way */
+    umount2(DEV_TEMPLATE_DIR, MNT_DETACH);
+
+    rc = mkdir(DEV_TEMPLATE_DIR, 0755);
+    sys_fail_if(rc < 0 && errno != EEXIST, "Error creating directory '%s'",
+                DEV_TEMPLATE_DIR);
+
+    rc = mount("tmpfs", DEV_TEMPLATE_DIR, "tmpfs",
+               MS_NOSUID | MS_STRICTATIME, "mode=755");
+    sys_fail_if(rc < 0, "Error mounting '%s'", DEV_TEMPLATE_DIR);
+
+    /* keep the per-container mounts on the clones from propagating back
+     * into the template */
+    rc = mount(NULL, DEV_TEMPLATE_DIR, NULL, MS_PRIVATE, NULL);
+    sys_fail_if(rc < 0, "Error making '%s' private", DEV_TEMPLATE_DIR);
+
+    rc = mkdir(DEV_TEMPLATE_DIR "/pts", 0755);
+    sys_fail_if(rc < 0, "Error creating directory '%s'",
+                DEV_TEMPLATE_DIR "/pts");
+
+    rc = mkdir(DEV_TEMPLATE_DIR "/shm", 0755);
+    sys_fail_if(rc < 0, "Error creating directory '%s'",
+                DEV_TEMPLATE_DIR "/shm");
+
+    setup_nodes(DEV_TEMPLATE_ROOT);
+    setup_ptmx(DEV_TEMPLATE_ROOT);
+    setup_symlinks(DEV_TEMPLATE_ROOT);
+
+    rc = open(DEV_TEMPLATE_ROOT "/dev.ready",
+              O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    sys_fail_if(rc < 0, "Error creating '%s'",
+                DEV_TEMPLATE_ROOT "/dev.ready");
+
+    close(rc);
+}
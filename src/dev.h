@@ -28,8 +28,15 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define DEV_TEMPLATE_ROOT RUN_DIR
+#define DEV_TEMPLATE_DIR  DEV_TEMPLATE_ROOT "/dev"
+
+struct user;
+
 void setup_ptmx(const char *dest);
 void setup_console_owner(char *path, struct user *users);
 void setup_console(const char *dest, const char *console);
 void setup_symlinks(const char *dest);
 void setup_nodes(const char *dest);
+
+void setup_dev_template(void);
@@ -0,0 +1,403 @@
+/*
+ * The process in the flask.
+ *
+ * Copyright (c) 2013, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "logfile.h"
+#include "uring.h"
+#include "printf.h"
+#include "util.h"
+
+#define LOG_BUF_SIZE  (64 * 1024)
+#define LOG_BUF_COUNT 16
+
+struct log_buf {
+    char data[LOG_BUF_SIZE];
+
+    size_t len;
+    size_t done;
+    off_t off;
+
+    /* the log rotation the offset refers to */
+    unsigned int gen;
+
+    bool busy;
+};
+
+/* The output is collected in a set of buffers, which are written out
+ * asynchronously through io_uring when available, and synchronously
+ * otherwise. When all buffers are waiting on the disk the output is dropped
+ * instead of slowing down the container, and a marker is left in its place. */
+struct logfile {
+    char *path;
+    int fd;
+
+    off_t size;
+    size_t max_size;
+    unsigned int keep;
+    unsigned int gen;
+
+    bool timestamps;
+    bool bol;
+
+    bool use_uring;
+    bool uring_checked;
+    struct uring uring;
+
+    struct log_buf bufs[LOG_BUF_COUNT];
+    unsigned int cur;
+    unsigned int inflight;
+
+    uint64_t dropped;
+};
+
+static void log_append(struct logfile *l, const char *buf, size_t len);
+static void log_submit(struct logfile *l, unsigned int i);
+static void log_reap(struct logfile *l, unsigned int wait_nr);
+static void log_write_sync(struct logfile *l, struct log_buf *b);
+static void log_rotate(struct logfile *l);
+static int log_open_fd(const char *path);
+
+struct logfile *logfile_open(const char *path, size_t max_size,
+                             unsigned int keep, bool timestamps) {
+    int rc;
+
+    struct logfile *l = calloc(1, sizeof(*l));
+    fail_if(!l, "OOM");
+
+    /* the path must stay valid for rotations after daemonizing */
+    if (path[0] != '/') {
+        _free_ char *cwd = get_current_dir_name();
+        sys_fail_if(!cwd, "getcwd()");
+
+        rc = asprintf(&l->path, "%s/%s", cwd, path);
+        fail_if(rc < 0, "OOM");
+    } else {
+        l->path = strdup(path);
+        fail_if(!l->path, "OOM");
+    }
+
+    l->fd = log_open_fd(l->path);
+
+    l->size = lseek(l->fd, 0, SEEK_END);
+    sys_fail_if(l->size < 0, "lseek()");
+
+    l->max_size   = max_size;
+    l->keep       = keep;
+    l->timestamps = timestamps;
+    l->bol        = true;
+
+    return l;
+}
+
+void logfile_close(struct logfile *l) {
+    if (!l)
+        return;
+
+    logfile_flush(l);
+
+    while (l->inflight)
+        log_reap(l, 1);
+
+    if (l->uring_checked)
+        uring_free(&l->uring);
+
+    closep(&l->fd);
+
+    free(l->path);
+    free(l);
+}
+
+void logfile_write(struct logfile *l, const char *buf, size_t len) {
+    char stamp[32];
+    size_t stamp_len = 0;
+
+    log_reap(l, 0);
+
+    if (l->timestamps) {
+        struct tm tm;
+        struct timespec ts;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        localtime_r(&ts.tv_sec, &tm);
+
+        stamp_len = strftime(stamp, sizeof(stamp), "[%F %T", &tm);
+        stamp_len += snprintf(stamp + stamp_len, sizeof(stamp) - stamp_len,
+                              ".%03ld] ", ts.tv_nsec / 1000000);
+    }
+
+    while (len) {
+        const char *nl = l->timestamps ? memchr(buf, '\n', len) : NULL;
+        size_t n = nl ? (size_t) (nl - buf) + 1 : len;
+
+        if (l->timestamps && l->bol)
+            log_append(l, stamp, stamp_len);
+
+        log_append(l, buf, n);
+
+        l->bol = nl != NULL;
+
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Start writing whatever output was collected so far. */
+void logfile_flush(struct logfile *l) {
+    log_reap(l, 0);
+
+    if (l->bufs[l->cur].len && !l->bufs[l->cur].busy) {
+        log_submit(l, l->cur);
+
+        l->cur = (l->cur + 1) % LOG_BUF_COUNT;
+    }
+}
+
+static void log_append(struct logfile *l, const char *buf, size_t len) {
+    while (len) {
+        struct log_buf *b = &l->bufs[l->cur];
+        size_t n;
+
+        if (b->busy) {
+            l->dropped += len;
+            return;
+        }
+
+        if (l->dropped) {
+            char marker[64];
+
+            int rc = snprintf(marker, sizeof(marker),
+                              "\n[pflask: %" PRIu64 " bytes dropped]\n",
+                              l->dropped);
+
+            /* the marker goes in a buffer of its own if needed */
+            if ((size_t) rc > LOG_BUF_SIZE - b->len) {
+                log_submit(l, l->cur);
+
+                l->cur = (l->cur + 1) % LOG_BUF_COUNT;
+                continue;
+            }
+
+            memcpy(b->data + b->len, marker, rc);
+            b->len += rc;
+
+            l->dropped = 0;
+        }
+
+        n = MIN(len, LOG_BUF_SIZE - b->len);
+
+        memcpy(b->data + b->len, buf, n);
+        b->len += n;
+
+        buf += n;
+        len -= n;
+
+        if (b->len == LOG_BUF_SIZE) {
+            log_submit(l, l->cur);
+
+            l->cur = (l->cur + 1) % LOG_BUF_COUNT;
+        }
+    }
+}
+
+static void log_submit(struct logfile *l, unsigned int i) {
+    struct io_uring_sqe *sqe;
+    struct log_buf *b = &l->bufs[i];
+
+    /* the ring is only set up once the output starts, as the process
+     * that opened the log may be about to daemonize */
+    if (!l->uring_checked) {
+        l->uring_checked = true;
+        l->use_uring = uring_init(&l->uring, LOG_BUF_COUNT * 2) == 0;
+    }
+
+    if (!b->done) {
+        if (l->max_size && l->size && (l->size + b->len > l->max_size))
+            log_rotate(l);
+
+        b->off = l->size;
+        b->gen = l->gen;
+
+        l->size += b->len;
+    }
+
+    sqe = l->use_uring ? uring_get_sqe(&l->uring) : NULL;
+    if (!sqe) {
+        /* the rest of a short write is no longer in flight once it's
+         * written out here */
+        if (b->busy)
+            l->inflight--;
+
+        log_write_sync(l, b);
+        return;
+    }
+
+    sqe->opcode    = IORING_OP_WRITE;
+    sqe->fd        = l->fd;
+    sqe->addr      = (uintptr_t) (b->data + b->done);
+    sqe->len       = b->len - b->done;
+    sqe->off       = b->off + b->done;
+    sqe->user_data = i;
+
+    if (!b->busy)
+        l->inflight++;
+
+    b->busy = true;
+
+    if (uring_submit(&l->uring, 0) < 0)
+        sysf_printf("io_uring_enter()");
+}
+
+static void log_reap(struct logfile *l, unsigned int wait_nr) {
+    struct io_uring_cqe *cqe;
+
+    if (!l->inflight)
+        return;
+
+    if (wait_nr && (uring_submit(&l->uring, wait_nr) < 0))
+        sysf_printf("io_uring_enter()");
+
+    while ((cqe = uring_peek_cqe(&l->uring)) != NULL) {
+        unsigned int i = cqe->user_data;
+        int res = cqe->res;
+
+        struct log_buf *b = &l->bufs[i];
+
+        uring_cqe_seen(&l->uring);
+
+        /* the kernel supports io_uring, but not IORING_OP_WRITE; the ring
+         * is kept around until the log is closed, as other writes may
+         * still be in flight */
+        if (res == -EINVAL) {
+            l->use_uring = false;
+
+            log_write_sync(l, b);
+            l->inflight--;
+            continue;
+        }
+
+        if (res < 0) {
+            errno = -res;
+            err_printf("Error writing output log: %s", strerror(errno));
+        } else if (b->done + res < b->len) {
+            b->done += res;
+
+            /* the rest of a short write can't go to a rotated file */
+            if (b->gen == l->gen) {
+                log_submit(l, i);
+                continue;
+            }
+
+            l->dropped += b->len - b->done;
+        }
+
+        b->busy = false;
+        b->len  = b->done = 0;
+
+        l->inflight--;
+    }
+}
+
+static void log_write_sync(struct logfile *l, struct log_buf *b) {
+    ssize_t rc;
+
+    while (b->done < b->len) {
+        rc = pwrite(l->fd, b->data + b->done, b->len - b->done,
+                    b->off + b->done);
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        if (rc < 0) {
+            err_printf("Error writing output log: %s", strerror(errno));
+            break;
+        }
+
+        b->done += rc;
+    }
+
+    b->busy = false;
+    b->len  = b->done = 0;
+}
+
+/* Move path to path.1, path.1 to path.2 and so on, dropping the oldest, and
+ * start over with an empty file. */
+static void log_rotate(struct logfile *l) {
+    int rc;
+
+    if (!l->keep) {
+        rc = unlink(l->path);
+        sys_fail_if((rc < 0) && (errno != ENOENT), "unlink(%s)", l->path);
+    }
+
+    for (unsigned int i = l->keep; i > 0; i--) {
+        _free_ char *from = NULL;
+        _free_ char *to   = NULL;
+
+        if (i > 1)
+            rc = asprintf(&from, "%s.%u", l->path, i - 1);
+        else
+            rc = asprintf(&from, "%s", l->path);
+        fail_if(rc < 0, "OOM");
+
+        rc = asprintf(&to, "%s.%u", l->path, i);
+        fail_if(rc < 0, "OOM");
+
+        rc = rename(from, to);
+        sys_fail_if((rc < 0) && (errno != ENOENT), "rename(%s)", from);
+    }
+
+    /* writes that are still in flight keep their reference to the old
+     * file, so it can be closed right away */
+    closep(&l->fd);
+
+    l->fd   = log_open_fd(l->path);
+    l->size = 0;
+
+    l->gen++;
+}
+
+static int log_open_fd(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    sys_fail_if(fd < 0, "Error opening output log '%s'", path);
+
+    return fd;
+}
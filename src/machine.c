@@ -36,11 +36,13 @@
 #include "printf.h"
 #include "util.h"
 
+/* kept open across containers launched by the same process */
+static DBusConnection *conn = NULL;
+
 void register_machine(pid_t pid, const char *dest) {
     int rc;
 
     DBusError err;
-    DBusConnection *conn;
 
     DBusMessageIter args;
     DBusMessage *req, *rep;
@@ -58,9 +60,20 @@ void register_machine(pid_t pid, const char *dest) {
     rc = asprintf(&name, "pflask-%d", pid);
     fail_if(rc < 0, "OOM");
 
-    conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, &err);
-    if (dbus_error_is_set(&err))
-        return;
+    if (conn && !dbus_connection_get_is_connected(conn)) {
+        dbus_connection_unref(conn);
+        conn = NULL;
+    }
+
+    if (!conn) {
+        conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, &err);
+        if (dbus_error_is_set(&err)) {
+            dbus_error_free(&err);
+            return;
+        }
+
+        dbus_connection_set_exit_on_disconnect(conn, FALSE);
+    }
 
     req = dbus_message_new_method_call(
         "org.freedesktop.machine1",
@@ -120,6 +133,5 @@ void register_machine(pid_t pid, const char *dest) {
 done:
     dbus_message_unref(req);
 
-    dbus_connection_close(conn);
     dbus_error_free(&err);
 }
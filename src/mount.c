@@ -30,9 +30,13 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
 
+#include <dirent.h>
+
+#include <sys/file.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -41,6 +45,7 @@
 
 #include "ut/utlist.h"
 
+#include "dev.h"
 #include "mount.h"
 #include "path.h"
 #include "printf.h"
@@ -56,13 +61,27 @@ struct mount {
     struct mount *next, *prev;
 };
 
+#define SNAPSHOT_BASE RUN_DIR "/snapshots"
+
 struct overlay {
     char *overlay;
     char *workdir;
     char type;
 };
 
+#ifdef MOUNT_ATTR_RDONLY
+static bool new_mount_api = true;
+
+static int new_mount(struct mount *m, struct mount *remount,
+                     const char *dest);
+#endif
+
 static void make_bind_dest(struct mount *m, const char *dest);
+static void make_mount_dest(const char *dest);
+static bool is_bind(struct mount *m);
+static char *snapshot_spec(struct mount *mounts, const char *dest);
+static bool snapshot_matches(const char *path, const char *spec);
+static void write_file(const char *path, const char *data);
 static void make_overlay_opts(struct mount *m, const char *dest);
 static void mount_add_overlay(struct mount **mounts, const char *overlay,
                               const char *dst, const char *work);
@@ -135,11 +154,187 @@ void mount_add_from_spec(struct mount **mounts, const char *spec) {
     }
 }
 
-void setup_mount(struct mount *mounts, const char *dest, const char *ephemeral_dir) {
+char *prepare_snapshot(struct mount *mounts, const char *dest) {
+    int rc;
+
+    struct stat sb;
+
+    struct mount *i = NULL;
+
+    _free_ char *spec = snapshot_spec(mounts, dest);
+
+    char *root = NULL;
+
+    /* FNV-1a of everything that ends up in the snapshot, a collision just
+     * moves on to the next key */
+    uint64_t key = 0xcbf29ce484222325ULL;
+
+    for (const char *p = spec; *p; p++)
+        key = (key ^ (unsigned char) *p) * 0x100000001b3ULL;
+
+    make_mount_dest(RUN_DIR);
+    make_mount_dest(SNAPSHOT_BASE);
+
+    for (;; key++) {
+        _close_ int lock_fd = -1;
+
+        _free_ char *base = NULL;
+        _free_ char *lock = NULL;
+        _free_ char *ready = NULL;
+        _free_ char *spec_path = NULL;
+
+        rc = asprintf(&base, SNAPSHOT_BASE "/%016llx",
+                      (unsigned long long) key);
+        fail_if(rc < 0, "OOM");
+
+        rc = asprintf(&lock, "%s.lock", base);
+        fail_if(rc < 0, "OOM");
+
+        rc = asprintf(&ready, "%s.ready", base);
+        fail_if(rc < 0, "OOM");
+
+        rc = asprintf(&spec_path, "%s.spec", base);
+        fail_if(rc < 0, "OOM");
+
+        lock_fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        sys_fail_if(lock_fd < 0, "Error opening '%s'", lock);
+
+        rc = flock(lock_fd, LOCK_EX);
+        sys_fail_if(rc < 0, "Error locking '%s'", lock);
+
+        root = path_prefix_root(base, "root");
+        fail_if(!root, "OOM");
+
+        if (!stat(ready, &sb)) {
+            if (snapshot_matches(spec_path, spec))
+                return root;
+
+            freep(&root);
+            continue;
+        }
+
+        /* a previous attempt may have been interrupted half-way */
+        umount2(root, MNT_DETACH);
+
+        make_mount_dest(base);
+        make_mount_dest(root);
+
+        rc = mount(dest, root, NULL, MS_BIND | MS_REC, NULL);
+        sys_fail_if(rc < 0, "Error bind mounting '%s'", dest);
+
+        /* keep the containers' mounts from propagating back */
+        rc = mount(NULL, root, NULL, MS_PRIVATE | MS_REC, NULL);
+        sys_fail_if(rc < 0, "Error making '%s' private", root);
+
+        DL_FOREACH(mounts, i) {
+            _free_ char *mnt_dest = NULL;
+
+            if (!is_bind(i))
+                continue;
+
+            mnt_dest = path_prefix_root(root, i->dst);
+
+            make_bind_dest(i, mnt_dest);
+
+            rc = mount(i->src, mnt_dest, NULL, i->flags, NULL);
+            sys_fail_if(rc < 0, "Error mounting '%s'", i->type);
+        }
+
+        write_file(spec_path, spec);
+        write_file(ready, "");
+
+        return root;
+    }
+}
+
+/* Unmount all the snapshots prepared by prepare_snapshot(). The containers
+ * already running keep their own copy of the tree, but the ones being started
+ * from a snapshot at the same time may find it gone. */
+void drop_snapshots(void) {
+    int rc;
+
+    struct dirent *de;
+
+    DIR *dir = opendir(SNAPSHOT_BASE);
+    if (!dir && (errno == ENOENT))
+        return;
+
+    sys_fail_if(!dir, "Error opening '%s'", SNAPSHOT_BASE);
+
+    while ((de = readdir(dir)) != NULL) {
+        size_t len = strlen(de->d_name);
+
+        _close_ int lock_fd = -1;
+
+        _free_ char *base = NULL;
+        _free_ char *path = NULL;
+
+        if ((len <= 5) || strcmp(de->d_name + len - 5, ".lock"))
+            continue;
+
+        rc = asprintf(&base, SNAPSHOT_BASE "/%.*s", (int) len - 5,
+                      de->d_name);
+        fail_if(rc < 0, "OOM");
+
+        rc = asprintf(&path, SNAPSHOT_BASE "/%s", de->d_name);
+        fail_if(rc < 0, "OOM");
+
+        /* wait for a snapshot being prepared, the lock itself is kept so
+         * that the launches waiting on it don't race a new one */
+        lock_fd = open(path, O_RDWR | O_CLOEXEC);
+        sys_fail_if(lock_fd < 0, "Error opening '%s'", path);
+
+        rc = flock(lock_fd, LOCK_EX);
+        sys_fail_if(rc < 0, "Error locking '%s'", path);
+
+        freep(&path);
+
+        rc = asprintf(&path, "%s.ready", base);
+        fail_if(rc < 0, "OOM");
+
+        rc = unlink(path);
+        sys_fail_if((rc < 0) && (errno != ENOENT), "Error removing '%s'",
+                    path);
+
+        freep(&path);
+
+        rc = asprintf(&path, "%s.spec", base);
+        fail_if(rc < 0, "OOM");
+
+        rc = unlink(path);
+        sys_fail_if((rc < 0) && (errno != ENOENT), "Error removing '%s'",
+                    path);
+
+        freep(&path);
+
+        path = path_prefix_root(base, "root");
+        fail_if(!path, "OOM");
+
+        rc = umount2(path, MNT_DETACH);
+        sys_fail_if((rc < 0) && (errno != EINVAL) && (errno != ENOENT),
+                    "Error unmounting '%s'", path);
+
+        rc = rmdir(path);
+        sys_fail_if((rc < 0) && (errno != ENOENT), "Error removing '%s'",
+                    path);
+
+        rc = rmdir(base);
+        sys_fail_if((rc < 0) && (errno != ENOENT), "Error removing '%s'",
+                    base);
+    }
+
+    closedir(dir);
+}
+
+void setup_mount(struct mount **mounts, const char *dest,
+                 const char *ephemeral_dir, bool dev_template,
+                 const char *snapshot) {
     int rc;
 
     struct mount *sys_mounts = NULL;
     struct mount *i = NULL;
+    struct mount *tmp = NULL;
+    struct mount *skip = NULL;
 
     _free_ char *mount_spec = NULL;
 
@@ -152,6 +347,35 @@ void setup_mount(struct mount *mounts, const char *dest, const char *ephemeral_d
     sys_fail_if(rc < 0, "Error mounting slave /");
 
     if (dest != NULL) {
+        if (snapshot != NULL) {
+            mount_add(&sys_mounts, snapshot, "/", "snapshot",
+                      MS_BIND | MS_REC, NULL);
+
+            DL_FOREACH_SAFE(*mounts, i, tmp) {
+                if (!is_bind(i))
+                    continue;
+
+                /* the overlay hides the mounts below it, so the binds
+                 * are cloned from the snapshot on top of it instead */
+                if (ephemeral_dir && !(i->flags & MS_REMOUNT)) {
+                    free(i->src);
+
+                    i->src = path_prefix_root(snapshot, i->dst);
+                    fail_if(!i->src, "OOM");
+
+                    i->flags |= MS_REC;
+                    continue;
+                }
+
+                DL_DELETE(*mounts, i);
+
+                free(i->src);
+                free(i->dst);
+                free(i->type);
+                free(i);
+            }
+        }
+
         if (ephemeral_dir != NULL) {
             rc = mount("tmpfs", ephemeral_dir, "tmpfs", 0, NULL);
             sys_fail_if(rc < 0, "Error mounting tmpfs");
@@ -184,8 +408,18 @@ void setup_mount(struct mount *mounts, const char *dest, const char *ephemeral_d
         mount_add(&sys_mounts, "sysfs", "/sys", "sysfs",
                   MS_NOSUID | MS_NOEXEC | MS_NODEV | MS_RDONLY, NULL);
 
-        mount_add(&sys_mounts, "tmpfs", "/dev", "tmpfs",
-                  MS_NOSUID | MS_STRICTATIME, "mode=755");
+        if (dev_template) {
+            /* the template tmpfs is shared by all containers, so only
+             * the nodes mounted on it are left writable */
+            mount_add(&sys_mounts, DEV_TEMPLATE_DIR, "/dev", "dev",
+                      MS_BIND | MS_REC, NULL);
+
+            mount_add(&sys_mounts, NULL, "/dev", "dev-ro",
+                      MS_BIND | MS_NOSUID | MS_RDONLY | MS_REMOUNT, NULL);
+        } else {
+            mount_add(&sys_mounts, "tmpfs", "/dev", "tmpfs",
+                      MS_NOSUID | MS_STRICTATIME, "mode=755");
+        }
 
         mount_add(&sys_mounts, "devpts", "/dev/pts", "devpts",
                   MS_NOSUID | MS_NOEXEC,
@@ -201,40 +435,189 @@ void setup_mount(struct mount *mounts, const char *dest, const char *ephemeral_d
                   MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL);
     }
 
-    DL_CONCAT(sys_mounts, mounts);
+    DL_CONCAT(sys_mounts, *mounts);
 
     DL_FOREACH(sys_mounts, i) {
-        _free_ char *mnt_dest = path_prefix_root(dest, i->dst);
+        _free_ char *mnt_dest = NULL;
+
+        if (i == skip)
+            continue;
+
+        mnt_dest = path_prefix_root(dest, i->dst);
 
         if (!strcmp(i->type, "overlay"))
             make_overlay_opts(i, mnt_dest);
 
-        if (!strcmp(i->type, "bind") || !strcmp(i->type, "bind-ro")) {
+        if (is_bind(i))
             make_bind_dest(i, mnt_dest);
-        } else {
-            rc = mkdir(mnt_dest, 0755);
-            if (rc < 0) {
-                struct stat sb;
-
-                switch (errno) {
-                case EEXIST:
-                    if (!stat(mnt_dest, &sb) &&
-                        !S_ISDIR(sb.st_mode))
-                        fail_printf("Not a directory");
-                    break;
-
-                default:
-                    sysf_printf("mkdir(%s)", mnt_dest);
-                    break;
-                }
+        else
+            make_mount_dest(mnt_dest);
+
+#ifdef MOUNT_ATTR_RDONLY
+        /* a remount that couldn't be folded into its bind, because that
+         * fell back to mount(2), is applied to the target as it is */
+        if (new_mount_api && !(i->flags & MS_REMOUNT)) {
+            struct mount *remount = NULL;
+
+            /* fold the remount pass of bind-ro and proc/sys-ro into the
+             * bind itself, so the mount is attached already read-only */
+            if (i->next && (i->next->flags & MS_REMOUNT) &&
+                !strcmp(i->next->dst, i->dst))
+                remount = i->next;
+
+            rc = new_mount(i, remount, mnt_dest);
+            if (rc == 0) {
+                skip = remount;
+                continue;
             }
+
+            /* nothing was attached, retry with mount(2) */
+            if (errno == ENOSYS)
+                new_mount_api = false;
         }
+#endif
 
         rc = mount(i->src, mnt_dest, i->type, i->flags, i->data);
         sys_fail_if(rc < 0, "Error mounting '%s'", i->type);
     }
 }
 
+#ifdef MOUNT_ATTR_RDONLY
+static uint64_t mount_attr_from_flags(unsigned long flags) {
+    uint64_t attr = 0;
+
+    if (flags & MS_RDONLY)
+        attr |= MOUNT_ATTR_RDONLY;
+
+    if (flags & MS_NOSUID)
+        attr |= MOUNT_ATTR_NOSUID;
+
+    if (flags & MS_NODEV)
+        attr |= MOUNT_ATTR_NODEV;
+
+    if (flags & MS_NOEXEC)
+        attr |= MOUNT_ATTR_NOEXEC;
+
+    if (flags & MS_STRICTATIME)
+        attr |= MOUNT_ATTR_STRICTATIME;
+
+    return attr;
+}
+
+static int config_fs(int fs_fd, struct mount *m) {
+    int rc;
+    size_t c;
+
+    _free_ char **opts = NULL;
+
+    _free_ char *tmp = NULL;
+
+    if (m->src) {
+        rc = fsconfig(fs_fd, FSCONFIG_SET_STRING, "source", m->src, 0);
+        if (rc < 0)
+            return -1;
+    }
+
+    if (!m->data)
+        return 0;
+
+    tmp = strdup(m->data);
+    fail_if(!tmp, "OOM");
+
+    c = split_str(tmp, &opts, ",");
+
+    for (size_t i = 0; i < c; i++) {
+        char *val = strchr(opts[i], '=');
+
+        if (val) {
+            *val++ = '\0';
+
+            rc = fsconfig(fs_fd, FSCONFIG_SET_STRING, opts[i], val, 0);
+        } else {
+            rc = fsconfig(fs_fd, FSCONFIG_SET_FLAG, opts[i], NULL, 0);
+        }
+
+        if (rc < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int new_mount(struct mount *m, struct mount *remount,
+                     const char *dest) {
+    int rc;
+
+    _close_ int fs_fd  = -1;
+    _close_ int mnt_fd = -1;
+
+    struct mount_attr attr = { 0 };
+
+    attr.attr_set = mount_attr_from_flags(m->flags);
+
+    if (remount)
+        attr.attr_set |= mount_attr_from_flags(remount->flags);
+
+    if (m->flags & MS_BIND) {
+        mnt_fd = open_tree(AT_FDCWD, m->src,
+                           OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC |
+                           ((m->flags & MS_REC) ? AT_RECURSIVE : 0));
+        if (mnt_fd < 0)
+            return -1;
+
+        /* like a MS_REMOUNT, this only changes the top-level mount */
+        if (attr.attr_set) {
+            rc = mount_setattr(mnt_fd, "", AT_EMPTY_PATH,
+                               &attr, sizeof(attr));
+            if (rc < 0)
+                return -1;
+        }
+    } else {
+        fs_fd = fsopen(m->type, FSOPEN_CLOEXEC);
+        if (fs_fd < 0)
+            return -1;
+
+        rc = config_fs(fs_fd, m);
+        if (rc < 0)
+            return -1;
+
+        rc = fsconfig(fs_fd, FSCONFIG_CMD_CREATE, NULL, NULL, 0);
+        if (rc < 0)
+            return -1;
+
+        mnt_fd = fsmount(fs_fd, FSMOUNT_CLOEXEC, attr.attr_set);
+        if (mnt_fd < 0)
+            return -1;
+    }
+
+    return move_mount(mnt_fd, "", AT_FDCWD, dest, MOVE_MOUNT_F_EMPTY_PATH);
+}
+#endif
+
+static bool is_bind(struct mount *m) {
+    return !strcmp(m->type, "bind") || !strcmp(m->type, "bind-ro");
+}
+
+static void make_mount_dest(const char *dest) {
+    int rc;
+
+    struct stat sb;
+
+    rc = mkdir(dest, 0755);
+    if (rc < 0) {
+        switch (errno) {
+        case EEXIST:
+            if (!stat(dest, &sb) && !S_ISDIR(sb.st_mode))
+                fail_printf("Not a directory");
+            break;
+
+        default:
+            sysf_printf("mkdir(%s)", dest);
+            break;
+        }
+    }
+}
+
 static void make_bind_dest(struct mount *m, const char *dest) {
     int rc;
 
@@ -310,3 +693,70 @@ static void mount_add_overlay(struct mount **mounts, const char *overlay,
 
     mount_add(mounts, NULL, dst, "overlay", 0, ovl);
 }
+
+/* Describe the snapshot of dest and the bind mounts, with the paths on the
+ * host resolved so that the same tree always gets the same description. */
+static char *snapshot_spec(struct mount *mounts, const char *dest) {
+    int rc;
+
+    struct mount *i = NULL;
+
+    char *spec = NULL;
+
+    _free_ char *path = realpath(dest, NULL);
+    sys_fail_if(!path, "Error resolving '%s'", dest);
+
+    rc = asprintf(&spec, "root %s\n", path);
+    fail_if(rc < 0, "OOM");
+
+    DL_FOREACH(mounts, i) {
+        char *tmp = spec;
+
+        _free_ char *src = NULL;
+
+        if (!is_bind(i))
+            continue;
+
+        src = realpath(i->src, NULL);
+        sys_fail_if(!src, "Error resolving '%s'", i->src);
+
+        rc = asprintf(&spec, "%s%s %s %s\n", tmp, i->type, src, i->dst);
+        fail_if(rc < 0, "OOM");
+
+        free(tmp);
+    }
+
+    return spec;
+}
+
+/* Check whether the snapshot described by the file at path is spec. */
+static bool snapshot_matches(const char *path, const char *spec) {
+    ssize_t rc;
+
+    size_t len = strlen(spec);
+
+    _free_ char *buf = malloc(len + 1);
+    fail_if(!buf, "OOM");
+
+    _close_ int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    /* one byte more than needed, to catch a longer description */
+    rc = read(fd, buf, len + 1);
+
+    return (rc == (ssize_t) len) && !memcmp(buf, spec, len);
+}
+
+static void write_file(const char *path, const char *data) {
+    int rc;
+
+    size_t len = strlen(data);
+
+    _close_ int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                          0644);
+    sys_fail_if(fd < 0, "Error creating '%s'", path);
+
+    rc = write(fd, data, len);
+    sys_fail_if(rc != (int) len, "Error writing '%s'", path);
+}
@@ -35,4 +35,9 @@ void mount_add(struct mount **mounts, const char *src, const char *dst,
 
 void mount_add_from_spec(struct mount **mounts, const char *spec);
 
-void setup_mount(struct mount *mounts, const char *dest, const char *ephemeral_dir);
+char *prepare_snapshot(struct mount *mounts, const char *dest);
+void drop_snapshots(void);
+
+void setup_mount(struct mount **mounts, const char *dest,
+                 const char *ephemeral_dir, bool dev_template,
+                 const char *snapshot);
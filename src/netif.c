@@ -29,9 +29,17 @@
  */
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
 
 #include <net/if.h>
+#include <arpa/inet.h>
 
 #include <linux/rtnetlink.h>
 #include <linux/veth.h>
@@ -43,23 +51,118 @@
 #include "printf.h"
 #include "util.h"
 
+struct netif_addr {
+    int family;
+    unsigned char addr[sizeof(struct in6_addr)];
+    int prefix;
+
+    struct netif_addr *next, *prev;
+};
+
 struct netif {
     enum netif_type type;
 
     char *dev;
     char *name;
 
+    /* applied from inside the container by config_netif() */
+    bool up;
+    bool nodad;
+    struct netif_addr *addrs;
+    struct netif_addr *gws;
+
     struct netif *next, *prev;
 } netif;
 
-static void if_up(int sock, int if_index);
-static void move_and_rename_if(int sock, pid_t pid, int i, char *new_name);
-static void create_macvlan(int sock, int master, char *name);
-static void create_ipvlan(int sock, int master, char *name);
-static void create_veth_pair(int sock, char *name_out, char *name_in);
+/* A veth pair created ahead of time, with the host end already attached to
+ * the bridge and up, and the peer waiting in the host to be moved into a
+ * container. */
+struct veth_pair {
+    char host[IFNAMSIZ];
+    char peer[IFNAMSIZ];
+
+    int peer_index;
+
+    struct veth_pool *pool;
+
+    struct veth_pair *next, *prev;
+};
+
+struct veth_pool {
+    char *bridge;
+    int master;
+
+    /* set when the pairs can't be created, the containers then fall back to
+     * creating their own */
+    bool broken;
+
+    struct veth_pair *ready;
+
+    /* the pairs either ready or being created */
+    unsigned int count;
+
+    struct veth_pool *next, *prev;
+};
+
+/* kept open across containers launched by the same process */
+static int nl_sock = -1;
+
+/* the connection to the process that creates the pool's pairs */
+static int pool_fd = -1;
+static pid_t pool_helper = -1;
+
+static unsigned int pool_size = 0;
+static unsigned int pool_seq = 0;
+
+static struct veth_pool *pools = NULL;
+
+/* the pairs being created, in the same order as the requests to the helper */
+static struct veth_pair *pool_creating = NULL;
+
+/* A pair to be created by the helper, and the outcome. */
+struct pool_req {
+    int master;
+    char host[IFNAMSIZ];
+    char peer[IFNAMSIZ];
+};
+
+struct pool_reply {
+    int peer_index;
+    int error;
+};
+
+static void if_up(struct nl_batch *b, int if_index);
+static void move_and_rename_if(struct nl_batch *b, pid_t pid, int i,
+                               char *new_name);
+static void create_macvlan(struct nl_batch *b, pid_t pid, int master,
+                           char *name);
+static void create_ipvlan(struct nl_batch *b, pid_t pid, int master,
+                          char *name);
+static void create_veth_pair(struct nl_batch *b, pid_t pid, char *name_out,
+                             char *name_in);
+static void create_bridge_veth(struct nl_batch *b, pid_t pid, int master,
+                               char *name_out, char *name_in);
+static void delete_if(struct nl_batch *b, char *name);
+static void add_addr(struct nl_batch *b, int if_index, char *name,
+                     struct netif_addr *a, bool nodad);
+static void add_default_route(struct nl_batch *b, int if_index, char *name,
+                              struct netif_addr *gw);
+
+static size_t split_netif_spec(char *spec, char ***dest);
+static void parse_addr(struct netif_addr **list, const char *spec,
+                       const char *str, bool with_prefix);
+static void parse_netif_opts(struct netif *nif, const char *spec,
+                             char **opts, size_t count);
+
+static struct veth_pool *pool_find(const char *bridge);
+static struct veth_pair *pool_take(const char *bridge);
+static void pool_name(char *name, char kind);
+static void pair_created(struct nlmsghdr *hdr, void *data);
+static void pool_serve(int fd);
+static void pool_lost(void);
 
 void netif_add(struct netif **ifs, enum netif_type type, char *dev, char *name) {
-    struct netif *nif = malloc(sizeof(struct netif));
+    struct netif *nif = calloc(1, sizeof(struct netif));
     fail_if(!nif, "OOM");
 
     nif->dev  = strdup(dev);
@@ -73,107 +176,407 @@ void netif_add_from_spec(struct netif **ifs, const char *spec) {
     _free_ char *tmp = NULL;
     _free_ char **opts = NULL;
 
+    size_t n;
+
     if (!spec) return;
 
     tmp = strdup(spec);
     fail_if(!tmp, "OOM");
 
-    size_t c = split_str(tmp, &opts, ":");
-    fail_if(!c, "Invalid netif spec '%s': not enough args", spec);
+    size_t c = split_netif_spec(tmp, &opts);
+    fail_if(!c, "Invalid netif spec '%s'", spec);
 
     if (if_nametoindex(opts[0])) {
         fail_if(c < 2, "Invalid netif spec '%s': not enough args",spec);
 
         netif_add(ifs, MOVE, opts[0], opts[1]);
+        n = 2;
     } else if (!strncmp(opts[0], "macvlan", 8)) {
         fail_if(c < 3, "Invalid netif spec '%s': not enough args",spec);
 
         netif_add(ifs, MACVLAN, opts[1], opts[2]);
+        n = 3;
     } else if (!strncmp(opts[0], "ipvlan", 8)) {
         fail_if(c < 3, "Invalid netif spec '%s': not enough args",spec);
 
         netif_add(ifs, IPVLAN, opts[1], opts[2]);
+        n = 3;
     } else if (!strncmp(opts[0], "veth", 5)) {
         fail_if(c < 3, "Invalid netif spec '%s': not enough args",spec);
 
         netif_add(ifs, VETH, opts[1], opts[2]);
+        n = 3;
+    } else if (!strncmp(opts[0], "bridge", 7)) {
+        fail_if(c < 3, "Invalid netif spec '%s': not enough args",spec);
+
+        netif_add(ifs, BRIDGE, opts[1], opts[2]);
+        n = 3;
     } else {
         fail_printf("Invalid netif spec '%s'", spec);
     }
+
+    parse_netif_opts((*ifs)->prev, spec, opts + n, c - n);
 }
 
+/* The interfaces are set up with a single batch of netlink requests: the new
+ * ones are created directly inside the container with their final name, and
+ * the existing ones are moved there and renamed. The veth pairs attached to a
+ * bridge are taken from the pool when there is one, so that only the peer has
+ * to be moved. */
 void setup_netif(struct netif *ifs, pid_t pid) {
-    int rc;
-    _close_ int sock = nl_open();
+    int sock;
+
+    ssize_t failed;
+
+    size_t n = 0;
 
     struct netif *i = NULL;
 
+    struct nl_batch batch = { 0 };
+    struct nl_batch undo = { 0 };
+
+    /* the host end of the bridge pairs, for cleaning up on failure */
+    _free_ char (*hosts)[IFNAMSIZ] = NULL;
+
+    if (!ifs)
+        return;
+
+    if (nl_sock < 0)
+        nl_sock = nl_open();
+
+    sock = nl_sock;
+
+    DL_FOREACH(ifs, i)
+        n++;
+
+    hosts = calloc(n, IFNAMSIZ);
+    fail_if(!hosts, "OOM");
+
+    n = 0;
+
     DL_FOREACH(ifs, i) {
         unsigned int if_index = 0;
 
-        switch (i->type) {
-        case MACVLAN: {
-            _free_ char *name = NULL;
-
-            rc = asprintf(&name, "pflask-%d", pid);
-            fail_if(rc < 0, "OOM");
+        struct veth_pair *pair = NULL;
 
+        if (i->type != VETH) {
             if_index = if_nametoindex(i->dev);
             sys_fail_if(!if_index, "Error searching for '%s'", i->dev);
+        }
 
-            create_macvlan(sock, if_index, name);
+        switch (i->type) {
+        case MACVLAN:
+            create_macvlan(&batch, pid, if_index, i->name);
+            break;
 
-            if_index = if_nametoindex(name);
+        case IPVLAN:
+            create_ipvlan(&batch, pid, if_index, i->name);
             break;
-        }
 
-        case IPVLAN: {
-            _free_ char *name = NULL;
+        case VETH:
+            create_veth_pair(&batch, pid, i->dev, i->name);
+            break;
 
-            rc = asprintf(&name, "pflask-%d", pid);
-            fail_if(rc < 0, "OOM");
+        case BRIDGE:
+            pair = pool_take(i->dev);
 
-            if_index = if_nametoindex(i->dev);
-            sys_fail_if(!if_index, "Error searching for '%s'", i->dev);
+            if (pair) {
+                strcpy(hosts[n], pair->host);
+                move_and_rename_if(&batch, pid, pair->peer_index, i->name);
 
-            create_ipvlan(sock, if_index, name);
+                free(pair);
+            } else {
+                pool_name(hosts[n], 'h');
+                create_bridge_veth(&batch, pid, if_index, hosts[n], i->name);
+            }
+            break;
 
-            if_index = if_nametoindex(name);
+        case MOVE:
+            move_and_rename_if(&batch, pid, if_index, i->name);
             break;
         }
 
-        case VETH: {
-            _free_ char *name = NULL;
+        n++;
+    }
 
-            rc = asprintf(&name, "pflask-%d", pid);
-            fail_if(rc < 0, "OOM");
+    failed = nl_batch_send(sock, &batch);
 
-            create_veth_pair(sock, i->dev, name);
+    /* the container is killed on failure, which takes the interfaces inside
+     * it along, but the host end of the veth pairs must go too */
+    if (failed >= 0) {
+        int err = errno;
 
-            if_index = if_nametoindex(name);
-            sys_fail_if(!if_index, "Error searching for '%s'", name);
-            break;
+        n = 0;
+
+        DL_FOREACH(ifs, i) {
+            if ((i->type == VETH) && !batch.reqs[n].error)
+                delete_if(&undo, i->dev);
+
+            /* a pair from the pool is left behind if it couldn't be moved */
+            if (i->type == BRIDGE)
+                delete_if(&undo, hosts[n]);
+
+            n++;
         }
 
-        case MOVE:
-            if_index = if_nametoindex(i->dev);
-            sys_fail_if(!if_index, "Error searching for '%s'", i->dev);
+        nl_batch_send(sock, &undo);
+
+        errno = err;
+        sysf_printf("%s", batch.reqs[failed].what);
+    }
+
+    nl_batch_reset(&batch);
+}
+
+/* Start keeping size veth pairs ready for each of the bridges later added with
+ * netif_pool_add(). The pairs are created by a separate process, one at a
+ * time, so that neither the caller nor the containers being launched have to
+ * wait for the whole refill. Returns the socket whose replies must be handled
+ * with netif_pool_handle() as they arrive. */
+int netif_pool_open(unsigned int size) {
+    int rc;
+
+    int fd[2];
+
+    rc = socketpair(AF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fd);
+    sys_fail_if(rc < 0, "socketpair()");
+
+    pool_helper = fork();
+    sys_fail_if(pool_helper < 0, "fork()");
+
+    if (!pool_helper) {
+        close(fd[0]);
+
+        pool_serve(fd[1]);
+        _exit(0);
+    }
+
+    close(fd[1]);
+
+    pool_fd   = fd[0];
+    pool_size = size;
+
+    return pool_fd;
+}
+
+/* Add the bridges used by the given interfaces to the pool. */
+void netif_pool_add(struct netif *ifs) {
+    struct netif *i = NULL;
+
+    if (pool_fd < 0)
+        return;
+
+    DL_FOREACH(ifs, i) {
+        struct veth_pool *pool;
+
+        if ((i->type != BRIDGE) || pool_find(i->dev))
+            continue;
+
+        pool = calloc(1, sizeof(struct veth_pool));
+        fail_if(!pool, "OOM");
+
+        pool->bridge = strdup(i->dev);
+        fail_if(!pool->bridge, "OOM");
+
+        pool->master = if_nametoindex(i->dev);
+        sys_fail_if(!pool->master, "Error searching for '%s'", i->dev);
+
+        DL_APPEND(pools, pool);
+    }
+}
+
+/* Drop the pairs that setup_netif() takes for the given interfaces from the
+ * pool, when it runs in a process forked from this one: both start from the
+ * same pool, and take the same pairs. */
+void netif_pool_skip(struct netif *ifs) {
+    struct netif *i = NULL;
+
+    DL_FOREACH(ifs, i) {
+        if (i->type == BRIDGE)
+            free(pool_take(i->dev));
+    }
+}
+
+/* Request the pairs missing from the pool. This doesn't wait for them to be
+ * created, so the pool refills while the containers keep being launched. */
+void netif_pool_refill(void) {
+    ssize_t rc;
+
+    struct veth_pool *pool = NULL;
+
+    DL_FOREACH(pools, pool) {
+        if (pool->broken)
+            continue;
+
+        for (; pool->count < pool_size; pool->count++) {
+            struct pool_req req = { .master = pool->master };
+
+            struct veth_pair *pair = calloc(1, sizeof(struct veth_pair));
+            fail_if(!pair, "OOM");
+
+            pair->pool = pool;
+
+            pool_name(pair->host, 'h');
+            pool_name(pair->peer, 'c');
+
+            strcpy(req.host, pair->host);
+            strcpy(req.peer, pair->peer);
+
+            /* the helper is gone, which is handled along with the end of
+             * its connection */
+            rc = send(pool_fd, &req, sizeof(req), MSG_NOSIGNAL);
+            if (rc < 0) {
+                free(pair);
+                return;
+            }
+
+            DL_APPEND(pool_creating, pair);
+        }
+    }
+}
+
+/* Handle the replies of the helper, to be called when its socket becomes
+ * readable. Returns false once the helper is gone, and the socket must no
+ * longer be waited on. */
+bool netif_pool_handle(void) {
+    ssize_t rc;
+
+    struct pool_reply reply;
+
+    struct veth_pool *pool = NULL;
+    struct veth_pair *pair = NULL;
+
+    while (1) {
+        rc = recv(pool_fd, &reply, sizeof(reply), MSG_DONTWAIT);
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        if (rc < 0 && errno == EAGAIN)
+            return true;
+
+        sys_fail_if(rc < 0, "Error receiving veth pool reply");
+
+        if ((rc != sizeof(reply)) || !pool_creating) {
+            pool_lost();
+            return false;
+        }
+
+        pair = pool_creating;
+        pool = pair->pool;
+
+        DL_DELETE(pool_creating, pair);
+
+        if (reply.error) {
+            if (!pool->broken)
+                err_printf("Error filling the pool for '%s': %s",
+                           pool->bridge, strerror(-reply.error));
+
+            /* don't keep retrying, whatever went wrong will most likely
+             * happen again */
+            pool->broken = true;
+            pool->count--;
+
+            free(pair);
+            continue;
+        }
+
+        pair->peer_index = reply.peer_index;
+
+        DL_APPEND(pool->ready, pair);
+    }
+}
+
+/* Delete the pairs that weren't used. */
+void netif_pool_close(void) {
+    int rc;
+
+    struct pollfd pfd;
+
+    struct nl_batch batch = { 0 };
+
+    struct veth_pool *pool = NULL, *ptmp;
+    struct veth_pair *pair = NULL, *tmp;
+
+    if (pool_fd < 0)
+        return;
+
+    pfd.fd = pool_fd; pfd.events = POLLIN;
+
+    while (pool_creating) {
+        rc = poll(&pfd, 1, -1);
+        sys_fail_if((rc < 0) && (errno != EINTR), "poll()");
+
+        if (!netif_pool_handle())
             break;
+    }
+
+    /* the helper exits once the connection is closed */
+    closep(&pool_fd);
+
+    waitpid(pool_helper, NULL, 0);
+
+    DL_FOREACH_SAFE(pools, pool, ptmp) {
+        DL_FOREACH_SAFE(pool->ready, pair, tmp) {
+            delete_if(&batch, pair->host);
+
+            DL_DELETE(pool->ready, pair);
+            free(pair);
         }
 
-        move_and_rename_if(sock, pid, if_index, i->name);
+        DL_DELETE(pools, pool);
+        free(pool->bridge);
+        free(pool);
     }
+
+    if (batch.count) {
+        if (nl_sock < 0)
+            nl_sock = nl_open();
+
+        nl_batch_send(nl_sock, &batch);
+    }
+
+    nl_batch_reset(&batch);
 }
 
-void config_netif(void) {
+/* Runs inside the container: the links are brought up before their addresses
+ * and routes are added, all within the same batch, as the kernel handles the
+ * requests in order. */
+void config_netif(struct netif *ifs) {
     _close_ int sock = nl_open();
-    if_up(sock, 1);
+
+    struct netif *i = NULL;
+
+    struct nl_batch batch = { 0 };
+
+    if_up(&batch, 1);
+
+    DL_FOREACH(ifs, i) {
+        unsigned int if_index;
+
+        struct netif_addr *a = NULL;
+
+        if (!i->up)
+            continue;
+
+        if_index = if_nametoindex(i->name);
+        sys_fail_if(!if_index, "Error searching for '%s'", i->name);
+
+        if_up(&batch, if_index);
+
+        DL_FOREACH(i->addrs, a)
+            add_addr(&batch, if_index, i->name, a, i->nodad);
+
+        DL_FOREACH(i->gws, a)
+            add_default_route(&batch, if_index, i->name, a);
+    }
+
+    nl_batch_commit(sock, &batch);
 }
 
-static void if_up(int sock, int if_index) {
-    _free_ struct nlmsg *req = malloc(NLMSG_GOOD_SIZE);
+static void if_up(struct nl_batch *b, int if_index) {
+    struct nlmsg *req = nl_batch_add(b, "Error bringing up interface %d",
+                                     if_index);
 
-    req->hdr.nlmsg_seq   = 1;
     req->hdr.nlmsg_type  = RTM_NEWLINK;
     req->hdr.nlmsg_len   = NLMSG_LENGTH(sizeof(struct ifinfomsg));
     req->hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
@@ -182,19 +585,65 @@ static void if_up(int sock, int if_index) {
     req->msg.ifi.ifi_index   = if_index;
     req->msg.ifi.ifi_flags   = IFF_UP;
     req->msg.ifi.ifi_change  = IFF_UP;
+}
+
+static void add_addr(struct nl_batch *b, int if_index, char *name,
+                     struct netif_addr *a, bool nodad) {
+    size_t len = (a->family == AF_INET) ? sizeof(struct in_addr)
+                                        : sizeof(struct in6_addr);
+
+    struct nlmsg *req = nl_batch_add(b, "Error adding address to '%s'", name);
+
+    req->hdr.nlmsg_type  = RTM_NEWADDR;
+    req->hdr.nlmsg_len   = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+    req->hdr.nlmsg_flags = NLM_F_REQUEST |
+                             NLM_F_CREATE  |
+                             NLM_F_EXCL    |
+                             NLM_F_ACK;
+
+    req->msg.ifa.ifa_family    = a->family;
+    req->msg.ifa.ifa_prefixlen = a->prefix;
+    req->msg.ifa.ifa_scope     = RT_SCOPE_UNIVERSE;
+    req->msg.ifa.ifa_index     = if_index;
+
+    /* skip Duplicate Address Detection, the address is usable right away */
+    if (nodad && (a->family == AF_INET6))
+        req->msg.ifa.ifa_flags = IFA_F_NODAD;
+
+    rtattr_append(req, IFA_LOCAL, a->addr, len);
+    rtattr_append(req, IFA_ADDRESS, a->addr, len);
+}
+
+static void add_default_route(struct nl_batch *b, int if_index, char *name,
+                              struct netif_addr *gw) {
+    size_t len = (gw->family == AF_INET) ? sizeof(struct in_addr)
+                                         : sizeof(struct in6_addr);
+
+    struct nlmsg *req = nl_batch_add(b, "Error adding default route via '%s'",
+                                     name);
 
-    nl_send(sock, req);
-    nl_recv(sock, req);
+    req->hdr.nlmsg_type  = RTM_NEWROUTE;
+    req->hdr.nlmsg_len   = NLMSG_LENGTH(sizeof(struct rtmsg));
+    req->hdr.nlmsg_flags = NLM_F_REQUEST |
+                             NLM_F_CREATE  |
+                             NLM_F_EXCL    |
+                             NLM_F_ACK;
+
+    req->msg.rtm.rtm_family   = gw->family;
+    req->msg.rtm.rtm_table    = RT_TABLE_MAIN;
+    req->msg.rtm.rtm_protocol = RTPROT_BOOT;
+    req->msg.rtm.rtm_scope    = RT_SCOPE_UNIVERSE;
+    req->msg.rtm.rtm_type     = RTN_UNICAST;
 
-    if (req->hdr.nlmsg_type == NLMSG_ERROR)
-        sys_fail_if(req->msg.err.error < 0,
-                    "Error sending netlink request");
+    rtattr_append(req, RTA_GATEWAY, gw->addr, len);
+    rtattr_append(req, RTA_OIF, &if_index, sizeof(if_index));
 }
 
-static void move_and_rename_if(int sock, pid_t pid, int if_index, char *new_name) {
-    _free_ struct nlmsg *req = malloc(NLMSG_GOOD_SIZE);
+static void move_and_rename_if(struct nl_batch *b, pid_t pid, int if_index,
+                               char *new_name) {
+    struct nlmsg *req = nl_batch_add(b, "Error moving interface '%s'",
+                                     new_name);
 
-    req->hdr.nlmsg_seq   = 1;
     req->hdr.nlmsg_type  = RTM_NEWLINK;
     req->hdr.nlmsg_len   = NLMSG_LENGTH(sizeof(struct ifinfomsg));
     req->hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
@@ -204,21 +653,14 @@ static void move_and_rename_if(int sock, pid_t pid, int if_index, char *new_name
 
     rtattr_append(req, IFLA_NET_NS_PID, &pid, sizeof(pid));
     rtattr_append(req, IFLA_IFNAME, new_name, strlen(new_name) + 1);
-
-    nl_send(sock, req);
-    nl_recv(sock, req);
-
-    if (req->hdr.nlmsg_type == NLMSG_ERROR)
-        sys_fail_if(req->msg.err.error < 0,
-                    "Error sending netlink request");
 }
 
-static void create_macvlan(int sock, int master, char *name) {
+static void create_macvlan(struct nl_batch *b, pid_t pid, int master,
+                           char *name) {
     struct rtattr *nested = NULL;
 
-    _free_ struct nlmsg *req = malloc(NLMSG_GOOD_SIZE);
+    struct nlmsg *req = nl_batch_add(b, "Error creating macvlan '%s'", name);
 
-    req->hdr.nlmsg_seq   = 1;
     req->hdr.nlmsg_type  = RTM_NEWLINK;
     req->hdr.nlmsg_len   = NLMSG_LENGTH(sizeof(struct ifinfomsg));
     req->hdr.nlmsg_flags = NLM_F_REQUEST |
@@ -233,22 +675,16 @@ static void create_macvlan(int sock, int master, char *name) {
     rtattr_end_nested(req, nested);
 
     rtattr_append(req, IFLA_LINK, &master, sizeof(master));
+    rtattr_append(req, IFLA_NET_NS_PID, &pid, sizeof(pid));
     rtattr_append(req, IFLA_IFNAME, name, strlen(name) + 1);
-
-    nl_send(sock, req);
-    nl_recv(sock, req);
-
-    if (req->hdr.nlmsg_type == NLMSG_ERROR)
-        sys_fail_if(req->msg.err.error < 0,
-                    "Error sending netlink request");
 }
 
-static void create_ipvlan(int sock, int master, char *name) {
+static void create_ipvlan(struct nl_batch *b, pid_t pid, int master,
+                          char *name) {
     struct rtattr *nested = NULL;
 
-    _free_ struct nlmsg *req = malloc(NLMSG_GOOD_SIZE);
+    struct nlmsg *req = nl_batch_add(b, "Error creating ipvlan '%s'", name);
 
-    req->hdr.nlmsg_seq   = 1;
     req->hdr.nlmsg_type  = RTM_NEWLINK;
     req->hdr.nlmsg_len   = NLMSG_LENGTH(sizeof(struct ifinfomsg));
     req->hdr.nlmsg_flags = NLM_F_REQUEST |
@@ -263,24 +699,58 @@ static void create_ipvlan(int sock, int master, char *name) {
     rtattr_end_nested(req, nested);
 
     rtattr_append(req, IFLA_LINK, &master, sizeof(master));
+    rtattr_append(req, IFLA_NET_NS_PID, &pid, sizeof(pid));
     rtattr_append(req, IFLA_IFNAME, name, strlen(name) + 1);
+}
+
+static void create_veth_pair(struct nl_batch *b, pid_t pid, char *name_out,
+                             char *name_in) {
+    struct rtattr *nested_info = NULL;
+    struct rtattr *nested_data = NULL;
+    struct rtattr *nested_peer = NULL;
+
+    struct nlmsg *req = nl_batch_add(b, "Error creating veth pair '%s'",
+                                     name_out);
+
+    req->hdr.nlmsg_type  = RTM_NEWLINK;
+    req->hdr.nlmsg_len   = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req->hdr.nlmsg_flags = NLM_F_REQUEST |
+                             NLM_F_CREATE  |
+                             NLM_F_EXCL    |
+                             NLM_F_ACK;
+
+    req->msg.ifi.ifi_family  = AF_UNSPEC;
+
+    nested_info = rtattr_start_nested(req, IFLA_LINKINFO);
+    rtattr_append(req, IFLA_INFO_KIND, "veth", 5);
+
+    nested_data = rtattr_start_nested(req, IFLA_INFO_DATA);
+    nested_peer = rtattr_start_nested(req, VETH_INFO_PEER);
+
+    /* the peer goes straight into the container */
+    req->hdr.nlmsg_len += sizeof(struct ifinfomsg);
+    rtattr_append(req, IFLA_NET_NS_PID, &pid, sizeof(pid));
+    rtattr_append(req, IFLA_IFNAME, name_in, strlen(name_in) + 1);
+
+    rtattr_end_nested(req, nested_peer);
+    rtattr_end_nested(req, nested_data);
 
-    nl_send(sock, req);
-    nl_recv(sock, req);
+    rtattr_end_nested(req, nested_info);
 
-    if (req->hdr.nlmsg_type == NLMSG_ERROR)
-        sys_fail_if(req->msg.err.error < 0,
-                    "Error sending netlink request");
+    rtattr_append(req, IFLA_IFNAME, name_out, strlen(name_out) + 1);
 }
 
-static void create_veth_pair(int sock, char *name_out, char *name_in) {
+/* Create a veth pair whose host end is attached to the master bridge and up.
+ * The peer is created inside the container, unless pid is 0. */
+static void create_bridge_veth(struct nl_batch *b, pid_t pid, int master,
+                               char *name_out, char *name_in) {
     struct rtattr *nested_info = NULL;
     struct rtattr *nested_data = NULL;
     struct rtattr *nested_peer = NULL;
 
-    _free_ struct nlmsg *req = malloc(NLMSG_GOOD_SIZE);
+    struct nlmsg *req = nl_batch_add(b, "Error creating veth pair '%s'",
+                                     name_out);
 
-    req->hdr.nlmsg_seq   = 1;
     req->hdr.nlmsg_type  = RTM_NEWLINK;
     req->hdr.nlmsg_len   = NLMSG_LENGTH(sizeof(struct ifinfomsg));
     req->hdr.nlmsg_flags = NLM_F_REQUEST |
@@ -288,7 +758,13 @@ static void create_veth_pair(int sock, char *name_out, char *name_in) {
                              NLM_F_EXCL    |
                              NLM_F_ACK;
 
+    /* the pool needs the index of the peer that stays in the host */
+    if (!pid)
+        req->hdr.nlmsg_flags |= NLM_F_ECHO;
+
     req->msg.ifi.ifi_family  = AF_UNSPEC;
+    req->msg.ifi.ifi_flags   = IFF_UP;
+    req->msg.ifi.ifi_change  = IFF_UP;
 
     nested_info = rtattr_start_nested(req, IFLA_LINKINFO);
     rtattr_append(req, IFLA_INFO_KIND, "veth", 5);
@@ -297,6 +773,10 @@ static void create_veth_pair(int sock, char *name_out, char *name_in) {
     nested_peer = rtattr_start_nested(req, VETH_INFO_PEER);
 
     req->hdr.nlmsg_len += sizeof(struct ifinfomsg);
+
+    if (pid)
+        rtattr_append(req, IFLA_NET_NS_PID, &pid, sizeof(pid));
+
     rtattr_append(req, IFLA_IFNAME, name_in, strlen(name_in) + 1);
 
     rtattr_end_nested(req, nested_peer);
@@ -304,12 +784,279 @@ static void create_veth_pair(int sock, char *name_out, char *name_in) {
 
     rtattr_end_nested(req, nested_info);
 
+    rtattr_append(req, IFLA_MASTER, &master, sizeof(master));
     rtattr_append(req, IFLA_IFNAME, name_out, strlen(name_out) + 1);
+}
+
+static void delete_if(struct nl_batch *b, char *name) {
+    struct nlmsg *req = nl_batch_add(b, "Error deleting interface '%s'",
+                                     name);
+
+    req->hdr.nlmsg_type  = RTM_DELLINK;
+    req->hdr.nlmsg_len   = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req->hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+
+    req->msg.ifi.ifi_family  = AF_UNSPEC;
+
+    rtattr_append(req, IFLA_IFNAME, name, strlen(name) + 1);
+}
+
+/* Like split_str() on ':', except that the IPv6 addresses are enclosed in
+ * square brackets and their own ':' don't count. Empty fields are rejected. */
+static size_t split_netif_spec(char *spec, char ***dest) {
+    size_t size = 0;
+    int depth = 0;
+
+    char *field = spec;
+
+    for (char *p = spec; ; p++) {
+        if (*p == '[')
+            depth++;
+        else if ((*p == ']') && depth)
+            depth--;
+
+        if (((*p != ':') || depth) && (*p != '\0'))
+            continue;
+
+        if ((p == field) || depth) {
+            free(*dest);
+            *dest = NULL;
+            return 0;
+        }
+
+        char **tmp = realloc(*dest, sizeof(char *) * (size + 1));
+        fail_if(!tmp, "OOM");
+
+        *dest = tmp;
+        (*dest)[size++] = field;
+
+        if (*p == '\0')
+            break;
+
+        *p = '\0';
+        field = p + 1;
+    }
+
+    return size;
+}
+
+static void parse_addr(struct netif_addr **list, const char *spec,
+                       const char *str, bool with_prefix) {
+    int rc;
+
+    _free_ char *tmp = strdup(str);
+
+    char *addr   = NULL;
+    char *prefix = NULL;
+
+    struct netif_addr *a = calloc(1, sizeof(struct netif_addr));
+    fail_if(!tmp || !a, "OOM");
+
+    addr = tmp;
 
-    nl_send(sock, req);
-    nl_recv(sock, req);
+    if (*addr == '[') {
+        char *end = strchr(++addr, ']');
+        fail_if(!end, "Invalid address '%s' in netif spec '%s'", str, spec);
+
+        *end++ = '\0';
+
+        a->family = AF_INET6;
+        prefix = end;
+    } else {
+        a->family = AF_INET;
+        prefix = addr + strcspn(addr, "/");
+    }
+
+    if (*prefix == '/') {
+        fail_if(!with_prefix, "Invalid address '%s' in netif spec '%s'",
+                str, spec);
+
+        *prefix++ = '\0';
+    } else {
+        fail_if(*prefix, "Invalid address '%s' in netif spec '%s'", str, spec);
+
+        prefix = NULL;
+    }
+
+    rc = inet_pton(a->family, addr, a->addr);
+    fail_if(rc != 1, "Invalid address '%s' in netif spec '%s'", str, spec);
+
+    a->prefix = (a->family == AF_INET) ? 32 : 128;
+
+    if (prefix) {
+        char *end = NULL;
+        long len  = strtol(prefix, &end, 10);
+
+        fail_if(!*prefix || *end || (len < 0) || (len > a->prefix),
+                "Invalid prefix length '%s' in netif spec '%s'", str, spec);
+
+        a->prefix = len;
+    }
+
+    DL_APPEND(*list, a);
+}
+
+static void parse_netif_opts(struct netif *nif, const char *spec,
+                             char **opts, size_t count) {
+    struct netif_addr *a = NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        if (!strncmp(opts[i], "addr=", 5)) {
+            parse_addr(&nif->addrs, spec, opts[i] + 5, true);
+        } else if (!strncmp(opts[i], "gw=", 3)) {
+            parse_addr(&nif->gws, spec, opts[i] + 3, false);
+        } else if (!strcmp(opts[i], "nodad")) {
+            nif->nodad = true;
+        } else if (!strcmp(opts[i], "up")) {
+            nif->up = true;
+        } else {
+            fail_printf("Invalid option '%s' in netif spec '%s'",
+                        opts[i], spec);
+        }
+    }
+
+    /* the link has to be up for the routes to be accepted */
+    if (nif->addrs || nif->gws || nif->nodad)
+        nif->up = true;
+
+    DL_FOREACH(nif->gws, a) {
+        struct netif_addr *o = a->next;
+
+        for (; o; o = o->next)
+            fail_if(o->family == a->family,
+                    "Only one gateway per address family in netif spec '%s'",
+                    spec);
+    }
+}
+
+static struct veth_pool *pool_find(const char *bridge) {
+    struct veth_pool *pool = NULL;
+
+    DL_FOREACH(pools, pool) {
+        if (!strcmp(pool->bridge, bridge))
+            return pool;
+    }
+
+    return NULL;
+}
+
+/* Remove a ready pair from the pool of the given bridge, if there's any. */
+static struct veth_pair *pool_take(const char *bridge) {
+    struct veth_pool *pool = pool_find(bridge);
+    struct veth_pair *pair;
+
+    if (!pool || pool->broken || !pool->ready)
+        return NULL;
+
+    pair = pool->ready;
+    DL_DELETE(pool->ready, pair);
+    pool->count--;
+
+    return pair;
+}
+
+/* Generate a name unique to this process for the host end ('h') or the peer
+ * ('c') of a bridge pair, short enough to fit IFNAMSIZ. */
+static void pool_name(char *name, char kind) {
+    snprintf(name, IFNAMSIZ, "pf%c%x.%x", kind, getpid() & 0xffffff,
+             pool_seq++ & 0xfffff);
+}
+
+/* Called on the pool's pairs echoed back by the kernel, as their host end,
+ * whose IFLA_LINK is the peer's index. */
+static void pair_created(struct nlmsghdr *hdr, void *data) {
+    struct veth_pair *pair = data;
+
+    struct ifinfomsg *ifi = NLMSG_DATA(hdr);
+    struct rtattr *rta;
+
+    const char *name = NULL;
+    int link = 0;
+
+    int len = IFLA_PAYLOAD(hdr);
+
+    if (hdr->nlmsg_type != RTM_NEWLINK)
+        return;
+
+    for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+        case IFLA_IFNAME:
+            name = RTA_DATA(rta);
+            break;
+
+        case IFLA_LINK:
+            link = *(int *) RTA_DATA(rta);
+            break;
+        }
+    }
+
+    if (name && !strcmp(name, pair->host))
+        pair->peer_index = link;
+}
+
+/* The helper is gone, the containers fall back to creating their own
+ * pairs. */
+static void pool_lost(void) {
+    struct veth_pool *pool = NULL;
+    struct veth_pair *pair = NULL, *tmp;
+
+    err_printf("The veth pool helper exited");
+
+    DL_FOREACH(pools, pool)
+        pool->broken = true;
+
+    DL_FOREACH_SAFE(pool_creating, pair, tmp) {
+        DL_DELETE(pool_creating, pair);
+
+        pair->pool->count--;
+        free(pair);
+    }
+}
+
+/* Runs in the helper: create the requested pairs one at a time, so that the
+ * rtnl lock is never held for long by the pool. */
+static void pool_serve(int fd) {
+    ssize_t rc;
+
+    struct pool_req req;
+
+    int sock = nl_open();
+
+    while ((rc = recv(fd, &req, sizeof(req), 0)) != 0) {
+        struct nl_batch batch = { 0 };
+
+        struct veth_pair pair = { .peer_index = 0 };
+
+        struct pool_reply reply = { .error = 0 };
+
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        sys_fail_if(rc < 0, "Error receiving veth pool request");
+
+        strcpy(pair.host, req.host);
+        strcpy(pair.peer, req.peer);
+
+        create_bridge_veth(&batch, 0, req.master, pair.host, pair.peer);
+        nl_batch_on_reply(&batch, pair_created, &pair);
+
+        if (nl_batch_send(sock, &batch) >= 0)
+            reply.error = -errno;
+
+        /* kernels before 6.1 don't echo new interfaces back */
+        if (!reply.error && !pair.peer_index) {
+            pair.peer_index = if_nametoindex(pair.peer);
+            reply.error = pair.peer_index ? 0 : -errno;
+        }
+
+        nl_batch_reset(&batch);
+
+        reply.peer_index = pair.peer_index;
+
+        rc = send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+        if (rc < 0)
+            break;
+    }
 
-    if (req->hdr.nlmsg_type == NLMSG_ERROR)
-        sys_fail_if(req->msg.err.error < 0,
-                    "Error sending netlink request");
+    close(sock);
 }
@@ -33,6 +33,7 @@ enum netif_type {
     MACVLAN,
     IPVLAN,
     VETH,
+    BRIDGE,
 };
 
 struct netif;
@@ -43,4 +44,11 @@ void netif_add_from_spec(struct netif **ifs, const char *spec);
 
 void setup_netif(struct netif *ifs, pid_t pid);
 
-void config_netif(void);
+int netif_pool_open(unsigned int size);
+void netif_pool_add(struct netif *ifs);
+void netif_pool_skip(struct netif *ifs);
+void netif_pool_refill(void);
+bool netif_pool_handle(void);
+void netif_pool_close(void);
+
+void config_netif(struct netif *ifs);
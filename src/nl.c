@@ -28,16 +28,37 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 
+#include <sys/socket.h>
 #include <netinet/in.h>
+#include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 
 #include "nl.h"
 #include "printf.h"
 #include "util.h"
 
+/* the size of the largest dump message the kernel sends by default, a
+ * bigger datagram makes the buffer grow */
+#define NL_BUF_SIZE 32768
+
+static uint32_t nl_seq = 0;
+
+/* the replies are received here, reused across requests */
+static char *nl_buf = NULL;
+static size_t nl_buf_size = 0;
+
+static ssize_t nl_recv(int sock);
+static bool nl_is_dump(struct nlmsghdr *hdr);
+
 void rtattr_append(struct nlmsg *nlmsg, int attr, void *d, size_t len) {
     struct rtattr *rtattr;
     size_t rtalen = RTA_LENGTH(len);
@@ -68,68 +89,246 @@ int nl_open(void) {
 
     int sock = -1;
 
+    int cap_ack = 1;
+
     struct sockaddr_nl addr;
 
-    sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
     sys_fail_if(sock < 0, "Error creating netlink socket");
 
     addr.nl_family = AF_NETLINK;
     addr.nl_pad    = 0;
-    addr.nl_pid    = getpid();
+    /* let the kernel pick the port id, the process may have more than one
+     * socket open */
+    addr.nl_pid    = 0;
     addr.nl_groups = 0;
 
     rc = bind(sock, (struct sockaddr *) &addr, sizeof(struct sockaddr_nl));
     sys_fail_if(rc < 0, "Error binding netlink socket");
 
+    /* only the error code of a failed request is ever looked at */
+    setsockopt(sock, SOL_NETLINK, NETLINK_CAP_ACK, &cap_ack, sizeof(cap_ack));
+
     return sock;
 }
 
-void nl_send(int sock, struct nlmsg *nlmsg) {
+/* Add a request to the batch. The returned message is zeroed, and fmt
+ * describes the request in the error reported if it fails. */
+struct nlmsg *nl_batch_add(struct nl_batch *b, const char *fmt, ...) {
+    int rc;
+    va_list args;
+
+    struct nl_req *req;
+
+    b->reqs = realloc(b->reqs, (b->count + 1) * sizeof(*b->reqs));
+    fail_if(!b->reqs, "OOM");
+
+    req = &b->reqs[b->count++];
+    memset(req, 0, sizeof(*req));
+
+    req->msg = calloc(1, NLMSG_GOOD_SIZE);
+    fail_if(!req->msg, "OOM");
+
+    va_start(args, fmt);
+    rc = vasprintf(&req->what, fmt, args);
+    va_end(args);
+
+    fail_if(rc < 0, "OOM");
+
+    return req->msg;
+}
+
+/* Set the function called on the replies to the last request added. */
+void nl_batch_on_reply(struct nl_batch *b,
+                       void (*reply)(struct nlmsghdr *hdr, void *data),
+                       void *data) {
+    struct nl_req *req = &b->reqs[b->count - 1];
+
+    req->reply = reply;
+    req->data  = data;
+}
+
+/* Send all the requests in the batch at once, without waiting for the
+ * replies, which are then handled by nl_batch_receive(). */
+void nl_batch_submit(int sock, struct nl_batch *b) {
     int rc;
+
     struct sockaddr_nl addr;
 
-    struct iovec iov = {
-        .iov_base = (void *) nlmsg,
-        .iov_len  = nlmsg->hdr.nlmsg_len
-    };
+    _free_ struct iovec *iov = NULL;
 
     struct msghdr msg = {
         .msg_name    = &addr,
         .msg_namelen = sizeof(struct sockaddr_nl),
-        .msg_iov     = &iov,
-        .msg_iovlen  = 1
     };
 
+    iov = calloc(b->count, sizeof(*iov));
+    fail_if(!iov, "OOM");
+
+    free(b->complete);
+
+    b->complete = calloc(b->count, sizeof(*b->complete));
+    fail_if(!b->complete, "OOM");
+
+    b->seq  = nl_seq + 1;
+    b->done = 0;
+
+    for (size_t i = 0; i < b->count; i++) {
+        struct nlmsg *req = b->reqs[i].msg;
+
+        req->hdr.nlmsg_seq    = ++nl_seq;
+        req->hdr.nlmsg_flags |= NLM_F_REQUEST;
+
+        /* a dump ends with NLMSG_DONE rather than with an ACK */
+        if (!nl_is_dump(&req->hdr))
+            req->hdr.nlmsg_flags |= NLM_F_ACK;
+
+        iov[i].iov_base = req;
+        iov[i].iov_len  = NLMSG_ALIGN(req->hdr.nlmsg_len);
+
+        b->reqs[i].error = 0;
+    }
+
     memset(&addr, 0, sizeof(struct sockaddr_nl));
     addr.nl_family = AF_NETLINK;
-    addr.nl_pid    = 0;
-    addr.nl_groups = 0;
+
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = b->count;
 
     rc = sendmsg(sock, &msg, 0);
     sys_fail_if(rc < 0, "Error sending netlink message");
 }
 
-void nl_recv(int sock, struct nlmsg *nlmsg) {
-    int rc;
-    struct sockaddr_nl addr;
+/* Receive and dispatch the next datagram of replies to a submitted batch.
+ * Returns true once all of its requests have completed, either with their
+ * ACK or, for dumps, with the end of the dump. */
+bool nl_batch_receive(int sock, struct nl_batch *b) {
+    int len = nl_recv(sock);
 
-    struct iovec iov = {
-        .iov_base = (void *) nlmsg,
-        .iov_len  = nlmsg->hdr.nlmsg_len
-    };
+    struct nlmsghdr *hdr = (struct nlmsghdr *) nl_buf;
 
-    struct msghdr msg = {
-        .msg_name    = &addr,
-        .msg_namelen = sizeof(struct sockaddr_nl),
-        .msg_iov     = &iov,
-        .msg_iovlen  = 1
-    };
+    for (; NLMSG_OK(hdr, len); hdr = NLMSG_NEXT(hdr, len)) {
+        size_t n = hdr->nlmsg_seq - b->seq;
 
-    memset(&addr, 0, sizeof(struct sockaddr_nl));
-    addr.nl_family = AF_NETLINK;
-    addr.nl_pid    = 0;
-    addr.nl_groups = 0;
+        struct nl_req *req;
+
+        /* not a reply to this batch */
+        if ((n >= b->count) || b->complete[n])
+            continue;
+
+        req = &b->reqs[n];
+
+        switch (hdr->nlmsg_type) {
+        case NLMSG_ERROR: {
+            struct nlmsgerr *err = NLMSG_DATA(hdr);
+
+            req->error = err->error;
+            break;
+        }
+
+        case NLMSG_DONE:
+            if (hdr->nlmsg_len >= NLMSG_LENGTH(sizeof(int)))
+                req->error = *(int *) NLMSG_DATA(hdr);
+            break;
+
+        default:
+            if (req->reply)
+                req->reply(hdr, req->data);
+            continue;
+        }
+
+        b->complete[n] = true;
+        b->done++;
+    }
+
+    return b->done == b->count;
+}
+
+/* Send all the requests in the batch at once and wait for all of them to
+ * complete. Returns the index of the first request that the kernel rejected,
+ * with errno set to the reason, or -1 if all of them succeeded. */
+ssize_t nl_batch_send(int sock, struct nl_batch *b) {
+    if (!b->count)
+        return -1;
+
+    nl_batch_submit(sock, b);
+
+    while (!nl_batch_receive(sock, b));
+
+    for (size_t i = 0; i < b->count; i++) {
+        if (b->reqs[i].error < 0) {
+            errno = -b->reqs[i].error;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Send the batch, failing on the first request that the kernel rejected.
+ * The batch is empty again afterwards. */
+void nl_batch_commit(int sock, struct nl_batch *b) {
+    ssize_t failed = nl_batch_send(sock, b);
+
+    if (failed >= 0)
+        sysf_printf("%s", b->reqs[failed].what);
+
+    nl_batch_reset(b);
+}
+
+void nl_batch_reset(struct nl_batch *b) {
+    for (size_t i = 0; i < b->count; i++) {
+        free(b->reqs[i].msg);
+        free(b->reqs[i].what);
+    }
+
+    freep(&b->reqs);
+    freep(&b->complete);
+
+    b->count = 0;
+    b->done  = 0;
+}
+
+/* Receive the next datagram into nl_buf, which first grows to fit it so that
+ * large replies aren't truncated. */
+static ssize_t nl_recv(int sock) {
+    ssize_t len;
+
+    if (!nl_buf) {
+        nl_buf_size = NL_BUF_SIZE;
+
+        nl_buf = malloc(nl_buf_size);
+        fail_if(!nl_buf, "OOM");
+    }
+
+    while (1) {
+        len = recv(sock, nl_buf, nl_buf_size, MSG_PEEK | MSG_TRUNC);
+        if ((len < 0) && (errno == EINTR))
+            continue;
+
+        sys_fail_if(len < 0, "Error receiving netlink message");
+
+        if ((size_t) len <= nl_buf_size)
+            break;
+
+        nl_buf_size = len;
+
+        nl_buf = realloc(nl_buf, nl_buf_size);
+        fail_if(!nl_buf, "OOM");
+    }
+
+    do {
+        len = recv(sock, nl_buf, nl_buf_size, 0);
+    } while ((len < 0) && (errno == EINTR));
+
+    sys_fail_if(len < 0, "Error receiving netlink message");
+
+    return len;
+}
 
-    rc = recvmsg(sock, &msg, 0);
-    sys_fail_if(rc < 0, "Error receiving netlink message");
+/* Whether the kernel will answer the request with a dump, which it does for
+ * RTM_GET* requests with NLM_F_DUMP. */
+static bool nl_is_dump(struct nlmsghdr *hdr) {
+    return ((hdr->nlmsg_type & 3) == 2) &&
+           ((hdr->nlmsg_flags & NLM_F_DUMP) == NLM_F_DUMP);
 }
@@ -33,6 +33,8 @@ struct nlmsg {
 
     union {
         struct ifinfomsg ifi;
+        struct ifaddrmsg ifa;
+        struct rtmsg     rtm;
         struct nlmsgerr  err;
     } msg;
 };
@@ -42,9 +44,44 @@ struct nlmsg {
 
 #define NLMSG_GOOD_SIZE (sizeof(struct nlmsg) * 256)
 
+struct nl_req {
+    struct nlmsg *msg;
+
+    /* describes the request in the error reported if it fails */
+    char *what;
+
+    /* called on every reply to the request other than its ACK, e.g. on the
+     * messages of a dump or on the ones echoed back by NLM_F_ECHO */
+    void (*reply)(struct nlmsghdr *hdr, void *data);
+    void *data;
+
+    /* the result of the request, once the batch has been sent */
+    int error;
+};
+
+/* Requests sent together with a single sendmsg(), each one with its own
+ * sequence number so that the replies can be matched back to them. */
+struct nl_batch {
+    struct nl_req *reqs;
+    size_t count;
+
+    /* the replies still expected, once the batch has been submitted */
+    uint32_t seq;
+    size_t done;
+    bool *complete;
+};
+
 int nl_open(void);
-void nl_send(int sock, struct nlmsg *nlmsg);
-void nl_recv(int sock, struct nlmsg *nlmsg);
+
+struct nlmsg *nl_batch_add(struct nl_batch *b, const char *fmt, ...);
+void nl_batch_on_reply(struct nl_batch *b,
+                       void (*reply)(struct nlmsghdr *hdr, void *data),
+                       void *data);
+void nl_batch_submit(int sock, struct nl_batch *b);
+bool nl_batch_receive(int sock, struct nl_batch *b);
+ssize_t nl_batch_send(int sock, struct nl_batch *b);
+void nl_batch_commit(int sock, struct nl_batch *b);
+void nl_batch_reset(struct nl_batch *b);
 
 void rtattr_append(struct nlmsg *nlmsg, int attr, void *d, size_t len);
 struct rtattr *rtattr_start_nested(struct nlmsg *nlmsg, int attr);
@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <syslog.h>
 
@@ -38,314 +39,1576 @@
 
 #include <linux/sched.h>
 
+#include <fcntl.h>
 #include <getopt.h>
+#include <wordexp.h>
 
+#include <sys/epoll.h>
 #include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+/* older libcs don't know about waiting on pidfds */
+#ifndef P_PIDFD
+# define P_PIDFD 3
+#endif
+
+#include "ut/utlist.h"
+
 #include "cmdline.h"
 
 #include "capabilities.h"
 #include "pty.h"
+#include "relay.h"
+#include "detach.h"
+#include "logfile.h"
 #include "user.h"
 #include "dev.h"
 #include "machine.h"
 #include "mount.h"
 #include "cgroup.h"
 #include "netif.h"
+#include "pool.h"
 #include "sync.h"
+#include "timing.h"
 #include "printf.h"
 #include "util.h"
 
+#define EPHEMERAL_DIR "/tmp/pflask-ephemeral-XXXXXX"
+
+struct container {
+    struct gengetopt_args_info *args;
+
+    int clone_flags;
+
+    char **argv;
+
+    struct mount *mounts;
+    struct netif *netifs;
+    struct cgroup *cgroups;
+    struct user *users;
+#if HAVE_LIBCAP_NG
+    struct capability *caps;
+#endif
+
+    pid_t pid;
+    int pidfd;
+    int sync[2];
+
+    /* the spawner's connection to the pool, not to be kept by the child */
+    int spawn_fd;
+
+    bool in_cgroup;
+    bool batch;
+
+    char *snapshot;
+
+    int master_fd;
+    char *master;
+
+    int out_fd;
+    int err_fd;
+
+    char ephemeral_dir[sizeof(EPHEMERAL_DIR)];
+};
+
+enum zygote_state {
+    ZYGOTE_START,
+    ZYGOTE_READY,
+    ZYGOTE_CLAIMED,
+    ZYGOTE_KILLED,
+};
+
+struct zygote {
+    struct container c;
+
+    enum zygote_state state;
+
+    /* the process that clones the container and sets it up, until it's
+     * handed over to the pool */
+    pid_t spawner;
+    int spawn_fd;
+
+    struct claim *claim;
+
+    bool exited;
+    int status;
+
+    struct zygote *next, *prev;
+};
+
+/* What the spawner of a container tells the pool: first that the container
+ * exists, with its pidfd if any, then that it's ready, with the parent end of
+ * its sync socket and the master pty. */
+enum spawn_type {
+    SPAWN_STARTED,
+    SPAWN_READY,
+};
+
+struct spawn_msg {
+    int type;
+
+    pid_t pid;
+    bool in_cgroup;
+
+    char ephemeral_dir[sizeof(EPHEMERAL_DIR)];
+};
+
+struct pending {
+    struct claim *claim;
+
+    struct pending *next, *prev;
+};
+
+enum job_state {
+    JOB_QUEUED,
+    JOB_START,
+    JOB_SETUP,
+    JOB_RUNNING,
+    JOB_DONE,
+};
+
+struct job {
+    struct container c;
+    struct gengetopt_args_info args;
+
+    unsigned int line;
+    wordexp_t words;
+    char **argv;
+
+    enum job_state state;
+    int status;
+
+    struct job *next, *prev;
+};
+
+static void container_init(struct container *c,
+                           struct gengetopt_args_info *args, char **argv);
+static void container_spawn(struct container *c);
+static void container_setup(struct container *c);
+static void container_clean(struct container *c);
+
+static void container_kill(struct container *c, int sig);
+static int container_wait(struct container *c, siginfo_t *status, int flags);
+static bool container_reap(struct container *c, int *status);
+
+static void do_child(struct container *c);
+static void do_exec(struct container *c, const char *dir, char **env);
+static void do_pool(struct container *c, int size);
+static int do_batch(const char *path, int jobs, int veth_pool);
+
+static int zygote_spawn(struct zygote **zygotes, struct container *tmpl,
+                        int epoll_fd);
+static void zygote_setup(struct container *c, int sock);
+static void zygote_receive(struct zygote *z, int epoll_fd);
+static bool zygote_reap(struct zygote *z);
+
+static struct job *job_parse(const char *spec, unsigned int line);
+static void job_spawn(struct job *j, int epoll_fd);
+static bool job_reap(struct job *j, int epoll_fd);
+static void job_free(struct job *j);
+
 static size_t validate_optlist(const char *name, const char *opts);
 
 static void do_daemonize(void);
 static void do_chroot(const char *dest);
-static pid_t do_clone(int *flags);
+static pid_t do_clone(int *flags, int cgroup_fd, int *pidfd, bool *in_cgroup);
 
 int main(int argc, char *argv[]) {
-    int rc, sync[2];
-
-    pid_t pid = -1;
+    int rc;
 
     siginfo_t status;
 
-    struct mount *mounts = NULL;
-    struct netif *netifs = NULL;
-    struct cgroup *cgroups = NULL;
-    struct user *users = NULL;
-#if HAVE_LIBCAP_NG
-    struct capability *caps = NULL;
-#endif
+    struct container c;
 
-    char *master;
     _close_ int master_fd = -1;
 
-    char ephemeral_dir[] = "/tmp/pflask-ephemeral-XXXXXX";
-
-    int clone_flags = CLONE_NEWNS  |
-                          CLONE_NEWIPC |
-                          CLONE_NEWPID |
-#ifdef CLONE_NEWCGROUP
-                          CLONE_NEWCGROUP |
-#endif
-                          CLONE_NEWUTS;
+    _close_ int out_fd = -1;
+    _close_ int err_fd = -1;
 
     struct gengetopt_args_info args;
 
+    struct relay_opts relay_opts;
+
+    struct detach detach;
+
     if (cmdline_parser(argc, argv, &args) != 0)
         return 1;
 
-    for (unsigned int i = 0; i < args.mount_given; i++) {
-        validate_optlist("--mount", args.mount_arg[i]);
-        mount_add_from_spec(&mounts, args.mount_arg[i]);
+    fail_if(args.scrollback_arg < 0, "Invalid scrollback size '%d'",
+            args.scrollback_arg);
+
+    fail_if(args.output_buffer_arg < 1, "Invalid output buffer size '%d'",
+            args.output_buffer_arg);
+
+    fail_if(args.log_size_arg < 0, "Invalid log size '%d'", args.log_size_arg);
+    fail_if(args.log_keep_arg < 0, "Invalid log count '%d'", args.log_keep_arg);
+
+    if (args.drop_snapshots_flag) {
+        drop_snapshots();
+
+        cmdline_parser_free(&args);
+        return 0;
+    }
+
+    relay_opts.stats = args.relay_stats_flag;
+
+    if (!strcmp(args.relay_engine_arg, "auto"))
+        relay_opts.engine = RELAY_ENGINE_AUTO;
+    else if (!strcmp(args.relay_engine_arg, "epoll"))
+        relay_opts.engine = RELAY_ENGINE_EPOLL;
+    else if (!strcmp(args.relay_engine_arg, "io_uring"))
+        relay_opts.engine = RELAY_ENGINE_URING;
+    else
+        fail_printf("Invalid value '%s' for --relay-engine",
+                    args.relay_engine_arg);
+
+    detach_init(&detach, args.detach_keys_arg);
+    relay_opts.detach = detach.len ? &detach : NULL;
+
+    if (!strcmp(args.output_policy_arg, "block"))
+        relay_opts.policy = RELAY_POLICY_BLOCK;
+    else if (!strcmp(args.output_policy_arg, "drop"))
+        relay_opts.policy = RELAY_POLICY_DROP;
+    else if (!strcmp(args.output_policy_arg, "spill"))
+        relay_opts.policy = RELAY_POLICY_SPILL;
+    else
+        fail_printf("Invalid value '%s' for --output-policy",
+                    args.output_policy_arg);
+
+    fail_if((relay_opts.policy != RELAY_POLICY_BLOCK) &&
+            (relay_opts.engine == RELAY_ENGINE_URING),
+            "--output-policy=%s can't be used with --relay-engine=io_uring",
+            args.output_policy_arg);
+
+    relay_opts.buffer = (size_t) args.output_buffer_arg * 1024;
+
+    relay_opts.scrollback = (size_t) args.scrollback_arg * 1024;
+    relay_opts.log = NULL;
+
+    if (args.log_output_given)
+        relay_opts.log = logfile_open(args.log_output_arg,
+                                      (size_t) args.log_size_arg * 1024,
+                                      args.log_keep_arg,
+                                      args.log_timestamps_flag);
+
+    container_init(&c, &args, argc > optind ? argv + optind : NULL);
+
+    if (args.attach_given) {
+        attach_pty(args.attach_arg, &relay_opts);
+
+        logfile_close(relay_opts.log);
+        return 0;
+    }
+
+    if (args.claim_given)
+        return pool_claim(args.claim_arg, c.argv, args.chdir_arg,
+                          args.setenv_arg, args.setenv_given);
+
+    if (args.veth_pool_given) {
+        fail_if(args.veth_pool_arg < 1, "Invalid veth pool size '%d'",
+                args.veth_pool_arg);
+
+        fail_if(!args.pool_given && !args.batch_given,
+                "--veth-pool can only be used with --pool or --batch");
+    }
+
+    if (args.batch_given) {
+        fail_if(args.jobs_arg < 1, "Invalid number of jobs '%d'",
+                args.jobs_arg);
+
+        rc = do_batch(args.batch_arg, args.jobs_arg,
+                      args.veth_pool_given ? args.veth_pool_arg : 0);
+
+        cmdline_parser_free(&args);
+        return rc;
+    }
+
+    if (args.pool_given) {
+        fail_if(args.pool_arg < 1, "Invalid pool size '%d'", args.pool_arg);
+
+        if (args.detach_flag)
+            do_daemonize();
+
+        do_pool(&c, args.pool_arg);
+
+        cmdline_parser_free(&args);
+        return 0;
+    }
+
+    if (!args.no_pty_flag) {
+        open_master_pty(&master_fd, &c.master);
+        c.master_fd = master_fd;
+    }
+
+    if (args.detach_flag)
+        do_daemonize();
+
+    /* a detached container can't inherit the caller's standard streams,
+     * so its output is collected through pipes instead */
+    if (args.no_pty_flag && args.detach_flag) {
+        open_pipe(&out_fd, &c.out_fd);
+        open_pipe(&err_fd, &c.err_fd);
+    }
+
+    if (args.timings_given)
+        timing_init(args.timings_arg);
+
+    container_spawn(&c);
+
+    closep(&c.out_fd);
+    closep(&c.err_fd);
+
+    timing_begin("sync_start");
+    sync_wait_child(c.sync, SYNC_START);
+    timing_end("sync_start");
+
+    container_setup(&c);
+
+    sync_wake_child(c.sync, SYNC_DONE);
+
+    sync_close(c.sync);
+
+    if (args.no_pty_flag)
+        process_pipes(c.pidfd, out_fd, err_fd);
+    else if (args.detach_flag)
+        serve_pty(master_fd, c.pidfd, &relay_opts);
+    else
+        process_pty(master_fd, c.pidfd, &relay_opts);
+
+    logfile_close(relay_opts.log);
+
+    timing_begin("reap");
+
+    container_kill(&c, SIGKILL);
+
+    rc = container_wait(&c, &status, 0);
+    sys_fail_if(rc < 0, "Error waiting for child");
+
+    switch (status.si_code) {
+    case CLD_EXITED:
+        if (status.si_status != 0)
+            err_printf("Child failed with code '%d'",
+                       status.si_status);
+        else
+            ok_printf("Child exited");
+        break;
+
+    case CLD_KILLED:
+        err_printf("Child was terminated by signal '%d'",
+                   status.si_status);
+        break;
+
+    default:
+        err_printf("Child failed");
+        break;
+    }
+
+    container_clean(&c);
+
+    timing_end("reap");
+
+    timing_report();
+
+    cmdline_parser_free(&args);
+
+    return status.si_status;
+}
+
+static void container_init(struct container *c,
+                           struct gengetopt_args_info *args, char **argv) {
+    memset(c, 0, sizeof(*c));
+
+    c->args = args;
+    c->argv = argv;
+
+    c->pid       = -1;
+    c->pidfd     = -1;
+    c->master_fd = -1;
+
+    c->out_fd = -1;
+    c->err_fd = -1;
+
+    c->sync[0] = -1;
+    c->sync[1] = -1;
+
+    c->spawn_fd = -1;
+
+    c->clone_flags = CLONE_NEWNS  |
+                     CLONE_NEWIPC |
+                     CLONE_NEWPID |
+#ifdef CLONE_NEWCGROUP
+                     CLONE_NEWCGROUP |
+#endif
+                     CLONE_NEWUTS;
+
+    for (unsigned int i = 0; i < args->mount_given; i++) {
+        validate_optlist("--mount", args->mount_arg[i]);
+        mount_add_from_spec(&c->mounts, args->mount_arg[i]);
     }
 
-    for (unsigned int i = 0; i < args.netif_given; i++) {
-        clone_flags |= CLONE_NEWNET;
+    for (unsigned int i = 0; i < args->netif_given; i++) {
+        c->clone_flags |= CLONE_NEWNET;
 
-        if (args.netif_arg != NULL) {
-            validate_optlist("--netif", args.netif_arg[i]);
-            netif_add_from_spec(&netifs, args.netif_arg[i]);
+        if (args->netif_arg != NULL) {
+            netif_add_from_spec(&c->netifs, args->netif_arg[i]);
         }
     }
 
-    if (args.user_given && !args.user_map_given) {
+    if (args->user_given && !args->user_map_given) {
         uid_t uid;
         gid_t gid;
 
-        clone_flags |= CLONE_NEWUSER;
+        c->clone_flags |= CLONE_NEWUSER;
 
-        if (user_get_uid_gid(args.user_arg, &uid, &gid)) {
-            user_add_map(&users, 'u', uid, uid, 1);
-            user_add_map(&users, 'g', gid, gid, 1);
+        if (user_get_uid_gid(args->user_arg, &uid, &gid)) {
+            user_add_map(&c->users, 'u', uid, uid, 1);
+            user_add_map(&c->users, 'g', gid, gid, 1);
         }
     }
 
-    for (unsigned int i = 0; i < args.user_map_given; i++) {
+    for (unsigned int i = 0; i < args->user_map_given; i++) {
         size_t count;
         uid_t id, host_id;
 
-        char *start = args.user_map_arg[i], *end = NULL;
+        char *start = args->user_map_arg[i], *end = NULL;
 
-        validate_optlist("--user-map", args.user_map_arg[i]);
+        validate_optlist("--user-map", args->user_map_arg[i]);
 
-        clone_flags |= CLONE_NEWUSER;
+        c->clone_flags |= CLONE_NEWUSER;
 
         id = strtoul(start, &end, 10);
         if (*end != ':')
             fail_printf("Invalid value '%s' for --user-map",
-                        args.user_map_arg[i]);
+                        args->user_map_arg[i]);
 
         start = end + 1;
 
         host_id = strtoul(start, &end, 10);
         if (*end != ':')
             fail_printf("Invalid value '%s' for --user-map",
-                        args.user_map_arg[i]);
+                        args->user_map_arg[i]);
 
         start = end + 1;
 
         count = strtoul(start, &end, 10);
         if (*end != '\0')
             fail_printf("Invalid value '%s' for --user-map",
-                        args.user_map_arg[i]);
+                        args->user_map_arg[i]);
 
-        user_add_map(&users, 'u', id, host_id, count);
-        user_add_map(&users, 'g', id, host_id, count);
+        user_add_map(&c->users, 'u', id, host_id, count);
+        user_add_map(&c->users, 'g', id, host_id, count);
     }
 
-    for (unsigned int i = 0; i < args.cgroup_given; i++)
-        cgroup_add(&cgroups, args.cgroup_arg[i]);
+    for (unsigned int i = 0; i < args->cgroup_given; i++)
+        cgroup_add(&c->cgroups, args->cgroup_arg[i]);
 
 #if HAVE_LIBCAP_NG
-    for (unsigned int i = 0; i < args.caps_given; i++)
-        capability_add(&caps, args.caps_arg[i]);
+    for (unsigned int i = 0; i < args->caps_given; i++)
+        capability_add(&c->caps, args->caps_arg[i]);
 #endif
 
-    if (args.no_userns_flag)
-        clone_flags &= ~(CLONE_NEWUSER);
+    if (args->no_userns_flag)
+        c->clone_flags &= ~(CLONE_NEWUSER);
+
+    if (args->no_mountns_flag)
+        c->clone_flags &= ~(CLONE_NEWNS);
 
-    if (args.no_mountns_flag)
-        clone_flags &= ~(CLONE_NEWNS);
+    if (args->no_netns_flag)
+        c->clone_flags &= ~(CLONE_NEWNET);
 
-    if (args.no_netns_flag)
-        clone_flags &= ~(CLONE_NEWNET);
+    if (args->no_ipcns_flag)
+        c->clone_flags &= ~(CLONE_NEWIPC);
 
-    if (args.no_ipcns_flag)
-        clone_flags &= ~(CLONE_NEWIPC);
+    if (args->no_utsns_flag)
+        c->clone_flags &= ~(CLONE_NEWUTS);
 
-    if (args.no_utsns_flag)
-        clone_flags &= ~(CLONE_NEWUTS);
+    if (args->no_pidns_flag)
+        c->clone_flags &= ~(CLONE_NEWPID);
+}
 
-    if (args.no_pidns_flag)
-        clone_flags &= ~(CLONE_NEWPID);
+static void container_spawn(struct container *c) {
+    _close_ int cgroup_fd = -1;
 
-    if (args.attach_given) {
-        master_fd = recv_pty(args.attach_arg);
-        fail_if(master_fd < 0, "Invalid PID '%u'", args.attach_arg);
+    sync_init(c->sync);
 
-        process_pty(master_fd);
-        return 0;
+    if (c->args->ephemeral_flag) {
+        strcpy(c->ephemeral_dir, EPHEMERAL_DIR);
+
+        if (!mkdtemp(c->ephemeral_dir))
+            sysf_printf("mkdtemp()");
     }
 
-    open_master_pty(&master_fd, &master);
+    /* the template must exist before the mount namespace is cloned */
+    if (c->args->dev_template_flag) {
+        timing_begin("dev_template");
+        setup_dev_template();
+        timing_end("dev_template");
+    }
 
-    if (args.detach_flag)
-        do_daemonize();
+    if (c->args->snapshot_flag) {
+        timing_begin("snapshot");
+        c->snapshot = prepare_snapshot(c->mounts, c->args->chroot_arg);
+        timing_end("snapshot");
+    }
 
-    sync_init(sync);
+    /* the cgroups are created before cloning, so the child can be
+     * spawned directly inside of them */
+    timing_begin("cgroup_prepare");
+    cgroup_fd = prepare_cgroup(c->cgroups);
+    timing_end("cgroup_prepare");
 
-    if (args.ephemeral_flag) {
-        if (!mkdtemp(ephemeral_dir))
-            sysf_printf("mkdtemp()");
+    timing_begin("clone");
+
+    c->pid = do_clone(&c->clone_flags, cgroup_fd, &c->pidfd, &c->in_cgroup);
+
+    if (!c->pid)
+        do_child(c);
+
+    timing_end("clone");
+}
+
+static void container_setup(struct container *c) {
+    struct gengetopt_args_info *args = c->args;
+
+    if (args->chroot_given && c->master &&
+        (c->clone_flags & CLONE_NEWUSER)) {
+        timing_begin("console_owner");
+        setup_console_owner(c->master, c->users);
+        timing_end("console_owner");
     }
 
-    pid = do_clone(&clone_flags);
+    timing_begin("cgroup");
+    setup_cgroup(c->cgroups, c->pid, c->in_cgroup);
+    timing_end("cgroup");
+
+    timing_begin("netif");
+    setup_netif(c->netifs, c->pid);
+    timing_end("netif");
+
+#ifdef HAVE_DBUS
+    timing_begin("machine");
+    register_machine(c->pid, args->chroot_given ? args->chroot_arg : "");
+    timing_end("machine");
+#endif
 
-    if (!pid) {
-        closep(&master_fd);
+    if (c->clone_flags & CLONE_NEWUSER) {
+        timing_begin("user_map");
+        setup_user_map(c->users, c->pid);
+        timing_end("user_map");
+    }
+}
 
-        rc = prctl(PR_SET_PDEATHSIG, SIGKILL);
-        sys_fail_if(rc < 0, "prctl(PR_SET_PDEATHSIG)");
+static void container_clean(struct container *c) {
+    int rc;
 
-        rc = setsid();
-        sys_fail_if(rc < 0, "setsid()");
+    sync_close(c->sync);
 
-        sync_barrier_parent(sync, SYNC_START);
+    closep(&c->pidfd);
 
-        sync_close(sync);
+    freep(&c->snapshot);
 
-        open_slave_pty(master);
+    /* the pool's containers share the same cgroups */
+    if (!c->args->pool_given)
+        clean_cgroup(c->cgroups);
 
-        setup_user(args.user_arg);
+    /* a pool's container may be gone before its spawner created it */
+    if (c->args->ephemeral_flag && c->ephemeral_dir[0]) {
+        rc = rmdir(c->ephemeral_dir);
+        sys_fail_if(rc != 0, "Error deleting ephemeral directory: %s",
+                             c->ephemeral_dir);
+    }
+}
 
-        if (args.hostname_given) {
-            rc = sethostname(args.hostname_arg,
-                             strlen(args.hostname_arg));
-            sys_fail_if(rc < 0, "Error setting hostname");
-        }
+static void container_kill(struct container *c, int sig) {
+#ifdef __NR_pidfd_send_signal
+    if (c->pidfd >= 0) {
+        syscall(__NR_pidfd_send_signal, c->pidfd, sig, NULL, 0);
+        return;
+    }
+#endif
+
+    kill(c->pid, sig);
+}
+
+static int container_wait(struct container *c, siginfo_t *status, int flags) {
+    int rc;
+
+    do {
+        /* the pidfd can't end up referring to a recycled PID */
+        if (c->pidfd >= 0)
+            rc = waitid(P_PIDFD, c->pidfd, status, WEXITED | flags);
+        else
+            rc = waitid(P_PID, c->pid, status, WEXITED | flags);
+    } while ((rc < 0) && (errno == EINTR));
+
+    return rc;
+}
+
+static bool container_reap(struct container *c, int *status) {
+    int rc;
+
+    siginfo_t info;
 
-        setup_mount(mounts, args.chroot_arg, args.ephemeral_flag ?
-                                               ephemeral_dir : NULL);
+    info.si_pid = 0;
 
-        if (args.chroot_given) {
-            setup_nodes(args.chroot_arg);
+    rc = container_wait(c, &info, WNOHANG);
+    if ((rc < 0) || (info.si_pid == 0))
+        return false;
 
-            setup_ptmx(args.chroot_arg);
+    *status = (info.si_code == CLD_EXITED) ? info.si_status :
+                                             128 + info.si_status;
+
+    return true;
+}
+
+static void do_child(struct container *c) {
+    int rc;
 
-            setup_symlinks(args.chroot_arg);
+    sigset_t mask;
 
-            setup_console(args.chroot_arg, master);
+    struct gengetopt_args_info *args = c->args;
 
-            do_chroot(args.chroot_arg);
+    closep(&c->master_fd);
+    closep(&c->spawn_fd);
+
+    /* the pool blocks the signals it handles via signalfd */
+    sigemptyset(&mask);
+
+    rc = sigprocmask(SIG_SETMASK, &mask, NULL);
+    sys_fail_if(rc < 0, "sigprocmask()");
+
+    rc = prctl(PR_SET_PDEATHSIG, SIGKILL);
+    sys_fail_if(rc < 0, "prctl(PR_SET_PDEATHSIG)");
+
+    rc = setsid();
+    sys_fail_if(rc < 0, "setsid()");
+
+    timing_begin("sync_start");
+    sync_barrier_parent(c->sync, SYNC_START);
+    timing_end("sync_start");
+
+    /* in batch mode the parent waits for the sync socket to be closed
+     * on exec, to know when the launch is complete */
+    if (args->pool_given || c->batch)
+        sync_close_parent(c->sync);
+    else
+        sync_close(c->sync);
+
+    if (c->master) {
+        timing_begin("slave_pty");
+        open_slave_pty(c->master);
+        timing_end("slave_pty");
+    } else if (c->batch) {
+        _close_ int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        sys_fail_if(null_fd < 0, "Error opening /dev/null");
+
+        rc = dup2(null_fd, STDIN_FILENO);
+        sys_fail_if(rc < 0, "dup2()");
+    }
+
+    if (c->out_fd >= 0) {
+        rc = dup2(c->out_fd, STDOUT_FILENO);
+        sys_fail_if(rc < 0, "dup2()");
+
+        rc = dup2(c->err_fd, STDERR_FILENO);
+        sys_fail_if(rc < 0, "dup2()");
+    }
+
+    timing_begin("user");
+    setup_user(args->user_arg);
+    timing_end("user");
+
+    if (args->hostname_given) {
+        rc = sethostname(args->hostname_arg,
+                         strlen(args->hostname_arg));
+        sys_fail_if(rc < 0, "Error setting hostname");
+    }
+
+    timing_begin("mount");
+    setup_mount(&c->mounts, args->chroot_arg, args->ephemeral_flag ?
+                                              c->ephemeral_dir : NULL,
+                args->dev_template_flag, c->snapshot);
+    timing_end("mount");
+
+    if (args->chroot_given) {
+        if (!args->dev_template_flag) {
+            timing_begin("nodes");
+            setup_nodes(args->chroot_arg);
+            timing_end("nodes");
+
+            timing_begin("ptmx");
+            setup_ptmx(args->chroot_arg);
+            timing_end("ptmx");
+
+            timing_begin("symlinks");
+            setup_symlinks(args->chroot_arg);
+            timing_end("symlinks");
+        }
+
+        if (c->master) {
+            timing_begin("console");
+            setup_console(args->chroot_arg, c->master);
+            timing_end("console");
         }
 
-        if (clone_flags & CLONE_NEWNET)
-            config_netif();
+        timing_begin("chroot");
+        do_chroot(args->chroot_arg);
+        timing_end("chroot");
+    }
+
+    if (c->clone_flags & CLONE_NEWNET) {
+        timing_begin("config_netif");
+        config_netif(c->netifs);
+        timing_end("config_netif");
+    }
 
-        umask(0022);
+    umask(0022);
 
 #if HAVE_LIBCAP_NG
-        setup_capabilities(caps);
+    timing_begin("capabilities");
+    setup_capabilities(c->caps);
+    timing_end("capabilities");
 #endif
 
-        if (args.chdir_given) {
-            rc = chdir(args.chdir_arg);
-            sys_fail_if(rc < 0, "Error changing cwd");
+    if (args->pool_given) {
+        char *dir, **env;
+
+        /* Park here until the container is claimed: everything above
+         * only depends on the pool configuration, while the command,
+         * its environment and working directory come with the claim. */
+        sync_wake_parent(c->sync, SYNC_READY);
+
+        pool_wait_request(c->sync[0], &c->argv, &dir, &env);
+
+        sync_close(c->sync);
+
+        do_exec(c, dir ? dir : args->chdir_arg, env);
+    }
+
+    do_exec(c, args->chdir_arg, NULL);
+}
+
+static void do_exec(struct container *c, const char *dir, char **env) {
+    int rc;
+
+    struct gengetopt_args_info *args = c->args;
+
+    if (dir) {
+        rc = chdir(dir);
+        sys_fail_if(rc < 0, "Error changing cwd");
+    }
+
+    if (args->chroot_given) {
+        char *term = getenv("TERM");
+
+        if (!args->keepenv_flag)
+            clearenv();
+
+        setenv("PATH", "/usr/sbin:/usr/bin:/sbin:/bin", 1);
+        setenv("USER", args->user_arg, 1);
+        setenv("LOGNAME", args->user_arg, 1);
+        if (term)
+            setenv("TERM", term, 1);
+    }
+
+    for (unsigned int i = 0; i < args->setenv_given; i++) {
+        rc = putenv(strdup(args->setenv_arg[i]));
+        sys_fail_if(rc != 0, "Error setting environment");
+    }
+
+    for (char **i = env; i && *i; i++) {
+        rc = putenv(*i);
+        sys_fail_if(rc != 0, "Error setting environment");
+    }
+
+    setenv("container", "pflask", 1);
+
+    timing_begin("exec");
+    timing_end("exec");
+
+    timing_report();
+
+    if (c->argv)
+        rc = execvpe(c->argv[0], c->argv, environ);
+    else
+        rc = execle("/bin/bash", "-bash", NULL, environ);
+
+    sys_fail_if(rc < 0, "Error executing command");
+}
+
+static void do_pool(struct container *tmpl, int size) {
+    int rc, n;
+
+    sigset_t mask;
+
+    _close_ int sock      = -1;
+    _close_ int epoll_fd  = -1;
+    _close_ int signal_fd = -1;
+
+    int veth_fd = -1;
+
+    struct zygote *zygotes = NULL, *z, *tmp;
+    struct pending *pending = NULL, *p;
+
+    /* the claims whose request hasn't been received yet */
+    struct pending *incoming = NULL;
+
+    struct epoll_event ev, events[16];
+
+    int count = 0;
+
+    sock = pool_listen(getpid());
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGCHLD);
+
+    rc = sigprocmask(SIG_BLOCK, &mask, NULL);
+    sys_fail_if(rc < 0, "sigprocmask()");
+
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    sys_fail_if(signal_fd < 0, "signalfd()");
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    sys_fail_if(epoll_fd < 0, "epoll_create1()");
+
+    ev.events = EPOLLIN; ev.data.ptr = &sock;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+    sys_fail_if(rc < 0, "epoll_ctl(sock)");
+
+    ev.events = EPOLLIN; ev.data.ptr = &signal_fd;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+    sys_fail_if(rc < 0, "epoll_ctl(signal_fd)");
+
+    if (tmpl->args->veth_pool_given) {
+        veth_fd = netif_pool_open(tmpl->args->veth_pool_arg);
+        netif_pool_add(tmpl->netifs);
+
+        ev.events = EPOLLIN; ev.data.ptr = &veth_fd;
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, veth_fd, &ev);
+        sys_fail_if(rc < 0, "epoll_ctl(veth_fd)");
+    }
+
+    ok_printf("Pool '%d' ready", getpid());
+
+    while (1) {
+        netif_pool_refill();
+
+        /* refill the pool, the new containers are set up in the
+         * background while claims keep being served */
+        while (count < size)
+            count += zygote_spawn(&zygotes, tmpl, epoll_fd);
+
+        do {
+            n = epoll_wait(epoll_fd, events, 16, -1);
+        } while ((n < 0) && (errno == EINTR));
+
+        sys_fail_if(n < 0, "epoll_wait()");
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &veth_fd) {
+                if (!netif_pool_handle())
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, veth_fd, NULL);
+
+                continue;
+            }
+
+            if (events[i].data.ptr == &sock) {
+                struct claim *claim = pool_accept(sock);
+                if (!claim)
+                    continue;
+
+                p = malloc(sizeof(struct pending));
+                fail_if(!p, "OOM");
+
+                p->claim = claim;
+
+                ev.events = EPOLLIN | EPOLLRDHUP; ev.data.ptr = p;
+                rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD,
+                               pool_claim_fd(claim), &ev);
+                sys_fail_if(rc < 0, "epoll_ctl(claim)");
+
+                DL_APPEND(incoming, p);
+                continue;
+            }
+
+            DL_FOREACH(incoming, p) {
+                if (events[i].data.ptr == p)
+                    break;
+            }
+
+            if (p) {
+                rc = pool_recv_request(p->claim);
+                if (rc == 0)
+                    continue;
+
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL,
+                          pool_claim_fd(p->claim), NULL);
+
+                DL_DELETE(incoming, p);
+
+                if (rc < 0) {
+                    pool_release(p->claim, -1);
+                    free(p);
+                    continue;
+                }
+
+                DL_APPEND(pending, p);
+                continue;
+            }
+
+            if (events[i].data.ptr == &signal_fd) {
+                struct signalfd_siginfo fdsi;
+
+                rc = read(signal_fd, &fdsi, sizeof(fdsi));
+                sys_fail_if(rc != sizeof(fdsi), "read()");
+
+                if (fdsi.ssi_signo != SIGCHLD)
+                    goto done;
+
+                /* only containers without a pidfd rely on SIGCHLD */
+                DL_FOREACH(zygotes, z) {
+                    if (z->c.pidfd < 0)
+                        zygote_reap(z);
+                }
+
+                continue;
+            }
+
+            DL_FOREACH(zygotes, z) {
+                if (events[i].data.ptr == &z->c.pidfd)
+                    break;
+            }
+
+            if (z) {
+                if (zygote_reap(z))
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, z->c.pidfd, NULL);
+
+                continue;
+            }
+
+            z = events[i].data.ptr;
+
+            switch (z->state) {
+            case ZYGOTE_START:
+                zygote_receive(z, epoll_fd);
+                break;
+
+            case ZYGOTE_CLAIMED:
+                /* the client went away, take the container down */
+                container_kill(&z->c, SIGKILL);
+
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL,
+                          pool_claim_fd(z->claim), NULL);
+                break;
+
+            default:
+                break;
+            }
         }
 
-        if (args.chroot_given) {
-            char *term = getenv("TERM");
+        /* dead containers are freed only once the whole batch has been
+         * handled, as later events may still point to them */
+        DL_FOREACH_SAFE(zygotes, z, tmp) {
+            /* the spawner reports back once it notices */
+            if (!z->exited || (z->spawn_fd >= 0))
+                continue;
+
+            if (z->state == ZYGOTE_CLAIMED) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL,
+                          pool_claim_fd(z->claim), NULL);
+
+                pool_release(z->claim, z->status);
+            } else {
+                /* the refill at the top of the loop replaces it */
+                err_printf("Pre-forked container failed with code '%d'",
+                           z->status);
+
+                closep(&z->c.master_fd);
+                count--;
+            }
 
-            if (!args.keepenv_flag)
-                clearenv();
+            container_clean(&z->c);
 
-            setenv("PATH", "/usr/sbin:/usr/bin:/sbin:/bin", 1);
-            setenv("USER", args.user_arg, 1);
-            setenv("LOGNAME", args.user_arg, 1);
-            if (term)
-                setenv("TERM", term, 1);
+            DL_DELETE(zygotes, z);
+            free(z->c.master);
+            free(z);
         }
 
-        for (unsigned int i = 0; i < args.setenv_given; i++) {
-            rc = putenv(strdup(args.setenv_arg[i]));
-            sys_fail_if(rc != 0, "Error setting environment");
+        while (pending) {
+            DL_FOREACH(zygotes, z) {
+                if (z->state == ZYGOTE_READY)
+                    break;
+            }
+
+            if (!z)
+                break;
+
+            p = pending;
+            DL_DELETE(pending, p);
+
+            /* the container didn't take the request, so it can't take
+             * any other either: it's replaced once reaped, and the next
+             * claim goes to the next container */
+            if (pool_grant(p->claim, z->c.sync[1], z->c.master_fd) < 0) {
+                container_kill(&z->c, SIGKILL);
+                z->state = ZYGOTE_KILLED;
+
+                pool_release(p->claim, -1);
+                free(p);
+                continue;
+            }
+
+            z->claim = p->claim;
+            z->state = ZYGOTE_CLAIMED;
+            free(p);
+
+            sync_close(z->c.sync);
+            closep(&z->c.master_fd);
+
+            ev.events = EPOLLRDHUP; ev.data.ptr = z;
+            rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD,
+                           pool_claim_fd(z->claim), &ev);
+            sys_fail_if(rc < 0, "epoll_ctl(claim)");
+
+            count--;
         }
+    }
 
-        setenv("container", "pflask", 1);
+done:
+    DL_FOREACH_SAFE(zygotes, z, tmp) {
+        siginfo_t status;
 
-        if (argc > optind)
-            rc = execvpe(argv[optind], argv + optind, environ);
-        else
-            rc = execle("/bin/bash", "-bash", NULL, environ);
+        if (z->spawn_fd >= 0) {
+            kill(z->spawner, SIGKILL);
+            waitpid(z->spawner, NULL, 0);
+
+            closep(&z->spawn_fd);
+        }
 
-        sys_fail_if(rc < 0, "Error executing command");
+        if (!z->exited && (z->c.pid > 0)) {
+            container_kill(&z->c, SIGKILL);
+            container_wait(&z->c, &status, 0);
+        }
+
+        if (z->claim)
+            pool_release(z->claim, 128 + SIGKILL);
+
+        closep(&z->c.master_fd);
+        container_clean(&z->c);
+
+        DL_DELETE(zygotes, z);
+        free(z->c.master);
+        free(z);
     }
 
-    sync_wait_child(sync, SYNC_START);
+    while (pending) {
+        p = pending;
+        DL_DELETE(pending, p);
 
-    if (args.chroot_given && (clone_flags & CLONE_NEWUSER))
-        setup_console_owner(master, users);
+        pool_release(p->claim, -1);
+        free(p);
+    }
 
-    setup_cgroup(cgroups, pid);
+    while (incoming) {
+        p = incoming;
+        DL_DELETE(incoming, p);
 
-    setup_netif(netifs, pid);
+        pool_release(p->claim, -1);
+        free(p);
+    }
 
-#ifdef HAVE_DBUS
-    register_machine(pid, args.chroot_given ? args.chroot_arg : "");
-#endif
+    netif_pool_close();
 
-    if (clone_flags & CLONE_NEWUSER)
-        setup_user_map(users, pid);
+    clean_cgroup(tmpl->cgroups);
+}
 
-    sync_wake_child(sync, SYNC_DONE);
+/* Start setting up a new container for the pool. The slow parts, cloning the
+ * container and setting it up, are done by a separate process, so that the
+ * pool keeps serving the claims in the meantime. */
+static int zygote_spawn(struct zygote **zygotes, struct container *tmpl,
+                        int epoll_fd) {
+    int rc;
 
-    sync_close(sync);
+    int sock[2];
 
-    if (args.detach_flag)
-        serve_pty(master_fd);
-    else
-        process_pty(master_fd);
+    struct epoll_event ev;
 
-    kill(pid, SIGKILL);
+    struct zygote *z = malloc(sizeof(struct zygote));
+    fail_if(!z, "OOM");
 
-    rc = waitid(P_PID, pid, &status, WEXITED);
-    sys_fail_if(rc < 0, "Error waiting for child");
+    memcpy(&z->c, tmpl, sizeof(struct container));
 
-    switch (status.si_code) {
-    case CLD_EXITED:
-        if (status.si_status != 0)
-            err_printf("Child failed with code '%d'",
-                       status.si_status);
-        else
-            ok_printf("Child exited");
-        break;
+    z->state  = ZYGOTE_START;
+    z->claim  = NULL;
+    z->exited = false;
+    z->status = -1;
 
-    case CLD_KILLED:
-        err_printf("Child was terminated by signal '%d'",
-                   status.si_status);
-        break;
+    rc = socketpair(AF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sock);
+    sys_fail_if(rc < 0, "socketpair()");
 
-    default:
-        err_printf("Child failed");
-        break;
+    z->spawner = fork();
+    sys_fail_if(z->spawner < 0, "fork()");
+
+    if (!z->spawner) {
+        close(sock[0]);
+
+        zygote_setup(&z->c, sock[1]);
+        _exit(0);
     }
 
-    sync_close(sync);
+    close(sock[1]);
 
-    clean_cgroup(cgroups);
+    z->spawn_fd = sock[0];
 
-    if (args.ephemeral_flag) {
-        rc = rmdir(ephemeral_dir);
-        sys_fail_if(rc != 0, "Error deleting ephemeral directory: %s",
-                             ephemeral_dir);
+    netif_pool_skip(tmpl->netifs);
+
+    ev.events = EPOLLIN | EPOLLRDHUP; ev.data.ptr = z;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, z->spawn_fd, &ev);
+    sys_fail_if(rc < 0, "epoll_ctl(spawn)");
+
+    DL_APPEND(*zygotes, z);
+
+    return 1;
+}
+
+/* Runs in the spawner: clone the container as a child of the pool itself, so
+ * that the pool can wait for it, and set it up. */
+static void zygote_setup(struct container *c, int sock) {
+    int rc;
+
+    char *master;
+
+    int fds[2];
+
+    struct spawn_msg msg = { .type = SPAWN_STARTED };
+
+    open_master_pty(&c->master_fd, &master);
+
+    c->master = strdup(master);
+    fail_if(!c->master, "OOM");
+
+    c->spawn_fd     = sock;
+    c->clone_flags |= CLONE_PARENT;
+
+    container_spawn(c);
+
+    sync_close_child(c->sync);
+
+    msg.pid       = c->pid;
+    msg.in_cgroup = c->in_cgroup;
+    memcpy(msg.ephemeral_dir, c->ephemeral_dir, sizeof(msg.ephemeral_dir));
+
+    rc = pool_send_fds(sock, &msg, sizeof(msg), &c->pidfd,
+                       (c->pidfd >= 0) ? 1 : 0);
+    sys_fail_if(rc < 0, "Error sending container to the pool");
+
+    /* the pool notices that the container died on the way once the
+     * connection is closed */
+    if (sync_wait_child(c->sync, SYNC_START) < 0)
+        _exit(1);
+
+    container_setup(c);
+
+    sync_wake_child(c->sync, SYNC_DONE);
+
+    if (sync_wait_child(c->sync, SYNC_READY) < 0)
+        _exit(1);
+
+    msg.type = SPAWN_READY;
+
+    fds[0] = c->sync[1];
+    fds[1] = c->master_fd;
+
+    rc = pool_send_fds(sock, &msg, sizeof(msg), fds, 2);
+    sys_fail_if(rc < 0, "Error sending container to the pool");
+}
+
+/* Handle a message from the spawner of z. */
+static void zygote_receive(struct zygote *z, int epoll_fd) {
+    int rc;
+
+    ssize_t len;
+
+    struct spawn_msg msg;
+
+    struct epoll_event ev;
+
+    int fds[POOL_MAX_FDS];
+    size_t nfds = POOL_MAX_FDS;
+
+    len = pool_recv_fds(z->spawn_fd, &msg, sizeof(msg), fds, &nfds);
+
+    if ((len == sizeof(msg)) && (msg.type == SPAWN_STARTED) && (nfds <= 1)) {
+        z->c.pid       = msg.pid;
+        z->c.pidfd     = nfds ? fds[0] : -1;
+        z->c.in_cgroup = msg.in_cgroup;
+
+        memcpy(z->c.ephemeral_dir, msg.ephemeral_dir,
+               sizeof(z->c.ephemeral_dir));
+
+        if (z->c.pidfd >= 0) {
+            ev.events = EPOLLIN; ev.data.ptr = &z->c.pidfd;
+            rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, z->c.pidfd, &ev);
+            sys_fail_if(rc < 0, "epoll_ctl(pidfd)");
+        }
+
+        return;
     }
 
-    cmdline_parser_free(&args);
+    if ((len == sizeof(msg)) && (msg.type == SPAWN_READY) && (nfds == 2)) {
+        z->c.sync[1]   = fds[0];
+        z->c.master_fd = fds[1];
 
-    return status.si_status;
+        z->state = ZYGOTE_READY;
+    } else {
+        for (size_t i = 0; i < nfds; i++)
+            close(fds[i]);
+
+        /* the spawner failed on the way, the container is replaced once
+         * reaped */
+        /* the container couldn't even be created, which won't get any
+         * better by retrying */
+        fail_if(z->c.pid <= 0, "Error spawning pre-forked container");
+
+        if (!z->exited)
+            container_kill(&z->c, SIGKILL);
+
+        z->state = ZYGOTE_KILLED;
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, z->spawn_fd, NULL);
+    closep(&z->spawn_fd);
+
+    waitpid(z->spawner, NULL, 0);
+}
+
+static bool zygote_reap(struct zygote *z) {
+    if (z->exited || (z->c.pid <= 0))
+        return false;
+
+    if (!container_reap(&z->c, &z->status))
+        return false;
+
+    z->exited = true;
+
+    return true;
+}
+
+static int do_batch(const char *path, int jobs, int veth_pool) {
+    int rc, n;
+
+    sigset_t mask;
+
+    _close_ int epoll_fd = -1;
+    _close_ int signal_fd = -1;
+
+    int veth_fd = -1;
+
+    struct job *queue = NULL, *j, *tmp;
+
+    struct epoll_event events[16];
+
+    int launching = 0;
+    unsigned int failed = 0;
+    unsigned int line = 0;
+
+    FILE *file = NULL;
+
+    _free_ char *spec = NULL;
+    size_t spec_len = 0;
+
+    /* all the specs are parsed upfront, so that a typo on the last line
+     * doesn't leave the batch half-launched */
+    file = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    sys_fail_if(!file, "Error opening file '%s'", path);
+
+    while (getline(&spec, &spec_len, file) >= 0) {
+        char *start = spec + strspn(spec, " \t");
+
+        line++;
+
+        start[strcspn(start, "\n")] = '\0';
+
+        if (*start == '#' || *start == '\0')
+            continue;
+
+        j = job_parse(start, line);
+
+        DL_APPEND(queue, j);
+    }
+
+    sys_fail_if(ferror(file), "Error reading file '%s'", path);
+
+    if (file != stdin)
+        fclose(file);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGCHLD);
+
+    rc = sigprocmask(SIG_BLOCK, &mask, NULL);
+    sys_fail_if(rc < 0, "sigprocmask()");
+
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    sys_fail_if(signal_fd < 0, "signalfd()");
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    sys_fail_if(epoll_fd < 0, "epoll_create1()");
+
+    events[0].events = EPOLLIN; events[0].data.ptr = &signal_fd;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &events[0]);
+    sys_fail_if(rc < 0, "epoll_ctl(signal_fd)");
+
+    if (veth_pool) {
+        veth_fd = netif_pool_open(veth_pool);
+
+        DL_FOREACH(queue, j)
+            netif_pool_add(j->c.netifs);
+
+        events[0].events = EPOLLIN; events[0].data.ptr = &veth_fd;
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, veth_fd, &events[0]);
+        sys_fail_if(rc < 0, "epoll_ctl(veth_fd)");
+    }
+
+    while (1) {
+        bool active = false;
+
+        netif_pool_refill();
+
+        /* the launches are throttled, the containers that are already
+         * running don't count towards the limit */
+        DL_FOREACH(queue, j) {
+            if (launching >= jobs)
+                break;
+
+            if (j->state != JOB_QUEUED)
+                continue;
+
+            job_spawn(j, epoll_fd);
+            launching++;
+        }
+
+        DL_FOREACH(queue, j) {
+            if (j->state != JOB_DONE)
+                active = true;
+        }
+
+        if (!active)
+            break;
+
+        do {
+            n = epoll_wait(epoll_fd, events, 16, -1);
+        } while ((n < 0) && (errno == EINTR));
+
+        sys_fail_if(n < 0, "epoll_wait()");
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &veth_fd) {
+                if (!netif_pool_handle())
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, veth_fd, NULL);
+
+                continue;
+            }
+
+            if (events[i].data.ptr == &signal_fd) {
+                struct signalfd_siginfo fdsi;
+
+                rc = read(signal_fd, &fdsi, sizeof(fdsi));
+                sys_fail_if(rc != sizeof(fdsi), "read()");
+
+                if (fdsi.ssi_signo != SIGCHLD)
+                    goto done;
+
+                /* only containers without a pidfd rely on SIGCHLD */
+                DL_FOREACH(queue, j) {
+                    if (j->c.pidfd < 0)
+                        job_reap(j, epoll_fd);
+                }
+
+                continue;
+            }
+
+            DL_FOREACH(queue, j) {
+                if (events[i].data.ptr == &j->c.pidfd)
+                    break;
+            }
+
+            if (j) {
+                job_reap(j, epoll_fd);
+                continue;
+            }
+
+            j = events[i].data.ptr;
+
+            switch (j->state) {
+            case JOB_START:
+                if ((events[i].events & EPOLLIN) &&
+                    (sync_wait_child(j->c.sync, SYNC_START) == 0)) {
+                    container_setup(&j->c);
+
+                    sync_wake_child(j->c.sync, SYNC_DONE);
+
+                    j->state = JOB_SETUP;
+                    break;
+                }
+
+                /* the child died before asking to be set up */
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, j->c.sync[1], NULL);
+                sync_close(j->c.sync);
+
+                j->state = JOB_RUNNING;
+
+                job_reap(j, epoll_fd);
+                break;
+
+            case JOB_SETUP:
+                /* the child's end was closed by exec() */
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, j->c.sync[1], NULL);
+                sync_close(j->c.sync);
+
+                j->state = JOB_RUNNING;
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        launching = 0;
+
+        DL_FOREACH(queue, j) {
+            if ((j->state == JOB_START) || (j->state == JOB_SETUP))
+                launching++;
+        }
+    }
+
+done:
+    DL_FOREACH_SAFE(queue, j, tmp) {
+        if ((j->state != JOB_QUEUED) && (j->state != JOB_DONE)) {
+            siginfo_t status;
+
+            container_kill(&j->c, SIGKILL);
+            container_wait(&j->c, &status, 0);
+
+            j->status = 128 + SIGKILL;
+            j->state  = JOB_DONE;
+
+            container_clean(&j->c);
+        }
+
+        if ((j->state != JOB_DONE) || (j->status != 0))
+            failed++;
+
+        DL_DELETE(queue, j);
+        job_free(j);
+    }
+
+    netif_pool_close();
+
+    if (failed) {
+        err_printf("%u containers failed", failed);
+        return 1;
+    }
+
+    return 0;
+}
+
+static struct job *job_parse(const char *spec, unsigned int line) {
+    int rc;
+
+    char *argv0 = "pflask";
+
+    struct job *j = calloc(1, sizeof(struct job));
+    fail_if(!j, "OOM");
+
+    j->line  = line;
+    j->state = JOB_QUEUED;
+
+    rc = wordexp(spec, &j->words, WRDE_NOCMD | WRDE_SHOWERR);
+    fail_if(rc != 0, "Invalid container spec at line %u", line);
+
+    j->argv = calloc(j->words.we_wordc + 2, sizeof(char *));
+    fail_if(!j->argv, "OOM");
+
+    j->argv[0] = argv0;
+    memcpy(j->argv + 1, j->words.we_wordv,
+           j->words.we_wordc * sizeof(char *));
+
+    rc = cmdline_parser(j->words.we_wordc + 1, j->argv, &j->args);
+    fail_if(rc != 0, "Invalid container spec at line %u", line);
+
+    if (j->args.attach_given || j->args.claim_given ||
+        j->args.pool_given   || j->args.batch_given ||
+        j->args.detach_given || j->args.timings_given ||
+        j->args.veth_pool_given)
+        fail_printf("Unsupported option in container spec at line %u",
+                    line);
+
+    container_init(&j->c, &j->args, (int) j->words.we_wordc + 1 > optind ?
+                                    j->argv + optind : NULL);
+
+    j->c.batch = true;
+
+    return j;
+}
+
+static void job_spawn(struct job *j, int epoll_fd) {
+    int rc;
+
+    struct epoll_event ev;
+
+    container_spawn(&j->c);
+
+    sync_close_child(j->c.sync);
+
+    ev.events = EPOLLIN | EPOLLRDHUP; ev.data.ptr = j;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, j->c.sync[1], &ev);
+    sys_fail_if(rc < 0, "epoll_ctl(sync)");
+
+    if (j->c.pidfd >= 0) {
+        ev.events = EPOLLIN; ev.data.ptr = &j->c.pidfd;
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, j->c.pidfd, &ev);
+        sys_fail_if(rc < 0, "epoll_ctl(pidfd)");
+    }
+
+    j->state = JOB_START;
+}
+
+static bool job_reap(struct job *j, int epoll_fd) {
+    if ((j->state == JOB_QUEUED) || (j->state == JOB_DONE))
+        return false;
+
+    if (!container_reap(&j->c, &j->status))
+        return false;
+
+    if (j->c.sync[1] >= 0)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, j->c.sync[1], NULL);
+
+    if (j->c.pidfd >= 0)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, j->c.pidfd, NULL);
+
+    if (j->status != 0)
+        err_printf("Container at line %u failed with code '%d'",
+                   j->line, j->status);
+
+    container_clean(&j->c);
+
+    j->state = JOB_DONE;
+
+    return true;
+}
+
+static void job_free(struct job *j) {
+    cmdline_parser_free(&j->args);
+    wordfree(&j->words);
+    free(j->argv);
+    free(j);
 }
 
 static size_t validate_optlist(const char *name, const char *opts) {
@@ -394,11 +1657,50 @@ static void do_chroot(const char *dest) {
     sys_fail_if(rc < 0, "chdir(/)");
 }
 
-static pid_t do_clone(int *flags) {
+static pid_t do_clone(int *flags, int cgroup_fd, int *pidfd, bool *in_cgroup) {
     pid_t pid;
 
     *flags |= SIGCHLD;
 
+    *in_cgroup = false;
+
+#if defined(__NR_clone3) && defined(CLONE_INTO_CGROUP)
+    struct clone_args args = {
+        .flags       = (*flags & ~CSIGNAL) | CLONE_PIDFD,
+        .pidfd       = (uintptr_t) pidfd,
+        .exit_signal = SIGCHLD,
+    };
+
+    /* the parent's parent is signaled as it was for the parent */
+    if (*flags & CLONE_PARENT)
+        args.exit_signal = 0;
+
+    if (cgroup_fd >= 0) {
+        args.flags  |= CLONE_INTO_CGROUP;
+        args.cgroup  = cgroup_fd;
+    }
+
+    pid = syscall(__NR_clone3, &args, sizeof(args));
+    if ((pid < 0) && (errno == EINVAL) && (*flags & CLONE_NEWUSER)) {
+        *flags &= ~(CLONE_NEWUSER);
+        args.flags &= ~(CLONE_NEWUSER);
+        pid = syscall(__NR_clone3, &args, sizeof(args));
+    }
+
+    /* the cgroup will be joined later by setup_cgroup() instead */
+    if ((pid < 0) && (errno != ENOSYS) && (cgroup_fd >= 0)) {
+        args.flags &= ~(CLONE_INTO_CGROUP);
+        pid = syscall(__NR_clone3, &args, sizeof(args));
+    }
+
+    if (pid >= 0) {
+        *in_cgroup = (args.flags & CLONE_INTO_CGROUP) != 0;
+        return pid;
+    }
+
+    sys_fail_if(errno != ENOSYS, "Error cloning process");
+#endif
+
     pid = syscall(__NR_clone, *flags, NULL);
     if (pid < 0) {
         if (errno == EINVAL) {
@@ -0,0 +1,484 @@
+/*
+ * The process in the flask.
+ *
+ * Copyright (c) 2013, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <termios.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "pool.h"
+#include "pty.h"
+#include "printf.h"
+#include "util.h"
+
+#define POOL_SOCKET_PATH "@/com/github/ghedo/pflask/pool/%u"
+
+struct request {
+    uint32_t argc;
+    uint32_t envc;
+
+    uint32_t has_attr;
+    struct termios attr;
+    struct winsize ws;
+
+    /* chdir, argv and env as consecutive NUL-terminated strings */
+    char data[];
+};
+
+struct claim {
+    int sock;
+
+    struct request *req;
+    size_t len;
+};
+
+static void make_addr(pid_t pid, struct sockaddr_un *addr, socklen_t *len);
+static int read_all(int fd, void *buf, size_t len);
+static int write_all(int fd, const void *buf, size_t len);
+static char *next_str(char **p, char *end);
+
+int pool_listen(pid_t pid) {
+    int rc;
+    socklen_t addrlen;
+
+    int sock = -1;
+
+    struct sockaddr_un addr;
+
+    make_addr(pid, &addr, &addrlen);
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    sys_fail_if(sock < 0, "socket()");
+
+    rc = bind(sock, (struct sockaddr *) &addr, addrlen);
+    sys_fail_if(rc < 0, "bind()");
+
+    rc = listen(sock, SOMAXCONN);
+    sys_fail_if(rc < 0, "listen()");
+
+    return sock;
+}
+
+/* Accept a client of the pool. Its socket is non-blocking, so that a client
+ * that doesn't send its request can't hold up the pool: the request is read
+ * with pool_recv_request() once the socket becomes readable. */
+struct claim *pool_accept(int sock) {
+    int rc;
+    socklen_t cred_len;
+
+    _close_ int fd = -1;
+
+    struct ucred ucred;
+
+    struct claim *claim = NULL;
+
+    fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0)
+        return NULL;
+
+    cred_len = sizeof(struct ucred);
+    rc = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &ucred, &cred_len);
+    sys_fail_if(rc < 0, "getsockopt(SO_PEERCRED)");
+
+    if (ucred.uid != geteuid())
+        return NULL;
+
+    claim = calloc(1, sizeof(struct claim));
+    fail_if(!claim, "OOM");
+
+    claim->sock = fd;
+    fd = -1;
+
+    return claim;
+}
+
+/* Returns 1 once the claim request has been received, 0 if it hasn't arrived
+ * yet, and -1 if the client sent an invalid one or went away. */
+int pool_recv_request(struct claim *claim) {
+    ssize_t len;
+
+    len = recv(claim->sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
+    if ((len < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+        return 0;
+
+    if (len < (ssize_t) sizeof(struct request)) {
+        if (len != 0)
+            err_printf("Invalid claim request");
+
+        return -1;
+    }
+
+    claim->len = len;
+    claim->req = malloc(len);
+    fail_if(!claim->req, "OOM");
+
+    if (recv(claim->sock, claim->req, len, 0) != len) {
+        err_printf("Invalid claim request");
+
+        freep(&claim->req);
+        return -1;
+    }
+
+    return 1;
+}
+
+int pool_claim_fd(struct claim *claim) {
+    return claim->sock;
+}
+
+int pool_grant(struct claim *claim, int child_fd, int master_fd) {
+    uint32_t len = claim->len;
+
+    if (write_all(child_fd, &len, sizeof(len)) < 0 ||
+        write_all(child_fd, claim->req, claim->len) < 0)
+        return -1;
+
+    freep(&claim->req);
+
+    if (send_fd(claim->sock, master_fd) < 0)
+        err_printf("Error sending pty to client");
+
+    return 0;
+}
+
+void pool_release(struct claim *claim, int status) {
+    send(claim->sock, &status, sizeof(status), MSG_NOSIGNAL);
+
+    closep(&claim->sock);
+
+    freep(&claim->req);
+    free(claim);
+}
+
+int pool_claim(pid_t pid, char **argv, const char *chdir,
+               char **env, unsigned int envc) {
+    int rc;
+    socklen_t addrlen;
+
+    char *p, *term;
+    size_t len;
+
+    int status = -1;
+
+    _close_ int sock = -1;
+    _close_ int master_fd = -1;
+
+    _free_ struct request *req = NULL;
+
+    struct sockaddr_un addr;
+
+    term = getenv("TERM");
+
+    len = sizeof(struct request) + strlen(chdir ? chdir : "") + 1;
+
+    for (char **i = argv; i && *i; i++)
+        len += strlen(*i) + 1;
+
+    for (unsigned int i = 0; i < envc; i++)
+        len += strlen(env[i]) + 1;
+
+    if (term)
+        len += strlen("TERM=") + strlen(term) + 1;
+
+    req = calloc(1, len);
+    fail_if(!req, "OOM");
+
+    p = stpcpy(req->data, chdir ? chdir : "") + 1;
+
+    for (char **i = argv; i && *i; i++, req->argc++)
+        p = stpcpy(p, *i) + 1;
+
+    if (term) {
+        p = stpcpy(stpcpy(p, "TERM="), term) + 1;
+        req->envc++;
+    }
+
+    for (unsigned int i = 0; i < envc; i++, req->envc++)
+        p = stpcpy(p, env[i]) + 1;
+
+    if (isatty(STDIN_FILENO)) {
+        rc = tcgetattr(STDIN_FILENO, &req->attr);
+        sys_fail_if(rc < 0, "tcgetattr()");
+
+        rc = ioctl(STDIN_FILENO, TIOCGWINSZ, &req->ws);
+        sys_fail_if(rc < 0, "ioctl(TIOCGWINSZ)");
+
+        req->has_attr = 1;
+    }
+
+    make_addr(pid, &addr, &addrlen);
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    sys_fail_if(sock < 0, "socket()");
+
+    rc = connect(sock, (struct sockaddr *) &addr, addrlen);
+    sys_fail_if(rc < 0, "connect()");
+
+    rc = send(sock, req, len, MSG_NOSIGNAL);
+    sys_fail_if(rc < 0, "Error sending claim request");
+
+    master_fd = recv_fd(sock);
+    fail_if(master_fd < 0, "Pool '%u' refused the claim", pid);
+
+    process_pty(master_fd, -1, NULL);
+
+    rc = read_all(sock, &status, sizeof(status));
+    sys_fail_if(rc < 0, "Error receiving exit status");
+
+    return status;
+}
+
+void pool_wait_request(int fd, char ***argv, char **chdir, char ***env) {
+    int rc;
+    uint32_t len;
+
+    char *p, *end;
+    struct request *req;
+
+    rc = read_all(fd, &len, sizeof(len));
+    sys_fail_if(rc < 0, "Error receiving request");
+
+    fail_if(len < sizeof(struct request), "Invalid request");
+
+    req = malloc(len);
+    fail_if(!req, "OOM");
+
+    rc = read_all(fd, req, len);
+    sys_fail_if(rc < 0, "Error receiving request");
+
+    p   = req->data;
+    end = (char *) req + len;
+
+    *chdir = next_str(&p, end);
+    if (!**chdir)
+        *chdir = NULL;
+
+    *argv = NULL;
+
+    if (req->argc) {
+        *argv = calloc(req->argc + 1, sizeof(char *));
+        fail_if(!*argv, "OOM");
+
+        for (uint32_t i = 0; i < req->argc; i++)
+            (*argv)[i] = next_str(&p, end);
+    }
+
+    *env = calloc(req->envc + 1, sizeof(char *));
+    fail_if(!*env, "OOM");
+
+    for (uint32_t i = 0; i < req->envc; i++)
+        (*env)[i] = next_str(&p, end);
+
+    if (req->has_attr && isatty(STDIN_FILENO)) {
+        rc = tcsetattr(STDIN_FILENO, TCSANOW, &req->attr);
+        sys_fail_if(rc < 0, "tcsetattr()");
+
+        rc = ioctl(STDIN_FILENO, TIOCSWINSZ, &req->ws);
+        sys_fail_if(rc < 0, "ioctl(TIOCSWINSZ)");
+    }
+}
+
+/* Send a message along with up to POOL_MAX_FDS file descriptors, used by the
+ * spawners to hand the containers they set up over to the pool. */
+int pool_send_fds(int sock, const void *buf, size_t len,
+                  const int *fds, size_t nfds) {
+    union {
+        struct cmsghdr cmsg;
+        char           control[CMSG_SPACE(sizeof(int) * POOL_MAX_FDS)];
+    } msg_control;
+
+    struct iovec iov = {
+        .iov_base = (void *) buf,
+        .iov_len  = len
+    };
+
+    struct msghdr msg = {
+        .msg_iov    = &iov,
+        .msg_iovlen = 1,
+    };
+
+    struct cmsghdr *cmsg;
+
+    fail_if(nfds > POOL_MAX_FDS, "Too many file descriptors");
+
+    if (nfds) {
+        msg.msg_control    = &msg_control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * nfds);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+/* Receive a message sent with pool_send_fds(). On return nfds is the number of
+ * file descriptors received. Returns the length of the message, 0 on EOF and
+ * -1 on error. */
+ssize_t pool_recv_fds(int sock, void *buf, size_t len,
+                      int *fds, size_t *nfds) {
+    ssize_t rc;
+
+    union {
+        struct cmsghdr cmsg;
+        char           control[CMSG_SPACE(sizeof(int) * POOL_MAX_FDS)];
+    } msg_control;
+
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len  = len
+    };
+
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = &msg_control,
+        .msg_controllen = sizeof(msg_control)
+    };
+
+    struct cmsghdr *cmsg;
+
+    size_t max = *nfds;
+
+    *nfds = 0;
+
+    do {
+        rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while ((rc < 0) && (errno == EINTR));
+
+    if (rc < 0)
+        return -1;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        size_t n;
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        for (size_t i = 0; i < n; i++) {
+            int fd;
+
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+            if (*nfds < max)
+                fds[(*nfds)++] = fd;
+            else
+                close(fd);
+        }
+    }
+
+    return rc;
+}
+
+static void make_addr(pid_t pid, struct sockaddr_un *addr, socklen_t *len) {
+    int rc;
+
+    _free_ char *path = NULL;
+
+    rc = asprintf(&path, POOL_SOCKET_PATH, pid);
+    fail_if(rc < 0, "OOM");
+
+    if ((size_t) rc >= sizeof(addr->sun_path))
+        fail_printf("Socket path too long");
+
+    memset(addr, 0, sizeof(struct sockaddr_un));
+
+    addr->sun_family = AF_UNIX;
+
+    rc = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", path);
+    addr->sun_path[0] = '\0';
+
+    *len = offsetof(struct sockaddr_un, sun_path) + rc;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t rc = read(fd, p, len);
+
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        if (rc == 0)
+            errno = EPIPE;
+
+        if (rc <= 0)
+            return -1;
+
+        p   += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t rc = send(fd, p, len, MSG_NOSIGNAL);
+
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        if (rc < 0)
+            return -1;
+
+        p   += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+static char *next_str(char **p, char *end) {
+    char *str = *p;
+    char *nul = memchr(str, '\0', end - str);
+
+    fail_if(!nul, "Invalid request");
+
+    *p = nul + 1;
+    return str;
+}
@@ -29,11 +29,18 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <signal.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <time.h>
 
 #include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
 #include <termios.h>
 
 #include <sys/ioctl.h>
@@ -43,16 +50,126 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#include <linux/io_uring.h>
+
+#include "ut/utlist.h"
+
+#include "pty.h"
+#include "logfile.h"
+#include "relay.h"
+#include "detach.h"
+#include "ring.h"
+#include "uring.h"
 #include "printf.h"
 #include "util.h"
 
 #define SOCKET_PATH "@/com/github/ghedo/pflask/%u"
 
+/* the output of a detached container is kept in a ring buffer of at least
+ * this size, which is also how far behind an attached client can fall */
+#define RING_SIZE  (1024 * 1024)
+#define RING_CHUNK (64 * 1024)
+
+struct pipe_log {
+    int fd;
+    int prio;
+
+    size_t len;
+    char buf[LINE_MAX];
+};
+
+/* The first message on a connection to a detached pflask: either a client
+ * attaching, with the size of its terminal, or a client that was resized.
+ * The container's terminal is only ever touched by the detached pflask. */
+enum attach_type {
+    ATTACH_DATA,
+    ATTACH_RESIZE,
+};
+
+struct attach_msg {
+    uint32_t type;
+    struct winsize ws;
+};
+
+struct client {
+    int fd;
+
+    /* the first message, until it has been received in full */
+    struct attach_msg hello;
+    size_t hello_len;
+
+    /* input of the client, merged with the other clients' */
+    struct relay in;
+
+    /* position in the ring of the next byte of output to send */
+    uint64_t pos;
+
+    struct client *next, *prev;
+};
+
+enum pty_event {
+    PTY_RUNNING,
+    PTY_EXITED,
+    PTY_DONE,
+};
+
+/* the requests the io_uring relay can have in flight, at most one of each */
+enum uring_op {
+    URING_READ_IN,
+    URING_WRITE_IN,
+    URING_READ_OUT,
+    URING_WRITE_OUT,
+    URING_SIGNAL,
+    URING_PID,
+    URING_CANCEL,
+    URING_OP_MAX,
+};
+
 static struct termios stdin_attr;
 static struct winsize stdin_ws;
 
-static int recv_fd(int sock);
-static void send_fd(int sock, int fd);
+/* the detached pflask that resizes the terminal for the attached client */
+static pid_t attach_pid = -1;
+
+static void relay_pty(int fd, int tty_fd, int pidfd,
+                      struct relay_opts *opts);
+static enum pty_event relay_epoll(int signal_fd, int pidfd, int tty_fd,
+                                  struct relay *in, struct relay *out,
+                                  struct logfile *log);
+static enum pty_event relay_uring(struct uring *u, int signal_fd, int pidfd,
+                                  int tty_fd, struct relay *in,
+                                  struct relay *out, struct logfile *log);
+static enum pty_event read_signals(int signal_fd, int tty_fd);
+static int connect_pty(pid_t pid);
+
+static void send_resize(pid_t pid, struct winsize *ws);
+static void client_add(struct client **clients, int epoll_fd, int fd);
+static int client_hello(struct client *cl, int master_fd, struct ring *ring,
+                        size_t scrollback);
+static void client_del(struct client **clients, struct client *cl);
+static bool client_flush(struct client *cl, struct ring *ring);
+static enum relay_state fan_out(struct client **clients, int master_fd,
+                                struct ring *ring, struct logfile *log);
+
+static bool scan_detach(void *data, const char *buf, size_t *len);
+static bool scan_log(void *data, const char *buf, size_t *len);
+static void flush_relay(struct relay *r);
+static int set_nonblock(int fd, bool nonblock);
+
+static bool uring_open_relay(struct uring *u);
+static void uring_queue_read(struct uring *u, struct relay *r,
+                             enum uring_op op, bool *busy);
+static void uring_queue_write(struct uring *u, struct relay *r,
+                              enum uring_op op, bool *busy);
+static void uring_queue_poll(struct uring *u, int fd, enum uring_op op,
+                             bool *busy);
+static void uring_cancel(struct uring *u, bool *busy);
+static bool uring_busy(bool *busy);
+static bool uring_read_done(struct relay *r, int len);
+static void uring_write_done(struct relay *r, int len);
+static ssize_t read_log(struct pipe_log *l);
+static void flush_log(struct pipe_log *l);
+static uint64_t now_ns(void);
 
 void open_master_pty(int *master_fd, char **master_name) {
     int rc;
@@ -75,6 +192,16 @@ void open_master_pty(int *master_fd, char **master_name) {
     sys_fail_if(rc < 0, "Error unlocking master pty");
 }
 
+void open_pipe(int *read_fd, int *write_fd) {
+    int rc, fds[2];
+
+    rc = pipe2(fds, O_CLOEXEC);
+    sys_fail_if(rc < 0, "pipe2()");
+
+    *read_fd  = fds[0];
+    *write_fd = fds[1];
+}
+
 void open_slave_pty(const char *master_name) {
     int rc;
 
@@ -103,30 +230,107 @@ void open_slave_pty(const char *master_name) {
     }
 }
 
-void process_pty(int master_fd) {
+void process_pty(int master_fd, int pidfd, struct relay_opts *opts) {
+    relay_pty(master_fd, master_fd, pidfd, opts);
+}
+
+void attach_pty(pid_t pid, struct relay_opts *opts) {
+    int rc;
+
+    _close_ int sock = -1;
+
+    struct attach_msg msg = { .type = ATTACH_DATA };
+
+    if (isatty(STDIN_FILENO)) {
+        rc = ioctl(STDIN_FILENO, TIOCGWINSZ, &msg.ws);
+        sys_fail_if(rc < 0, "ioctl(TIOCGWINSZ)");
+    }
+
+    sock = connect_pty(pid);
+
+    rc = send(sock, &msg, sizeof(msg), MSG_NOSIGNAL);
+    sys_fail_if(rc < 0, "Error attaching to '%u'", pid);
+
+    attach_pid = pid;
+
+    relay_pty(sock, -1, -1, opts);
+}
+
+/* Relay between the terminal and fd, which is either the master pty or the
+ * connection to a detached pflask, while tty_fd is the pty to resize, or -1
+ * if the detached pflask resizes it. */
+static void relay_pty(int fd, int tty_fd, int pidfd,
+                      struct relay_opts *opts) {
     int rc;
 
     sigset_t mask;
 
-    _close_ int epoll_fd  = -1;
     _close_ int signal_fd = -1;
 
     struct termios raw_attr;
 
-    struct epoll_event stdin_ev, master_ev, signal_ev, events[3];
+    struct relay in, out;
+
+    struct uring uring;
+
+    enum pty_event ev;
+
+    int fd_flags, stdin_flags, stdout_flags;
+
+    uint64_t bytes, start = now_ns();
+
+    struct logfile *log = opts ? opts->log : NULL;
+
+    struct detach *detach = opts ? opts->detach : NULL;
+
+    enum relay_engine engine = opts ? opts->engine : RELAY_ENGINE_AUTO;
+
+    enum relay_policy policy = opts ? opts->policy : RELAY_POLICY_BLOCK;
+
+    bool use_uring = false;
+
+    /* the output can only be dropped or spilled while no write is using
+     * the buffer, which is never the case with io_uring */
+    if ((engine != RELAY_ENGINE_EPOLL) && (policy == RELAY_POLICY_BLOCK)) {
+        use_uring = uring_open_relay(&uring);
 
-    int line_max = sysconf(_SC_LINE_MAX);
-    sys_fail_if(line_max < 0, "sysconf()");
+        fail_if(!use_uring && (engine == RELAY_ENGINE_URING),
+                "io_uring is not supported by the kernel");
+    }
 
     memcpy(&raw_attr, &stdin_attr, sizeof(stdin_attr));
 
+    /* the data can go through splice(), unless the input needs to be
+     * scanned for the detach keys, the output needs to be logged too or
+     * dropped or spilled when the terminal is slow, or the data is moved by
+     * io_uring */
+    relay_init(&in, STDIN_FILENO, fd, !detach && !use_uring);
+    relay_init(&out, fd, STDOUT_FILENO,
+               !log && !use_uring && (policy == RELAY_POLICY_BLOCK));
+
+    if (opts)
+        relay_set_policy(&out, policy, opts->buffer);
+
+    if (detach) {
+        in.scan = scan_detach;
+        in.data = detach;
+    }
+
+    if (log) {
+        out.scan = scan_log;
+        out.data = log;
+    }
+
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
     sigaddset(&mask, SIGTERM);
-    sigaddset(&mask, SIGCHLD);
     sigaddset(&mask, SIGWINCH);
     sigaddset(&mask, SIGRTMIN + 4);
 
+    /* without a pidfd, fall back to SIGCHLD to know when the child dies */
+    if (pidfd < 0)
+        sigaddset(&mask, SIGCHLD);
+
     rc = sigprocmask(SIG_BLOCK, &mask, NULL);
     sys_fail_if(rc < 0, "sigprocmask()");
 
@@ -142,98 +346,365 @@ void process_pty(int master_fd) {
     rc = tcsetattr(STDIN_FILENO, TCSANOW, &raw_attr);
     sys_fail_if(rc < 0, "tcsetattr()");
 
+    /* with epoll the relay must never block, a slow terminal only fills up
+     * its buffer (and then the pty's), while io_uring waits for the data
+     * itself, which it can only do on blocking files */
+    fd_flags     = set_nonblock(fd, !use_uring);
+    stdin_flags  = set_nonblock(STDIN_FILENO, !use_uring);
+    stdout_flags = set_nonblock(STDOUT_FILENO, !use_uring);
+
+    if (use_uring) {
+        ev = relay_uring(&uring, signal_fd, pidfd, tty_fd, &in, &out, log);
+        uring_free(&uring);
+
+        set_nonblock(fd, true);
+        set_nonblock(STDIN_FILENO, true);
+        set_nonblock(STDOUT_FILENO, true);
+    } else {
+        ev = relay_epoll(signal_fd, pidfd, tty_fd, &in, &out, log);
+    }
+
+    /* the input typed right before the detach keys may not be written yet */
+    if (ev == PTY_DONE)
+        relay_drain(&in);
+
+    /* the child is gone, but its last output may still be in the pty */
+    if (ev == PTY_EXITED) {
+        do {
+            bytes = out.bytes;
+
+            rc = relay_pump(&out);
+            flush_relay(&out);
+        } while ((rc == RELAY_OPEN) && (out.bytes != bytes));
+    }
+
+    fcntl(fd, F_SETFL, fd_flags);
+    fcntl(STDIN_FILENO, F_SETFL, stdin_flags);
+    fcntl(STDOUT_FILENO, F_SETFL, stdout_flags);
+
+    rc = tcsetattr(STDIN_FILENO, TCSANOW, &stdin_attr);
+    sys_fail_if(rc < 0, "tcsetattr()");
+
+    if (opts && opts->stats)
+        relay_report(&in, &out, now_ns() - start);
+
+    relay_free(&in);
+    relay_free(&out);
+}
+
+static enum pty_event relay_epoll(int signal_fd, int pidfd, int tty_fd,
+                                  struct relay *in, struct relay *out,
+                                  struct logfile *log) {
+    int rc, n;
+
+    _close_ int epoll_fd = -1;
+
+    struct epoll_event ev, events[8];
+
     epoll_fd = epoll_create1(EPOLL_CLOEXEC);
     sys_fail_if(epoll_fd < 0, "epoll_create1()");
 
-    stdin_ev.events = EPOLLIN; stdin_ev.data.fd = STDIN_FILENO;
-    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stdin_ev.data.fd, &stdin_ev);
+    ev.events = EPOLLIN | EPOLLET; ev.data.fd = in->in;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
     sys_fail_if(rc < 0, "epoll_ctl(STDIN_FILENO)");
 
-    master_ev.events = EPOLLIN; master_ev.data.fd = master_fd;
-    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, master_ev.data.fd, &master_ev);
-    sys_fail_if(rc < 0, "epoll_ctl(master_fd)");
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET; ev.data.fd = out->in;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+    sys_fail_if(rc < 0, "epoll_ctl(fd)");
 
-    signal_ev.events = EPOLLIN; signal_ev.data.fd = signal_fd;
-    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_ev.data.fd, &signal_ev);
+    /* regular files can't be polled, but writing to them never blocks */
+    ev.events = EPOLLOUT | EPOLLET; ev.data.fd = out->out;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+    sys_fail_if((rc < 0) && (errno != EPERM), "epoll_ctl(STDOUT_FILENO)");
+
+    ev.events = EPOLLIN; ev.data.fd = signal_fd;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
     sys_fail_if(rc < 0, "epoll_ctl(signal_fd)");
 
+    if (pidfd >= 0) {
+        ev.events = EPOLLIN; ev.data.fd = pidfd;
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+        sys_fail_if(rc < 0, "epoll_ctl(pidfd)");
+    }
+
     while (1) {
-        char buf[line_max];
+        bool pump_in = false, pump_out = false;
 
         do {
-            rc = epoll_wait(epoll_fd, events, 1, -1);
-        } while ((rc < 0) && (errno == EINTR));
+            n = epoll_wait(epoll_fd, events, 8, -1);
+        } while ((n < 0) && (errno == EINTR));
 
-        sys_fail_if(rc < 0, "epoll_wait()");
+        sys_fail_if(n < 0, "epoll_wait()");
 
-        if (events[0].data.fd == STDIN_FILENO) {
-            char *p;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == in->in)
+                pump_in = true;
 
-            int rc = read(STDIN_FILENO, buf, line_max);
+            if (events[i].data.fd == out->out)
+                pump_out = true;
 
-            if (!rc)
-                goto done;
-            else if (rc < 0)
-                goto done;
+            /* fd being writable again unblocks the input */
+            if (events[i].data.fd == out->in) {
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    pump_out = true;
 
-            rc = write(master_fd, buf, rc);
-            sys_fail_if(rc < 0, "write()");
+                if (events[i].events & EPOLLOUT)
+                    pump_in = true;
+            }
+
+            if (events[i].data.fd == pidfd)
+                return PTY_EXITED;
+
+            if (events[i].data.fd == signal_fd) {
+                enum pty_event ev = read_signals(signal_fd, tty_fd);
 
-            for (p = buf; p < buf + rc; p++) {
-                if (*p == '\0')
-                    goto done;
+                if (ev != PTY_RUNNING)
+                    return ev;
             }
         }
 
-        if (events[0].data.fd == master_fd) {
-            rc = read(master_fd, buf, line_max);
+        if (pump_out) {
+            rc = relay_pump(out);
 
-            if (!rc)
-                goto done;
-            else if (rc < 0)
-                goto done;
+            if (log)
+                logfile_flush(log);
 
-            rc = write(STDOUT_FILENO, buf, rc);
-            sys_fail_if(rc < 0, "write()");
+            if (rc != RELAY_OPEN)
+                return PTY_EXITED;
         }
 
-        if (events[0].data.fd == signal_fd) {
-            struct signalfd_siginfo fdsi;
+        if (pump_in && (relay_pump(in) != RELAY_OPEN))
+            return PTY_DONE;
+    }
+}
 
-            rc = read(signal_fd, &fdsi, sizeof(fdsi));
-            sys_fail_if(rc != sizeof(fdsi), "read()");
+/* Move the data through io_uring: a read is kept queued on each input for as
+ * long as its relay has room, and a write on each output for as long as there
+ * is data to write, so the relay only needs one system call per wakeup to
+ * submit the new requests and wait for the next completion. */
+static enum pty_event relay_uring(struct uring *u, int signal_fd, int pidfd,
+                                  int tty_fd, struct relay *in,
+                                  struct relay *out, struct logfile *log) {
+    int rc;
+
+    bool busy[URING_OP_MAX] = { false };
+
+    enum pty_event ev = PTY_RUNNING;
+
+    bool cancelling = false;
+
+    while (1) {
+        struct io_uring_cqe *cqe;
+
+        if (ev == PTY_RUNNING) {
+            uring_queue_read(u, in, URING_READ_IN, busy);
+            uring_queue_write(u, in, URING_WRITE_IN, busy);
+            uring_queue_read(u, out, URING_READ_OUT, busy);
+            uring_queue_write(u, out, URING_WRITE_OUT, busy);
+
+            uring_queue_poll(u, signal_fd, URING_SIGNAL, busy);
+            uring_queue_poll(u, pidfd, URING_PID, busy);
+        }
+
+        rc = uring_submit(u, 1);
+        sys_fail_if(rc < 0, "io_uring_enter()");
+
+        while ((cqe = uring_peek_cqe(u)) != NULL) {
+            enum uring_op op = cqe->user_data;
+            int res = cqe->res;
 
-            switch (fdsi.ssi_signo) {
-            case SIGWINCH: {
-                struct winsize ws;
+            uring_cqe_seen(u);
 
-                rc = ioctl(STDIN_FILENO,TIOCGWINSZ,&ws);
-                sys_fail_if(rc < 0, "ioctl()");
+            busy[op] = false;
 
-                rc = ioctl(master_fd, TIOCSWINSZ, &ws);
-                sys_fail_if(rc < 0, "ioctl()");
+            if (res == -EINTR || res == -ECANCELED)
+                continue;
+
+            switch (op) {
+            case URING_READ_IN:
+                if (ev != PTY_RUNNING)
+                    break;
+
+                if (res <= 0)
+                    ev = PTY_DONE;
+                else if (uring_read_done(in, res))
+                    ev = PTY_DONE;
+                break;
+
+            case URING_READ_OUT:
+                /* the other side of a pty was closed */
+                if ((res == 0) || (res == -EIO) || (res == -ECONNRESET)) {
+                    if (ev == PTY_RUNNING)
+                        ev = PTY_EXITED;
+                    break;
+                }
+
+                if (res < 0) {
+                    errno = -res;
+                    sysf_printf("Error reading input");
+                }
+
+                uring_read_done(out, res);
+
+                if (log)
+                    logfile_flush(log);
+                break;
+
+            case URING_WRITE_IN:
+            case URING_WRITE_OUT:
+                if (res < 0) {
+                    errno = -res;
+                    sysf_printf("Error writing output");
+                }
+
+                uring_write_done(op == URING_WRITE_IN ? in : out, res);
+                break;
 
+            case URING_SIGNAL:
+                if (ev == PTY_RUNNING)
+                    ev = read_signals(signal_fd, tty_fd);
+                break;
+
+            case URING_PID:
+                if (ev == PTY_RUNNING)
+                    ev = PTY_EXITED;
+                break;
+
+            default:
                 break;
             }
+        }
+
+        if (ev == PTY_RUNNING)
+            continue;
+
+        /* the relays can only be handed back once the kernel is done with
+         * their buffers */
+        if (!cancelling) {
+            uring_cancel(u, busy);
+            cancelling = true;
+        }
+
+        if (!uring_busy(busy))
+            return ev;
+    }
+}
+
+void process_pipes(int pidfd, int out_fd, int err_fd) {
+    int rc, n;
+
+    sigset_t mask;
+
+    _close_ int epoll_fd  = -1;
+    _close_ int signal_fd = -1;
+
+    struct epoll_event ev, events[4];
+
+    struct pipe_log logs[] = {
+        { .fd = out_fd, .prio = LOG_INFO },
+        { .fd = err_fd, .prio = LOG_ERR  },
+    };
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGRTMIN + 4);
+
+    if (pidfd < 0)
+        sigaddset(&mask, SIGCHLD);
+
+    rc = sigprocmask(SIG_BLOCK, &mask, NULL);
+    sys_fail_if(rc < 0, "sigprocmask()");
+
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    sys_fail_if(signal_fd < 0, "signalfd()");
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    sys_fail_if(epoll_fd < 0, "epoll_create1()");
+
+    ev.events = EPOLLIN; ev.data.fd = signal_fd;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+    sys_fail_if(rc < 0, "epoll_ctl(signal_fd)");
+
+    if (pidfd >= 0) {
+        ev.events = EPOLLIN; ev.data.fd = pidfd;
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+        sys_fail_if(rc < 0, "epoll_ctl(pidfd)");
+    }
+
+    /* the output of a detached container is forwarded to syslog, one
+     * message per line */
+    for (size_t i = 0; i < sizeof(logs) / sizeof(*logs); i++) {
+        if (logs[i].fd < 0)
+            continue;
+
+        set_nonblock(logs[i].fd, true);
+
+        ev.events = EPOLLIN; ev.data.fd = logs[i].fd;
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+        sys_fail_if(rc < 0, "epoll_ctl(pipe)");
+    }
 
-            case SIGINT:
-            case SIGTERM:
-            case SIGCHLD:
-                goto done;
+    while (1) {
+        do {
+            n = epoll_wait(epoll_fd, events, 4, -1);
+        } while ((n < 0) && (errno == EINTR));
+
+        sys_fail_if(n < 0, "epoll_wait()");
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == pidfd)
+                goto exited;
+
+            if (fd == signal_fd) {
+                struct signalfd_siginfo fdsi;
+
+                while (read(signal_fd, &fdsi, sizeof(fdsi)) == sizeof(fdsi)) {
+                    switch (fdsi.ssi_signo) {
+                    case SIGCHLD:
+                        goto exited;
+
+                    case SIGINT:
+                    case SIGTERM:
+                        goto done;
+                    }
+
+                    if (fdsi.ssi_signo == (unsigned int) SIGRTMIN + 4)
+                        goto done;
+                }
             }
 
-            if (fdsi.ssi_signo == (unsigned int) SIGRTMIN + 4)
-                goto done;
+            for (size_t j = 0; j < sizeof(logs) / sizeof(*logs); j++) {
+                if ((fd != logs[j].fd) || (read_log(&logs[j]) != 0))
+                    continue;
+
+                /* the write end is closed, but the child may still be
+                 * running */
+                rc = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+                sys_fail_if(rc < 0, "epoll_ctl(pipe)");
+
+                logs[j].fd = -1;
+            }
         }
     }
 
+exited:
+    for (size_t i = 0; i < sizeof(logs) / sizeof(*logs); i++) {
+        if (logs[i].fd < 0)
+            continue;
+
+        while (read_log(&logs[i]) > 0);
+    }
+
 done:
-    rc = tcsetattr(STDIN_FILENO, TCSANOW, &stdin_attr);
-    sys_fail_if(rc < 0, "tcsetattr()");
+    for (size_t i = 0; i < sizeof(logs) / sizeof(*logs); i++)
+        flush_log(&logs[i]);
 }
 
-void serve_pty(int fd) {
-    int rc;
+void serve_pty(int fd, int pidfd, struct relay_opts *opts) {
+    int rc, n;
     socklen_t addrlen;
 
     pid_t pid;
@@ -246,10 +717,18 @@ void serve_pty(int fd) {
 
     _free_ char *path = NULL;
 
-    struct epoll_event sock_ev, signal_ev, events[3];
+    struct epoll_event ev, events[16];
 
     struct sockaddr_un servaddr_un;
 
+    struct client *clients = NULL, *cl, *tmp;
+
+    struct ring ring;
+
+    size_t scrollback = opts ? opts->scrollback : 0;
+
+    struct logfile *log = opts ? opts->log : NULL;
+
     pid = getpid();
 
     memset(&servaddr_un, 0, sizeof(struct sockaddr_un));
@@ -268,87 +747,595 @@ void serve_pty(int fd) {
     servaddr_un.sun_path[0] = '\0';
     addrlen = offsetof(struct sockaddr_un, sun_path) + rc;
 
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     sys_fail_if(sock < 0, "socket()");
 
     rc = bind(sock, (struct sockaddr *) &servaddr_un, addrlen);
     sys_fail_if(rc < 0, "bind()");
 
-    rc = listen(sock, 1);
+    rc = listen(sock, SOMAXCONN);
     sys_fail_if(rc < 0, "listen()");
 
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
     sigaddset(&mask, SIGTERM);
-    sigaddset(&mask, SIGCHLD);
     sigaddset(&mask, SIGRTMIN + 4);
 
+    if (pidfd < 0)
+        sigaddset(&mask, SIGCHLD);
+
     rc = sigprocmask(SIG_BLOCK, &mask, NULL);
     sys_fail_if(rc < 0, "sigprocmask()");
 
     signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
     sys_fail_if(signal_fd < 0, "signalfd()");
 
+    set_nonblock(fd, true);
+
+    ring_init(&ring, scrollback > RING_SIZE ? scrollback : RING_SIZE);
+
     epoll_fd = epoll_create1(EPOLL_CLOEXEC);
     sys_fail_if(epoll_fd < 0, "epoll_create1()");
 
-    sock_ev.events = EPOLLIN; sock_ev.data.fd = sock;
-    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_ev.data.fd, &sock_ev);
-    sys_fail_if(rc < 0, "epoll_ctl(STDIN_FILENO)");
+    ev.events = EPOLLIN; ev.data.fd = sock;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+    sys_fail_if(rc < 0, "epoll_ctl(sock)");
 
-    signal_ev.events = EPOLLIN; signal_ev.data.fd = signal_fd;
-    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_ev.data.fd, &signal_ev);
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET; ev.data.fd = fd;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+    sys_fail_if(rc < 0, "epoll_ctl(master_fd)");
+
+    ev.events = EPOLLIN; ev.data.fd = signal_fd;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
     sys_fail_if(rc < 0, "epoll_ctl(signal_fd)");
 
+    if (pidfd >= 0) {
+        ev.events = EPOLLIN; ev.data.fd = pidfd;
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+        sys_fail_if(rc < 0, "epoll_ctl(pidfd)");
+    }
+
     while (1) {
+        bool pump_in = false, pump_out = false;
+
         do {
-            rc = epoll_wait(epoll_fd, events, 1, -1);
-        } while ((rc < 0) && (errno == EINTR));
+            n = epoll_wait(epoll_fd, events, 16, -1);
+        } while ((n < 0) && (errno == EINTR));
+
+        sys_fail_if(n < 0, "epoll_wait()");
 
-        sys_fail_if(rc < 0, "epoll_wait()");
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == sock) {
+                int conn;
 
-        if (events[0].data.fd == sock) {
-            socklen_t len;
-            struct ucred ucred;
+                while ((conn = accept4(sock, NULL, NULL, SOCK_NONBLOCK |
+                                       SOCK_CLOEXEC)) >= 0) {
+                    client_add(&clients, epoll_fd, conn);
+                }
 
-            _close_ int send_sock = -1;
+                sys_fail_if(errno != EAGAIN, "accept()");
+                continue;
+            }
+
+            if (events[i].data.fd == fd) {
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    pump_out = true;
+
+                if (events[i].events & EPOLLOUT)
+                    pump_in = true;
+
+                continue;
+            }
+
+            if (events[i].data.fd == pidfd)
+                goto exited;
 
-            send_sock = accept(sock, (struct sockaddr *) NULL,NULL);
-            sys_fail_if(send_sock < 0, "accept()");
+            if (events[i].data.fd == signal_fd) {
+                struct signalfd_siginfo fdsi;
+
+                while (read(signal_fd, &fdsi, sizeof(fdsi)) == sizeof(fdsi)) {
+                    switch (fdsi.ssi_signo) {
+                    case SIGCHLD:
+                        goto exited;
+
+                    case SIGINT:
+                    case SIGTERM:
+                        goto done;
+                    }
+
+                    if (fdsi.ssi_signo == (unsigned int) SIGRTMIN + 4)
+                        goto done;
+                }
+
+                continue;
+            }
 
-            len = sizeof(struct ucred);
-            rc = getsockopt(send_sock, SOL_SOCKET, SO_PEERCRED,
-                            &ucred, &len);
-            sys_fail_if(rc < 0, "getsockopt(SO_PEERCRED)");
+            DL_FOREACH_SAFE(clients, cl, tmp) {
+                if (cl->fd != events[i].data.fd)
+                    continue;
 
-            if (ucred.uid == geteuid())
-                send_fd(send_sock, fd);
+                rc = client_hello(cl, fd, &ring, scrollback);
+                if (rc <= 0) {
+                    if (rc < 0)
+                        client_del(&clients, cl);
+
+                    continue;
+                }
+
+                if (!client_flush(cl, &ring) ||
+                    (relay_pump(&cl->in) != RELAY_OPEN))
+                    client_del(&clients, cl);
+            }
+        }
+
+        if (pump_out && (fan_out(&clients, fd, &ring, log) != RELAY_OPEN))
+            goto exited;
+
+        if (pump_in) {
+            DL_FOREACH_SAFE(clients, cl, tmp) {
+                if (cl->hello_len < sizeof(cl->hello))
+                    continue;
+
+                if (relay_pump(&cl->in) != RELAY_OPEN)
+                    client_del(&clients, cl);
+            }
+        }
+    }
+
+exited:
+    /* the child is gone, pass its last output on to whoever is still
+     * attached */
+    fan_out(&clients, fd, &ring, log);
+
+done:
+    DL_FOREACH_SAFE(clients, cl, tmp) {
+        client_del(&clients, cl);
+    }
+
+    ring_free(&ring);
+}
+
+static bool scan_detach(void *data, const char *buf, size_t *len) {
+    return detach_scan(data, buf, len);
+}
+
+static bool scan_log(void *data, const char *buf, size_t *len) {
+    logfile_write(data, buf, *len);
+
+    return false;
+}
+
+static void flush_relay(struct relay *r) {
+    ssize_t rc;
+
+    while (relay_pending(r)) {
+        struct pollfd pfd = { .fd = r->out, .events = POLLOUT };
+
+        rc = relay_flush(r);
+        if (rc >= 0)
+            continue;
+
+        sys_fail_if(errno != EAGAIN && errno != EINTR, "write()");
+
+        poll(&pfd, 1, -1);
+    }
+}
+
+/* Returns the previous flags, to restore them later. */
+static int set_nonblock(int fd, bool nonblock) {
+    int rc;
+
+    int flags = fcntl(fd, F_GETFL);
+    sys_fail_if(flags < 0, "fcntl(F_GETFL)");
+
+    rc = fcntl(fd, F_SETFL, nonblock ? flags | O_NONBLOCK :
+                                       flags & ~O_NONBLOCK);
+    sys_fail_if(rc < 0, "fcntl(F_SETFL)");
+
+    return flags;
+}
+
+static enum pty_event read_signals(int signal_fd, int tty_fd) {
+    int rc;
+
+    struct signalfd_siginfo fdsi;
+
+    while (read(signal_fd, &fdsi, sizeof(fdsi)) == sizeof(fdsi)) {
+        switch (fdsi.ssi_signo) {
+        case SIGWINCH: {
+            struct winsize ws;
+
+            rc = ioctl(STDIN_FILENO,TIOCGWINSZ,&ws);
+            sys_fail_if(rc < 0, "ioctl()");
+
+            if (tty_fd < 0) {
+                send_resize(attach_pid, &ws);
+                break;
+            }
+
+            rc = ioctl(tty_fd, TIOCSWINSZ, &ws);
+            sys_fail_if(rc < 0, "ioctl()");
+
+            break;
+        }
+
+        case SIGCHLD:
+            return PTY_EXITED;
+
+        case SIGINT:
+        case SIGTERM:
+            return PTY_DONE;
+        }
+
+        if (fdsi.ssi_signo == (unsigned int) SIGRTMIN + 4)
+            return PTY_DONE;
+    }
+
+    return PTY_RUNNING;
+}
+
+static bool uring_open_relay(struct uring *u) {
+    if (uring_init(u, 16) < 0)
+        return false;
+
+    if (uring_supports(u, IORING_OP_READ) &&
+        uring_supports(u, IORING_OP_WRITE) &&
+        uring_supports(u, IORING_OP_POLL_ADD) &&
+        uring_supports(u, IORING_OP_ASYNC_CANCEL))
+        return true;
+
+    uring_free(u);
+    return false;
+}
+
+static void uring_queue_read(struct uring *u, struct relay *r,
+                             enum uring_op op, bool *busy) {
+    struct io_uring_sqe *sqe;
+
+    bool writing = busy[op == URING_READ_IN ? URING_WRITE_IN :
+                                              URING_WRITE_OUT];
+
+    if (busy[op])
+        return;
+
+    /* no request is using the buffer, so it can be rearranged */
+    if (!r->pending)
+        r->start = r->end = 0;
+
+    if ((r->end == r->size) && !writing) {
+        memmove(r->buf, r->buf + r->start, r->pending);
+
+        r->start = 0;
+        r->end   = r->pending;
+    }
+
+    if (r->end == r->size)
+        return;
+
+    sqe = uring_get_sqe(u);
+    if (!sqe)
+        return;
+
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = r->in;
+    sqe->addr      = (uintptr_t) (r->buf + r->end);
+    sqe->len       = r->size - r->end;
+    sqe->off       = (uint64_t) -1;
+    sqe->user_data = op;
+
+    busy[op] = true;
+}
+
+static void uring_queue_write(struct uring *u, struct relay *r,
+                              enum uring_op op, bool *busy) {
+    struct io_uring_sqe *sqe;
+
+    if (busy[op] || !r->pending)
+        return;
+
+    sqe = uring_get_sqe(u);
+    if (!sqe)
+        return;
+
+    sqe->opcode    = IORING_OP_WRITE;
+    sqe->fd        = r->out;
+    sqe->addr      = (uintptr_t) (r->buf + r->start);
+    sqe->len       = r->pending;
+    sqe->off       = (uint64_t) -1;
+    sqe->user_data = op;
+
+    busy[op] = true;
+}
+
+static void uring_queue_poll(struct uring *u, int fd, enum uring_op op,
+                             bool *busy) {
+    struct io_uring_sqe *sqe;
+
+    if ((fd < 0) || busy[op])
+        return;
+
+    sqe = uring_get_sqe(u);
+    if (!sqe)
+        return;
+
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data     = op;
+
+    busy[op] = true;
+}
+
+/* Ask the kernel to give up on all the requests still in flight. */
+static void uring_cancel(struct uring *u, bool *busy) {
+    struct io_uring_sqe *sqe;
+
+    for (int op = 0; op < URING_CANCEL; op++) {
+        if (!busy[op])
+            continue;
+
+        sqe = uring_get_sqe(u);
+        fail_if(!sqe, "io_uring submission queue full");
+
+        sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe->addr      = op;
+        sqe->user_data = URING_CANCEL;
+    }
+}
+
+static bool uring_busy(bool *busy) {
+    for (int op = 0; op < URING_CANCEL; op++) {
+        if (busy[op])
+            return true;
+    }
+
+    return false;
+}
+
+static bool uring_read_done(struct relay *r, int len) {
+    size_t keep = len;
+
+    r->end     += len;
+    r->pending += len;
+
+    if (!r->scan || !r->scan(r->data, r->buf + r->end - len, &keep))
+        return false;
+
+    /* what was read before the match is still passed on */
+    r->end     -= len - keep;
+    r->pending -= len - keep;
+
+    return true;
+}
+
+static void uring_write_done(struct relay *r, int len) {
+    r->start   += len;
+    r->pending -= len;
+    r->bytes   += len;
+}
+
+static ssize_t read_log(struct pipe_log *l) {
+    char *nl;
+
+    ssize_t rc = read(l->fd, l->buf + l->len, sizeof(l->buf) - l->len - 1);
+    if (rc <= 0)
+        return rc;
+
+    l->len += rc;
+
+    while ((nl = memchr(l->buf, '\n', l->len)) != NULL) {
+        *nl = '\0';
+
+        syslog(l->prio, "%s", l->buf);
+
+        l->len -= nl + 1 - l->buf;
+        memmove(l->buf, nl + 1, l->len);
+    }
+
+    /* overlong lines are split */
+    if (l->len == sizeof(l->buf) - 1)
+        flush_log(l);
+
+    return rc;
+}
+
+static void flush_log(struct pipe_log *l) {
+    if (l->len == 0)
+        return;
+
+    l->buf[l->len] = '\0';
+
+    syslog(l->prio, "%s", l->buf);
+
+    l->len = 0;
+}
+
+/* The size of the terminal goes on a connection of its own, so that it
+ * doesn't have to be told apart from the input. */
+static void send_resize(pid_t pid, struct winsize *ws) {
+    ssize_t rc;
+
+    _close_ int sock = connect_pty(pid);
+
+    struct attach_msg msg = { .type = ATTACH_RESIZE, .ws = *ws };
+
+    rc = send(sock, &msg, sizeof(msg), MSG_NOSIGNAL);
+    if (rc < 0)
+        err_printf("Error resizing the terminal: %s", strerror(errno));
+}
+
+static void client_add(struct client **clients, int epoll_fd, int fd) {
+    int rc;
+    socklen_t len;
+
+    struct ucred ucred;
+    struct epoll_event ev;
+
+    struct client *cl;
+
+    len = sizeof(struct ucred);
+    rc = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &ucred, &len);
+    sys_fail_if(rc < 0, "getsockopt(SO_PEERCRED)");
+
+    if (ucred.uid != geteuid()) {
+        close(fd);
+        return;
+    }
+
+    cl = calloc(1, sizeof(*cl));
+    fail_if(!cl, "OOM");
+
+    cl->fd = fd;
+
+    /* not a relay yet, until the client says what it's there for */
+    relay_init(&cl->in, -1, -1, false);
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET; ev.data.fd = fd;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+    sys_fail_if(rc < 0, "epoll_ctl(client)");
+
+    DL_APPEND(*clients, cl);
+}
+
+/* Read the first message of the client. Returns 1 once it's attached, 0 if
+ * the message hasn't been received in full yet, and -1 if the client has to
+ * be disconnected, which is also the case once a resize is done. */
+static int client_hello(struct client *cl, int master_fd, struct ring *ring,
+                        size_t scrollback) {
+    ssize_t rc;
+
+    if (cl->hello_len == sizeof(cl->hello))
+        return 1;
+
+    while (cl->hello_len < sizeof(cl->hello)) {
+        rc = read(cl->fd, (char *) &cl->hello + cl->hello_len,
+                  sizeof(cl->hello) - cl->hello_len);
+        if (rc > 0) {
+            cl->hello_len += rc;
+            continue;
+        }
+
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        return (rc < 0 && errno == EAGAIN) ? 0 : -1;
+    }
+
+    if ((cl->hello.type != ATTACH_DATA) && (cl->hello.type != ATTACH_RESIZE))
+        return -1;
+
+    if (cl->hello.ws.ws_row && cl->hello.ws.ws_col)
+        ioctl(master_fd, TIOCSWINSZ, &cl->hello.ws);
+
+    if (cl->hello.type == ATTACH_RESIZE)
+        return -1;
+
+    /* start by replaying the most recent output */
+    cl->pos = ring->head > scrollback ? ring->head - scrollback : 0;
+    if (cl->pos < ring_tail(ring))
+        cl->pos = ring_tail(ring);
+
+    relay_free(&cl->in);
+    relay_init(&cl->in, cl->fd, master_fd, false);
+
+    return 1;
+}
+
+static void client_del(struct client **clients, struct client *cl) {
+    DL_DELETE(*clients, cl);
+
+    close(cl->fd);
+
+    relay_free(&cl->in);
+
+    free(cl);
+}
+
+static bool client_flush(struct client *cl, struct ring *ring) {
+    ssize_t rc;
+
+    while (cl->pos < ring->head) {
+        rc = write(cl->fd, ring_at(ring, cl->pos), ring->head - cl->pos);
+        if (rc > 0)
+            cl->pos += rc;
+
+        if (rc >= 0 || errno == EINTR)
+            continue;
+
+        return errno == EAGAIN;
+    }
+
+    return true;
+}
+
+/* Read the output of the container into the scrollback ring, whether anybody
+ * is attached or not, and send it on to the attached clients. Clients that
+ * fall behind by more than the size of the ring are disconnected, instead of
+ * slowing down the container and the other clients. */
+static enum relay_state fan_out(struct client **clients, int master_fd,
+                                struct ring *ring, struct logfile *log) {
+    ssize_t rc;
+
+    struct client *cl, *tmp;
+
+    while (1) {
+        rc = ring_fill(ring, master_fd, RING_CHUNK);
+        if (rc == 0)
+            return RELAY_EOF;
+
+        if (rc < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+
+            case EAGAIN:
+                if (log)
+                    logfile_flush(log);
+
+                return RELAY_OPEN;
+
+            case EIO:
+                return RELAY_EOF;
+
+            default:
+                sysf_printf("read()");
+            }
         }
 
-        if (events[0].data.fd == signal_fd) {
-            struct signalfd_siginfo fdsi;
+        if (log)
+            logfile_write(log, ring_at(ring, ring->head - rc), rc);
 
-            rc = read(signal_fd, &fdsi, sizeof(fdsi));
-            sys_fail_if(rc != sizeof(fdsi), "read()");
+        DL_FOREACH_SAFE(*clients, cl, tmp) {
+            if (cl->hello_len < sizeof(cl->hello))
+                continue;
 
-            switch (fdsi.ssi_signo) {
-            case SIGINT:
-            case SIGTERM:
-            case SIGCHLD:
-                return;
+            if (cl->pos < ring_tail(ring)) {
+                err_printf("Disconnecting client that can't keep up");
+                client_del(clients, cl);
+                continue;
             }
 
-            if (fdsi.ssi_signo == (unsigned int) SIGRTMIN + 4)
-                return;
+            if (!client_flush(cl, ring))
+                client_del(clients, cl);
         }
     }
 }
 
-int recv_pty(pid_t pid) {
+static uint64_t now_ns(void) {
+    int rc;
+    struct timespec ts;
+
+    rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+    sys_fail_if(rc < 0, "clock_gettime()");
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int connect_pty(pid_t pid) {
     int rc;
     socklen_t addrlen;
 
-    _close_ int sock = -1;
+    int sock;
 
     _free_ char *path = NULL;
 
@@ -368,18 +1355,16 @@ int recv_pty(pid_t pid) {
     servaddr_un.sun_path[0] = '\0';
     addrlen = offsetof(struct sockaddr_un, sun_path) + rc;
 
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
     sys_fail_if(sock < 0, "socket()");
 
     rc = connect(sock, (struct sockaddr *) &servaddr_un, addrlen);
     sys_fail_if(rc < 0, "connect()");
 
-    return recv_fd(sock);
+    return sock;
 }
 
-static void send_fd(int sock, int fd) {
-    int rc;
-
+int send_fd(int sock, int fd) {
     union {
         struct cmsghdr cmsg;
         char           control[CMSG_SPACE(sizeof(int))];
@@ -411,11 +1396,10 @@ static void send_fd(int sock, int fd) {
 
     memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
 
-    rc = sendmsg(sock, &msg, 0);
-    sys_fail_if(rc < 0, "sendmsg()");
+    return sendmsg(sock, &msg, MSG_NOSIGNAL);
 }
 
-static int recv_fd(int sock) {
+int recv_fd(int sock) {
     int rc;
 
     union {
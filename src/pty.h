@@ -28,10 +28,17 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+struct relay_opts;
+
 void open_master_pty(int *master_fd, char **master_name);
 void open_slave_pty(const char *master_name);
+void open_pipe(int *read_fd, int *write_fd);
+
+void process_pty(int master_fd, int pidfd, struct relay_opts *opts);
+void process_pipes(int pidfd, int out_fd, int err_fd);
 
-void process_pty(int master_fd);
+void serve_pty(int fd, int pidfd, struct relay_opts *opts);
+void attach_pty(pid_t pid, struct relay_opts *opts);
 
-void serve_pty(int fd);
-int recv_pty(pid_t pid);
+int send_fd(int sock, int fd);
+int recv_fd(int sock);
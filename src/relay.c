@@ -0,0 +1,413 @@
+/*
+ * The process in the flask.
+ *
+ * Copyright (c) 2013, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/sendfile.h>
+
+#include "relay.h"
+#include "printf.h"
+#include "util.h"
+
+#define RELAY_SIZE (256 * 1024)
+
+static bool relay_use_copy(struct relay *r);
+static bool relay_make_room(struct relay *r);
+static ssize_t relay_flush_spill(struct relay *r);
+
+void relay_init(struct relay *r, int in, int out, bool splice) {
+    int rc;
+
+    memset(r, 0, sizeof(*r));
+
+    r->in  = in;
+    r->out = out;
+
+    r->pipe[0] = -1;
+    r->pipe[1] = -1;
+
+    r->spill_fd = -1;
+
+    r->size = RELAY_SIZE;
+
+    /* the data only goes through userspace when it has to be looked at,
+     * or when one of the endpoints doesn't support splice() (see
+     * relay_use_copy()) */
+    if (splice) {
+        rc = pipe2(r->pipe, O_CLOEXEC | O_NONBLOCK);
+        sys_fail_if(rc < 0, "pipe2()");
+
+        /* this is capped by /proc/sys/fs/pipe-max-size */
+        fcntl(r->pipe[1], F_SETPIPE_SZ, RELAY_SIZE);
+
+        rc = fcntl(r->pipe[1], F_GETPIPE_SZ);
+        sys_fail_if(rc < 0, "fcntl(F_GETPIPE_SZ)");
+
+        r->size = rc;
+        return;
+    }
+
+    r->buf = malloc(r->size);
+    fail_if(!r->buf, "OOM");
+}
+
+void relay_free(struct relay *r) {
+    closep(&r->pipe[0]);
+    closep(&r->pipe[1]);
+
+    closep(&r->spill_fd);
+
+    freep(&r->buf);
+}
+
+/* Bound the relay's buffer to size bytes and choose what happens when it's
+ * full: RELAY_POLICY_BLOCK stops reading the input until the output catches
+ * up, RELAY_POLICY_DROP discards the oldest data and writes a marker in its
+ * place, and RELAY_POLICY_SPILL moves the data to a temporary file. Only copy
+ * mode relays can drop or spill, and this must be called before the relay is
+ * used. */
+void relay_set_policy(struct relay *r, enum relay_policy policy,
+                      size_t size) {
+    int rc;
+
+    r->policy = policy;
+
+    if (!r->buf) {
+        fail_if(policy != RELAY_POLICY_BLOCK, "Invalid relay policy");
+
+        fcntl(r->pipe[1], F_SETPIPE_SZ, size);
+
+        rc = fcntl(r->pipe[1], F_GETPIPE_SZ);
+        sys_fail_if(rc < 0, "fcntl(F_GETPIPE_SZ)");
+
+        r->size = rc;
+        return;
+    }
+
+    freep(&r->buf);
+
+    r->size = size;
+
+    r->buf = malloc(r->size);
+    fail_if(!r->buf, "OOM");
+}
+
+/* How much data is waiting to be written, including the spilled data. */
+size_t relay_pending(struct relay *r) {
+    return r->pending + (r->spill_end - r->spill_off);
+}
+
+ssize_t relay_fill(struct relay *r) {
+    ssize_t rc;
+
+    if ((r->pending == r->size) && !relay_make_room(r)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (r->buf) {
+        if (r->end == r->size) {
+            memmove(r->buf, r->buf + r->start, r->pending);
+
+            r->start = 0;
+            r->end   = r->pending;
+        }
+
+        rc = read(r->in, r->buf + r->end, r->size - r->end);
+        if (rc > 0) {
+            r->end     += rc;
+            r->pending += rc;
+        }
+
+        return rc;
+    }
+
+    rc = splice(r->in, NULL, r->pipe[1], NULL, r->size - r->pending,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if ((rc < 0) && (errno == EINVAL) && relay_use_copy(r))
+        return relay_fill(r);
+
+    if (rc > 0)
+        r->pending += rc;
+
+    return rc;
+}
+
+ssize_t relay_flush(struct relay *r) {
+    ssize_t rc;
+
+    /* the spilled data is older than what's in the buffer */
+    if (r->spill_off < r->spill_end)
+        return relay_flush_spill(r);
+
+    if (!r->pending)
+        return 0;
+
+    if (r->dropped && !r->note_len) {
+        r->note_len = snprintf(r->note, sizeof(r->note),
+                               "\r\n[pflask: %" PRIu64 " bytes dropped]\r\n",
+                               r->dropped);
+        r->note_off = 0;
+        r->dropped  = 0;
+    }
+
+    if (r->note_len) {
+        rc = write(r->out, r->note + r->note_off,
+                   r->note_len - r->note_off);
+        if ((rc > 0) && ((r->note_off += rc) == r->note_len))
+            r->note_len = 0;
+
+        return rc;
+    }
+
+    if (r->buf) {
+        rc = write(r->out, r->buf + r->start, r->pending);
+        if (rc > 0) {
+            r->start   += rc;
+            r->pending -= rc;
+            r->bytes   += rc;
+
+            if (!r->pending)
+                r->start = r->end = 0;
+        }
+
+        return rc;
+    }
+
+    rc = splice(r->pipe[0], NULL, r->out, NULL, r->pending,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if ((rc < 0) && (errno == EINVAL) && relay_use_copy(r))
+        return relay_flush(r);
+
+    if (rc > 0) {
+        r->pending -= rc;
+        r->bytes   += rc;
+    }
+
+    return rc;
+}
+
+/* Write out the pending data until the output would block. */
+void relay_drain(struct relay *r) {
+    ssize_t rc;
+
+    while (relay_pending(r)) {
+        rc = relay_flush(r);
+        if (rc >= 0 || errno == EINTR)
+            continue;
+
+        sys_fail_if(errno != EAGAIN, "Error writing output");
+        break;
+    }
+}
+
+/* Move data from the input to the output until one of them would block
+ * (both are expected to be non-blocking), or the output buffer is full. */
+enum relay_state relay_pump(struct relay *r) {
+    ssize_t rc;
+
+    while (1) {
+        relay_drain(r);
+
+        if ((r->pending == r->size) && (r->policy == RELAY_POLICY_BLOCK))
+            return RELAY_OPEN;
+
+        rc = relay_fill(r);
+        if (rc > 0) {
+            size_t len = rc;
+
+            if (r->scan && r->buf &&
+                r->scan(r->data, r->buf + r->end - rc, &len)) {
+                /* what was read before the match is still passed on */
+                r->end     -= rc - len;
+                r->pending -= rc - len;
+
+                relay_drain(r);
+                return RELAY_STOP;
+            }
+
+            continue;
+        }
+
+        if (rc == 0)
+            return RELAY_EOF;
+
+        switch (errno) {
+        case EINTR:
+            continue;
+
+        case EAGAIN:
+            return RELAY_OPEN;
+
+        /* the other side of a pty or socket was closed */
+        case EIO:
+        case ECONNRESET:
+            return RELAY_EOF;
+
+        default:
+            sysf_printf("Error reading input");
+        }
+    }
+}
+
+void relay_report(struct relay *in, struct relay *out, uint64_t ns) {
+    double secs = ns / 1e9;
+
+    debug_printf("Relayed %" PRIu64 " bytes in (%.2f MB/s, %s), "
+                 "%" PRIu64 " bytes out (%.2f MB/s, %s)",
+                 in->bytes, secs ? in->bytes / secs / 1e6 : 0,
+                 in->buf ? "copy" : "splice",
+                 out->bytes, secs ? out->bytes / secs / 1e6 : 0,
+                 out->buf ? "copy" : "splice");
+}
+
+/* Switch a splice() relay to copy mode, moving to the new buffer whatever
+ * is still sitting in the pipe. */
+static bool relay_use_copy(struct relay *r) {
+    ssize_t rc;
+
+    if (r->buf)
+        return false;
+
+    r->buf = malloc(r->size);
+    fail_if(!r->buf, "OOM");
+
+    r->start = 0;
+    r->end   = 0;
+
+    while (r->end < r->pending) {
+        rc = read(r->pipe[0], r->buf + r->end, r->pending - r->end);
+        sys_fail_if(rc <= 0, "Error draining relay pipe");
+
+        r->end += rc;
+    }
+
+    closep(&r->pipe[0]);
+    closep(&r->pipe[1]);
+
+    return true;
+}
+
+/* Make room in a full buffer according to the relay's policy. */
+static bool relay_make_room(struct relay *r) {
+    int rc;
+
+    size_t len;
+
+    const char *tmp;
+
+    switch (r->policy) {
+    case RELAY_POLICY_BLOCK:
+        return false;
+
+    /* a quarter of the buffer goes at once, so that the data isn't
+     * dropped a few bytes at a time */
+    case RELAY_POLICY_DROP:
+        len = r->size / 4;
+
+        r->start   += len;
+        r->pending -= len;
+        r->dropped += len;
+        return true;
+
+    case RELAY_POLICY_SPILL:
+        if (r->spill_fd < 0) {
+            tmp = getenv("TMPDIR");
+            if (!tmp)
+                tmp = "/tmp";
+
+            r->spill_fd = open(tmp, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+
+            /* not every filesystem supports O_TMPFILE */
+            if ((r->spill_fd < 0) && (errno == EOPNOTSUPP)) {
+                _free_ char *path = NULL;
+
+                rc = asprintf(&path, "%s/pflask-spill-XXXXXX", tmp);
+                fail_if(rc < 0, "OOM");
+
+                r->spill_fd = mkostemp(path, O_CLOEXEC);
+                if (r->spill_fd >= 0)
+                    unlink(path);
+            }
+
+            sys_fail_if(r->spill_fd < 0, "Error creating spill file in '%s'",
+                        tmp);
+        }
+
+        while (r->pending) {
+            rc = pwrite(r->spill_fd, r->buf + r->start, r->pending,
+                        r->spill_end);
+            if ((rc < 0) && (errno == EINTR))
+                continue;
+
+            sys_fail_if(rc < 0, "Error writing spill file");
+
+            r->start     += rc;
+            r->pending   -= rc;
+            r->spill_end += rc;
+        }
+
+        r->start = r->end = 0;
+        return true;
+    }
+
+    return false;
+}
+
+static ssize_t relay_flush_spill(struct relay *r) {
+    int rc;
+    ssize_t len;
+
+    len = sendfile(r->out, r->spill_fd, &r->spill_off,
+                   r->spill_end - r->spill_off);
+    if (len <= 0)
+        return len;
+
+    r->bytes += len;
+
+    /* everything was written out, so the file can start over */
+    if (r->spill_off == r->spill_end) {
+        rc = ftruncate(r->spill_fd, 0);
+        sys_fail_if(rc < 0, "Error truncating spill file");
+
+        r->spill_off = r->spill_end = 0;
+    }
+
+    return len;
+}
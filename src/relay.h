@@ -0,0 +1,127 @@
+/*
+ * The process in the flask.
+ *
+ * Copyright (c) 2013, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+enum relay_policy {
+    RELAY_POLICY_BLOCK,
+    RELAY_POLICY_DROP,
+    RELAY_POLICY_SPILL,
+};
+
+struct relay {
+    int in;
+    int out;
+
+    /* splice() mode */
+    int pipe[2];
+
+    /* copy mode */
+    char *buf;
+    size_t start;
+    size_t end;
+
+    size_t size;
+    size_t pending;
+
+    uint64_t bytes;
+
+    /* what to do when the buffer is full, see relay_set_policy() */
+    enum relay_policy policy;
+
+    /* data discarded by RELAY_POLICY_DROP that still has to be reported
+     * with a marker, and the marker being written */
+    uint64_t dropped;
+    char note[64];
+    size_t note_len;
+    size_t note_off;
+
+    /* data moved to a temporary file by RELAY_POLICY_SPILL, which still
+     * has to be written between spill_off and spill_end */
+    int spill_fd;
+    off_t spill_off;
+    off_t spill_end;
+
+    /* called on the data read by a copy mode relay, before it's written
+     * out; returning true stops the relay, once the first len bytes (as
+     * set by the callback) have been written */
+    bool (*scan)(void *data, const char *buf, size_t *len);
+    void *data;
+};
+
+enum relay_state {
+    RELAY_OPEN,
+    RELAY_EOF,
+    RELAY_STOP,
+};
+
+enum relay_engine {
+    RELAY_ENGINE_AUTO,
+    RELAY_ENGINE_EPOLL,
+    RELAY_ENGINE_URING,
+};
+
+struct logfile;
+struct detach;
+
+struct relay_opts {
+    bool stats;
+
+    enum relay_engine engine;
+
+    /* how much of the container's output is buffered, and what happens
+     * once the terminal falls that far behind */
+    enum relay_policy policy;
+    size_t buffer;
+
+    /* the key sequence that detaches from the container, NULL if there
+     * is none */
+    struct detach *detach;
+
+    /* where to keep a copy of the output, if anywhere */
+    struct logfile *log;
+
+    /* how much of the recent output of a detached container is replayed
+     * to a client when it attaches */
+    size_t scrollback;
+};
+
+void relay_init(struct relay *r, int in, int out, bool splice);
+void relay_free(struct relay *r);
+
+void relay_set_policy(struct relay *r, enum relay_policy policy,
+                      size_t size);
+size_t relay_pending(struct relay *r);
+
+ssize_t relay_fill(struct relay *r);
+ssize_t relay_flush(struct relay *r);
+void relay_drain(struct relay *r);
+
+enum relay_state relay_pump(struct relay *r);
+
+void relay_report(struct relay *in, struct relay *out, uint64_t ns);
@@ -0,0 +1,101 @@
+/*
+ * The process in the flask.
+ *
+ * Copyright (c) 2013, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "ring.h"
+#include "printf.h"
+#include "util.h"
+
+/* The ring buffer is mapped twice in a row, so that any size bytes starting
+ * anywhere in the first mapping are contiguous in memory and the data never
+ * needs to be split when it wraps around. */
+void ring_init(struct ring *r, size_t size) {
+    int rc;
+    void *addr;
+
+    _close_ int fd = -1;
+
+    long page = sysconf(_SC_PAGESIZE);
+
+    r->size = (size + page - 1) / page * page;
+    r->head = 0;
+
+    fd = memfd_create("pflask-ring", MFD_CLOEXEC);
+    sys_fail_if(fd < 0, "memfd_create()");
+
+    rc = ftruncate(fd, r->size);
+    sys_fail_if(rc < 0, "ftruncate()");
+
+    r->buf = mmap(NULL, 2 * r->size, PROT_NONE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    sys_fail_if(r->buf == MAP_FAILED, "mmap()");
+
+    addr = mmap(r->buf, r->size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0);
+    sys_fail_if(addr == MAP_FAILED, "mmap()");
+
+    addr = mmap(r->buf + r->size, r->size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0);
+    sys_fail_if(addr == MAP_FAILED, "mmap()");
+}
+
+void ring_free(struct ring *r) {
+    if (r->buf)
+        munmap(r->buf, 2 * r->size);
+
+    r->buf = NULL;
+}
+
+/* Read at most len bytes from fd, overwriting the oldest data once the ring
+ * is full. */
+ssize_t ring_fill(struct ring *r, int fd, size_t len) {
+    ssize_t rc;
+
+    if (len > r->size)
+        len = r->size;
+
+    rc = read(fd, r->buf + r->head % r->size, len);
+    if (rc > 0)
+        r->head += rc;
+
+    return rc;
+}
+
+uint64_t ring_tail(struct ring *r) {
+    return r->head > r->size ? r->head - r->size : 0;
+}
+
+const char *ring_at(struct ring *r, uint64_t pos) {
+    return r->buf + pos % r->size;
+}
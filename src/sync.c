@@ -28,7 +28,6 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <fcntl.h>
 #include <unistd.h>
 
 #include <sys/types.h>
@@ -40,12 +39,12 @@
 int sync_init(int fd[2]) {
     int rc;
 
-    rc = socketpair(AF_LOCAL, SOCK_STREAM, 0, fd);
+    /* the child's end is closed on exec, which the parent can detect,
+     * while the parent's end must not leak into containers spawned
+     * later on by the same process */
+    rc = socketpair(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, fd);
     sys_fail_if(rc < 0, "Error creating socket pair");
 
-    rc = fcntl(fd[0], F_SETFD, FD_CLOEXEC);
-    sys_fail_if(rc < 0, "Error setting FD_CLOEXEC");
-
     return 0;
 }
 
@@ -56,8 +55,9 @@ static int sync_wait(int fd, int seq) {
     rc = read(fd, &sync, sizeof(sync));
     sys_fail_if(rc < 0, "Error reading from socket");
 
+    /* the other end was closed */
     if (!rc)
-        return 0;
+        return -1;
 
     if (sync != seq)
         fail_printf("Invalid sync sequence: %d != %d", seq, sync);
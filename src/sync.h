@@ -31,6 +31,7 @@
 enum {
     SYNC_START,
     SYNC_DONE,
+    SYNC_READY,
 };
 
 int sync_init(int fd[2]);
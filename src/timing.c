@@ -0,0 +1,186 @@
+/*
+ * The process in the flask.
+ *
+ * Copyright (c) 2013, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "printf.h"
+#include "util.h"
+
+#define TIMING_MAX_PHASES 64
+
+struct timing_phase {
+    const char *name;
+    bool child;
+
+    uint64_t begin;
+    uint64_t end;
+};
+
+struct timing {
+    uint64_t start;
+    unsigned int count;
+
+    struct timing_phase phases[TIMING_MAX_PHASES];
+};
+
+/* The table is shared between the parent and the child, so that the child
+ * can report the phases run by the parent while it was waiting for it. */
+static struct timing *timings = NULL;
+
+static int timing_fd = -1;
+static pid_t timing_pid = -1;
+
+static uint64_t timing_now(void);
+
+void timing_init(const char *path) {
+    if (path && strcmp(path, "-")) {
+        timing_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                         0644);
+        sys_fail_if(timing_fd < 0, "Error opening file '%s'", path);
+    } else {
+        timing_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+        sys_fail_if(timing_fd < 0, "fcntl(F_DUPFD_CLOEXEC)");
+    }
+
+    timings = mmap(NULL, sizeof(*timings), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    sys_fail_if(timings == MAP_FAILED, "mmap()");
+
+    timing_pid = getpid();
+
+    timings->start = timing_now();
+    timings->count = 0;
+}
+
+void timing_begin(const char *phase) {
+    unsigned int i;
+
+    if (!timings)
+        return;
+
+    i = __sync_fetch_and_add(&timings->count, 1);
+    if (i >= TIMING_MAX_PHASES)
+        return;
+
+    timings->phases[i].name  = phase;
+    timings->phases[i].child = getpid() != timing_pid;
+    timings->phases[i].begin = timing_now();
+    timings->phases[i].end   = 0;
+}
+
+void timing_end(const char *phase) {
+    unsigned int i;
+
+    bool child = getpid() != timing_pid;
+
+    uint64_t now = timing_now();
+
+    if (!timings)
+        return;
+
+    i = MIN(timings->count, TIMING_MAX_PHASES);
+
+    while (i-- > 0) {
+        struct timing_phase *p = &timings->phases[i];
+
+        if (p->child != child || p->end || strcmp(p->name, phase))
+            continue;
+
+        p->end = now;
+        break;
+    }
+}
+
+void timing_report(void) {
+    int rc;
+
+    unsigned int i, count;
+
+    uint64_t now;
+
+    FILE *out = NULL;
+
+    _free_ char *buf = NULL;
+    size_t len = 0;
+
+    if (!timings)
+        return;
+
+    now = timing_now();
+
+    out = open_memstream(&buf, &len);
+    sys_fail_if(!out, "open_memstream()");
+
+    fprintf(out, "{\"pid\":%d,\"clock\":\"monotonic\",\"start_ns\":%llu,"
+                 "\"phases\":[", timing_pid,
+                 (unsigned long long) timings->start);
+
+    count = MIN(timings->count, TIMING_MAX_PHASES);
+
+    for (i = 0; i < count; i++) {
+        struct timing_phase *p = &timings->phases[i];
+
+        uint64_t end = p->end ? p->end : now;
+
+        fprintf(out, "%s{\"name\":\"%s\",\"side\":\"%s\","
+                     "\"begin_ns\":%llu,\"duration_ns\":%llu}",
+                i ? "," : "", p->name, p->child ? "child" : "parent",
+                (unsigned long long) (p->begin - timings->start),
+                (unsigned long long) (end - p->begin));
+    }
+
+    fprintf(out, "],\"total_ns\":%llu}\n",
+            (unsigned long long) (now - timings->start));
+
+    rc = fclose(out);
+    sys_fail_if(rc != 0, "fclose()");
+
+    rc = write(timing_fd, buf, len);
+    sys_fail_if(rc < 0, "Error writing timings");
+}
+
+static uint64_t timing_now(void) {
+    int rc;
+    struct timespec ts;
+
+    rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+    sys_fail_if(rc < 0, "clock_gettime()");
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,199 @@
+/*
+ * The process in the flask.
+ *
+ * Copyright (c) 2013, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "printf.h"
+#include "util.h"
+
+/* A minimal io_uring wrapper, talking to the kernel directly so that
+ * liburing isn't needed. Only a single thread is expected to use a ring. */
+
+int uring_init(struct uring *u, unsigned int entries) {
+    struct io_uring_params p;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+
+    u->fd = -1;
+
+#ifdef __NR_io_uring_setup
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+#else
+    errno = ENOSYS;
+#endif
+    if (u->fd < 0)
+        return -1;
+
+    u->entries = p.sq_entries;
+
+    u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_ring_len = p.cq_off.cqes +
+                     p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_len    = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+        goto fail;
+
+    u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ring == MAP_FAILED)
+        goto fail;
+
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail;
+
+    u->sq_head  = (unsigned int *) ((char *) u->sq_ring + p.sq_off.head);
+    u->sq_tail  = (unsigned int *) ((char *) u->sq_ring + p.sq_off.tail);
+    u->sq_mask  = (unsigned int *) ((char *) u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *) ((char *) u->sq_ring + p.sq_off.array);
+
+    u->cq_head  = (unsigned int *) ((char *) u->cq_ring + p.cq_off.head);
+    u->cq_tail  = (unsigned int *) ((char *) u->cq_ring + p.cq_off.tail);
+    u->cq_mask  = (unsigned int *) ((char *) u->cq_ring + p.cq_off.ring_mask);
+
+    u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ring + p.cq_off.cqes);
+
+    u->sq_local = *u->sq_tail;
+
+    return 0;
+
+fail:
+    uring_free(u);
+    return -1;
+}
+
+void uring_free(struct uring *u) {
+    if (u->sq_ring && u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_len);
+
+    if (u->cq_ring && u->cq_ring != MAP_FAILED)
+        munmap(u->cq_ring, u->cq_ring_len);
+
+    if (u->sqes && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_len);
+
+    u->sq_ring = u->cq_ring = NULL;
+    u->sqes    = NULL;
+
+    closep(&u->fd);
+}
+
+/* Check whether the kernel knows about the given IORING_OP_*. */
+bool uring_supports(struct uring *u, unsigned int op) {
+    int rc;
+
+    _free_ struct io_uring_probe *probe = NULL;
+
+    probe = calloc(1, sizeof(*probe) + 256 * sizeof(probe->ops[0]));
+    fail_if(!probe, "OOM");
+
+#ifdef __NR_io_uring_register
+    rc = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE,
+                 probe, 256);
+#else
+    rc = -1;
+#endif
+    if (rc < 0)
+        return false;
+
+    return (op <= probe->last_op) &&
+           (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+/* Return a zeroed submission entry, or NULL if the queue is full. The entry
+ * is only passed to the kernel by the next uring_submit(). */
+struct io_uring_sqe *uring_get_sqe(struct uring *u) {
+    unsigned int head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    struct io_uring_sqe *sqe;
+
+    if (u->sq_local - head >= u->entries)
+        return NULL;
+
+    sqe = &u->sqes[u->sq_local & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+
+    u->sq_array[u->sq_local & *u->sq_mask] = u->sq_local & *u->sq_mask;
+    u->sq_local++;
+    u->sq_pending++;
+
+    return sqe;
+}
+
+/* Submit the queued entries, and wait for at least wait_nr completions. */
+int uring_submit(struct uring *u, unsigned int wait_nr) {
+    int rc;
+
+    unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+    __atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+
+    if (!u->sq_pending && !wait_nr)
+        return 0;
+
+    do {
+        rc = syscall(__NR_io_uring_enter, u->fd, u->sq_pending, wait_nr,
+                     flags, NULL, 0);
+    } while ((rc < 0) && (errno == EINTR));
+
+    if (rc >= 0)
+        u->sq_pending -= rc;
+
+    return rc;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *u) {
+    unsigned int head = *u->cq_head;
+
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &u->cqes[head & *u->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
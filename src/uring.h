@@ -0,0 +1,74 @@
+/*
+ * The process in the flask.
+ *
+ * Copyright (c) 2013, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct uring {
+    int fd;
+
+    unsigned int entries;
+
+    /* submission queue */
+    void *sq_ring;
+    size_t sq_ring_len;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    unsigned int sq_local;
+    unsigned int sq_pending;
+
+    /* completion queue */
+    void *cq_ring;
+    size_t cq_ring_len;
+
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+
+    struct io_uring_cqe *cqes;
+};
+
+int uring_init(struct uring *u, unsigned int entries);
+void uring_free(struct uring *u);
+
+bool uring_supports(struct uring *u, unsigned int op);
+
+struct io_uring_sqe *uring_get_sqe(struct uring *u);
+int uring_submit(struct uring *u, unsigned int wait_nr);
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *u);
+void uring_cqe_seen(struct uring *u);
@@ -36,6 +36,9 @@
 
 #include <pwd.h>
 #include <grp.h>
+#include <spawn.h>
+
+#include <sys/wait.h>
 
 #include "ut/utlist.h"
 
@@ -67,60 +70,142 @@ void user_add_map(struct user **users, char type, uid_t id, uid_t host_id,
     DL_APPEND(*users, usr);
 }
 
-void setup_user_map2(struct user *users, char type, pid_t pid) {
+static const char *get_map_cmd(char type) {
+    static bool resolved = false;
+    static char *uid_cmd = NULL, *gid_cmd = NULL;
+
+    /* $PATH is only scanned once, the same helpers are used for every
+     * container created by this process */
+    if (!resolved) {
+        uid_cmd = on_path("newuidmap", NULL);
+        gid_cmd = on_path("newgidmap", NULL);
+
+        resolved = true;
+    }
+
+    return type == 'u' ? uid_cmd : gid_cmd;
+}
+
+static pid_t spawn_user_map(struct user *users, char type, pid_t pid) {
     int rc;
 
-    struct user *i;
+    pid_t child;
 
-    _free_ char *map = strdup("");
+    size_t argc = 2;
+
+    struct user *i;
 
-    _free_ char *have_cmd = on_path("newuidmap", NULL);
+    char **argv = NULL;
 
-    if (!have_cmd && geteuid() != 0)
-        fail_printf("Unprivileged containers need the newuidmap/newgidmap executables");
+    const char *cmd = get_map_cmd(type);
+    fail_if(!cmd, "Unprivileged containers need the newuidmap/newgidmap executables");
 
     DL_FOREACH(users, i) {
-        char *tmp = NULL;
+        if (i->type == type)
+            argc += 3;
+    }
+
+    argv = calloc(argc + 1, sizeof(char *));
+    fail_if(!argv, "OOM");
 
+    argc = 0;
+
+    argv[argc++] = strdup(cmd);
+
+    rc = asprintf(&argv[argc++], "%u", pid);
+    fail_if(rc < 0, "OOM");
+
+    DL_FOREACH(users, i) {
         if (i->type != type)
             continue;
 
-        rc = asprintf(&tmp, "%s%u %u %lu%c", map,
-                      i->id, i->host_id, i->count,
-                      have_cmd ? ' ' : '\n');
+        rc = asprintf(&argv[argc++], "%u", i->id);
         fail_if(rc < 0, "OOM");
-        freep(&map);
 
-        map = tmp;
+        rc = asprintf(&argv[argc++], "%u", i->host_id);
+        fail_if(rc < 0, "OOM");
+
+        rc = asprintf(&argv[argc++], "%lu", i->count);
+        fail_if(rc < 0, "OOM");
     }
 
-    if (have_cmd != NULL) {
-        _free_ char *cmd = NULL;
+    rc = posix_spawn(&child, cmd, NULL, NULL, argv, environ);
+    if (rc != 0) {
+        errno = rc;
+        sysf_printf("Error executing '%s'", cmd);
+    }
 
-        rc = asprintf(&map, "new%cidmap %u %s", type, pid, map);
-        fail_if(rc < 0, "OOM");
+    for (size_t j = 0; j < argc; j++)
+        free(argv[j]);
 
-        rc = system(map);
-        fail_if(rc != 0, "new%cidmap returned %d", type, rc);
-    } else {
-        _close_ int map_fd = -1;
+    free(argv);
 
-        _free_ char *map_file = NULL;
+    return child;
+}
 
-        rc = asprintf(&map_file, "/proc/%d/%cid_map", pid, type);
-        fail_if(rc < 0, "OOM");
+static void wait_user_map(pid_t child, char type) {
+    int rc, status;
+
+    do {
+        rc = waitpid(child, &status, 0);
+    } while ((rc < 0) && (errno == EINTR));
 
-        map_fd = open(map_file, O_RDWR);
-        sys_fail_if(map_fd < 0, "Error opening file '%s'", map_file);
+    sys_fail_if(rc < 0, "Error waiting for new%cidmap", type);
 
-        rc = write(map_fd, map, strlen(map));
-        sys_fail_if(rc < 0, "Error writing to file '%s'", map_file);
+    fail_if(!WIFEXITED(status) || WEXITSTATUS(status),
+            "new%cidmap returned %d", type, WEXITSTATUS(status));
+}
+
+static void write_user_map(struct user *users, char type, pid_t pid) {
+    int rc;
+
+    struct user *i;
+
+    _close_ int map_fd = -1;
+
+    _free_ char *map = strdup("");
+    _free_ char *map_file = NULL;
+
+    DL_FOREACH(users, i) {
+        char *tmp = NULL;
+
+        if (i->type != type)
+            continue;
+
+        rc = asprintf(&tmp, "%s%u %u %lu\n", map,
+                      i->id, i->host_id, i->count);
+        fail_if(rc < 0, "OOM");
+        freep(&map);
+
+        map = tmp;
     }
+
+    rc = asprintf(&map_file, "/proc/%d/%cid_map", pid, type);
+    fail_if(rc < 0, "OOM");
+
+    map_fd = open(map_file, O_RDWR);
+    sys_fail_if(map_fd < 0, "Error opening file '%s'", map_file);
+
+    rc = write(map_fd, map, strlen(map));
+    sys_fail_if(rc < 0, "Error writing to file '%s'", map_file);
 }
 
 void setup_user_map(struct user *users, pid_t pid) {
-    setup_user_map2(users, 'u', pid);
-    setup_user_map2(users, 'g', pid);
+    pid_t uid_child, gid_child;
+
+    if (!get_map_cmd('u') && geteuid() == 0) {
+        write_user_map(users, 'u', pid);
+        write_user_map(users, 'g', pid);
+        return;
+    }
+
+    /* the uid and gid helpers don't depend on each other, so run them
+     * concurrently */
+    uid_child = spawn_user_map(users, 'u', pid);
+    gid_child = spawn_user_map(users, 'g', pid);
+
+    wait_user_map(uid_child, 'u');
+    wait_user_map(gid_child, 'g');
 }
 
 void setup_user(const char *user) {
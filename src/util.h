@@ -33,6 +33,8 @@
 
 #define MIN(a, b) ((a) > (b) ? (b) : (a))
 
+#define RUN_DIR "/run/pflask"
+
 #define fail_if_(cond, fmt, ...)                \
     do {                                        \
         if ((cond))                             \